@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+#include <numeric>
+
+#include "scran_norm/center_size_factors.hpp"
+#include "simulate.hpp"
+
+/*
+ * Arguments are:
+ * 0. number of cells.
+ * 1. number of blocks.
+ * 2. block mode; 0 = lowest, 1 = per-block.
+ */
+static void BM_CenterSizeFactorsBlocked(benchmark::State& state) {
+    size_t n = state.range(0);
+    auto sf = simulate_size_factors(n);
+    auto block = simulate_blocks(n, state.range(1));
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    opt.block_mode = (state.range(2) ? scran_norm::CenterBlockMode::PER_BLOCK : scran_norm::CenterBlockMode::LOWEST);
+
+    std::vector<double> buffer(n);
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::copy(sf.begin(), sf.end(), buffer.begin());
+        state.ResumeTiming();
+
+        auto means = scran_norm::center_size_factors_blocked(n, buffer.data(), block.data(), NULL, opt);
+        benchmark::DoNotOptimize(means.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+BENCHMARK(BM_CenterSizeFactorsBlocked)
+    ->ArgNames({ "cells", "blocks", "per_block" })
+    ->ArgsProduct({ benchmark::CreateRange(100000, 100000000, 10), { 1, 10 }, { 0, 1 } })
+    ->Unit(benchmark::kMillisecond);
+
+/*
+ * Same arguments as BM_CenterSizeFactorsBlocked, but the cells are sorted by block.
+ */
+static void BM_CenterSizeFactorsBlockedSorted(benchmark::State& state) {
+    size_t n = state.range(0);
+    auto sf = simulate_size_factors(n);
+    auto block = simulate_blocks(n, state.range(1));
+
+    size_t nblocks = state.range(1);
+    std::vector<size_t> offsets(nblocks + 1);
+    for (auto b : block) {
+        ++(offsets[b + 1]);
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    opt.block_mode = (state.range(2) ? scran_norm::CenterBlockMode::PER_BLOCK : scran_norm::CenterBlockMode::LOWEST);
+
+    std::vector<double> buffer(n);
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::copy(sf.begin(), sf.end(), buffer.begin());
+        state.ResumeTiming();
+
+        auto means = scran_norm::center_size_factors_blocked_sorted(nblocks, offsets.data(), buffer.data(), NULL, opt);
+        benchmark::DoNotOptimize(means.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+BENCHMARK(BM_CenterSizeFactorsBlockedSorted)
+    ->ArgNames({ "cells", "blocks", "per_block" })
+    ->ArgsProduct({ benchmark::CreateRange(100000, 100000000, 10), { 10, 1000 }, { 0, 1 } })
+    ->Unit(benchmark::kMillisecond);
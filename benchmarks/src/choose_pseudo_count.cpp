@@ -0,0 +1,31 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "scran_norm/choose_pseudo_count.hpp"
+#include "simulate.hpp"
+
+/*
+ * Arguments are:
+ * 0. number of cells.
+ * 1. whether to compute approximate quantiles.
+ */
+static void BM_ChoosePseudoCount(benchmark::State& state) {
+    size_t n = state.range(0);
+    auto sf = simulate_size_factors(n);
+
+    scran_norm::ChoosePseudoCountOptions opt;
+    opt.approximate = state.range(1);
+
+    for (auto _ : state) {
+        auto pseudo = scran_norm::choose_pseudo_count(n, sf.data(), opt);
+        benchmark::DoNotOptimize(pseudo);
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(n));
+}
+
+BENCHMARK(BM_ChoosePseudoCount)
+    ->ArgNames({ "cells", "approximate" })
+    ->ArgsProduct({ benchmark::CreateRange(100000, 100000000, 10), { 0, 1 } })
+    ->Unit(benchmark::kMillisecond);
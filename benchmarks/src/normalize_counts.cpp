@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+#include <memory>
+#include <numeric>
+
+#include "scran_norm/normalize_counts.hpp"
+#include "simulate.hpp"
+
+/*
+ * Arguments are:
+ * 0. whether the counts are sparse.
+ * 1. whether to iterate over rows.
+ * 2. extraction type; 0 = full, 1 = block, 2 = index.
+ * 3. whether the pseudo-count is equal to 1.
+ * 4. whether to preserve sparsity.
+ */
+template<typename OutputValue_>
+static void BM_NormalizeCounts(benchmark::State& state) {
+    constexpr int nr = 2000, nc = 5000;
+    bool sparse = state.range(0);
+    bool row = state.range(1);
+    int extraction = state.range(2);
+
+    auto counts = simulate_counts(nr, nc, 0.1, sparse);
+    auto sf = simulate_size_factors(nc);
+
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = (state.range(3) ? 1 : 2.5);
+    opt.preserve_sparsity = state.range(4);
+    auto normalized = scran_norm::normalize_counts<OutputValue_>(counts, std::move(sf), opt);
+
+    int primary = (row ? nr : nc);
+    int secondary = (row ? nc : nr);
+    int block_start = secondary / 4, block_length = secondary / 2;
+    auto indices = std::make_shared<std::vector<int> >();
+    for (int i = 0; i < secondary; i += 2) {
+        indices->push_back(i);
+    }
+    int extracted = (extraction == 0 ? secondary : extraction == 1 ? block_length : static_cast<int>(indices->size()));
+
+    tatami::Options topt;
+    std::vector<OutputValue_> vbuffer(extracted);
+    std::vector<int> ibuffer(extracted);
+
+    for (auto _ : state) {
+        OutputValue_ total = 0;
+
+        if (normalized->is_sparse()) {
+            std::unique_ptr<tatami::MyopicSparseExtractor<OutputValue_, int> > ext;
+            if (extraction == 0) {
+                ext = normalized->sparse(row, topt);
+            } else if (extraction == 1) {
+                ext = normalized->sparse(row, block_start, block_length, topt);
+            } else {
+                ext = normalized->sparse(row, indices, topt);
+            }
+            for (int p = 0; p < primary; ++p) {
+                auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+                total += std::accumulate(range.value, range.value + range.number, static_cast<OutputValue_>(0));
+            }
+
+        } else {
+            std::unique_ptr<tatami::MyopicDenseExtractor<OutputValue_, int> > ext;
+            if (extraction == 0) {
+                ext = normalized->dense(row, topt);
+            } else if (extraction == 1) {
+                ext = normalized->dense(row, block_start, block_length, topt);
+            } else {
+                ext = normalized->dense(row, indices, topt);
+            }
+            for (int p = 0; p < primary; ++p) {
+                auto ptr = ext->fetch(p, vbuffer.data());
+                total += std::accumulate(ptr, ptr + extracted, static_cast<OutputValue_>(0));
+            }
+        }
+
+        benchmark::DoNotOptimize(total);
+    }
+
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(primary) * static_cast<int64_t>(extracted));
+}
+
+BENCHMARK_TEMPLATE(BM_NormalizeCounts, double)
+    ->ArgNames({ "sparse", "row", "extraction", "unit_pseudo", "preserve_sparsity" })
+    ->ArgsProduct({ { 0, 1 }, { 0, 1 }, { 0, 1, 2 }, { 0, 1 }, { 0, 1 } })
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_NormalizeCounts, float)
+    ->ArgNames({ "sparse", "row", "extraction", "unit_pseudo", "preserve_sparsity" })
+    ->ArgsProduct({ { 0, 1 }, { 0, 1 }, { 0, 1, 2 }, { 0, 1 }, { 0, 1 } })
+    ->Unit(benchmark::kMillisecond);
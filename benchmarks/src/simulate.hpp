@@ -0,0 +1,51 @@
+#ifndef SIMULATE_HPP
+#define SIMULATE_HPP
+
+#include <random>
+#include <vector>
+#include <memory>
+
+#include "tatami/tatami.hpp"
+
+inline std::vector<double> simulate_size_factors(size_t num, unsigned seed = 42) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> dist(0.1, 10);
+    std::vector<double> output(num);
+    for (auto& o : output) {
+        o = dist(rng);
+    }
+    return output;
+}
+
+inline std::vector<int> simulate_blocks(size_t num, int nblocks, unsigned seed = 69) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> dist(0, nblocks - 1);
+    std::vector<int> output(num);
+    for (auto& o : output) {
+        o = dist(rng);
+    }
+    return output;
+}
+
+// Counts are Poisson-like integers stored as doubles, with zeros added to reach the desired density.
+inline std::shared_ptr<const tatami::Matrix<double, int> > simulate_counts(int nrow, int ncol, double density, bool sparse, unsigned seed = 1234) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unif(0, 1);
+    std::poisson_distribution<int> counts(5);
+
+    std::vector<double> values(static_cast<size_t>(nrow) * static_cast<size_t>(ncol));
+    for (auto& v : values) {
+        if (unif(rng) < density) {
+            v = counts(rng) + 1;
+        }
+    }
+
+    auto dense = std::make_shared<tatami::DenseRowMatrix<double, int> >(nrow, ncol, std::move(values));
+    if (sparse) {
+        return tatami::convert_to_compressed_sparse<double, int>(dense.get(), true);
+    } else {
+        return dense;
+    }
+}
+
+#endif
@@ -0,0 +1,682 @@
+#ifndef SCRAN_NORM_CACHE_NORMALIZED_COUNTS_HPP
+#define SCRAN_NORM_CACHE_NORMALIZED_COUNTS_HPP
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+
+/**
+ * @file cache_normalized_counts.hpp
+ * @brief Cache chunks of normalized expression values for repeated access.
+ */
+
+namespace scran_norm {
+
+/**
+ * @brief Options for `cache_normalized_counts()`.
+ */
+struct CacheNormalizedCountsOptions {
+    /**
+     * Whether to cache chunks of consecutive rows.
+     * If false, chunks of consecutive columns are cached instead.
+     * Only extraction along this dimension is cached, see `CachedNormalizedMatrix` for details.
+     */
+    bool row = true;
+
+    /**
+     * Number of consecutive rows (if `CacheNormalizedCountsOptions::row = true`) or columns (otherwise) in each chunk.
+     * Larger chunks reduce the overhead of populating the cache but increase the granularity of eviction.
+     */
+    size_t chunk_size = 100;
+
+    /**
+     * Maximum memory usage of the cache, in bytes.
+     * Once this limit is reached, the least recently used chunks are evicted to make room for new chunks.
+     * Chunks that are larger than this limit are never cached, in which case extraction is passed through to the wrapped matrix.
+     * Setting this to zero will disable the cache entirely.
+     */
+    size_t cache_size = 100000000;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Value_, typename Index_>
+struct CachedChunk {
+    bool sparse = false;
+    Index_ start = 0;
+    Index_ length = 0;
+
+    // For dense chunks, 'values' contains 'length' consecutive arrays of length equal to the extent of the other dimension.
+    // For sparse chunks, 'values' and 'indices' are compressed by 'pointers', which is of length 'length + 1'.
+    std::vector<Value_> values;
+    std::vector<Index_> indices;
+    std::vector<size_t> pointers;
+
+    size_t memory() const {
+        return values.size() * sizeof(Value_) + indices.size() * sizeof(Index_) + pointers.size() * sizeof(size_t);
+    }
+};
+
+template<typename Value_, typename Index_>
+class ChunkCache {
+public:
+    ChunkCache(size_t num_chunks, size_t limit) : my_chunks(num_chunks), my_positions(num_chunks), my_limit(limit) {}
+
+private:
+    typedef std::shared_ptr<const CachedChunk<Value_, Index_> > ChunkPtr;
+
+    std::mutex my_mutex;
+    std::vector<ChunkPtr> my_chunks;
+    std::vector<typename std::list<size_t>::iterator> my_positions;
+    std::list<size_t> my_recent; // most recently used chunks at the front.
+    size_t my_used = 0;
+    size_t my_limit;
+
+    void touch(size_t id) {
+        my_recent.splice(my_recent.begin(), my_recent, my_positions[id]);
+    }
+
+public:
+    ChunkPtr find(size_t id) {
+        std::lock_guard<std::mutex> lock(my_mutex);
+        const auto& current = my_chunks[id];
+        if (current) {
+            touch(id);
+        }
+        return current;
+    }
+
+    // Chunks are computed outside of the lock, so another thread may have
+    // inserted the same chunk in the meantime; if so, we just use that.
+    ChunkPtr insert(size_t id, ChunkPtr chunk) {
+        std::lock_guard<std::mutex> lock(my_mutex);
+        const auto& current = my_chunks[id];
+        if (current) {
+            touch(id);
+            return current;
+        }
+
+        size_t required = chunk->memory();
+        if (required > my_limit) {
+            return chunk;
+        }
+
+        // Evicted chunks may still be in use by an extractor, but this is
+        // fine as each extractor holds its own reference to the chunk.
+        while (my_used + required > my_limit) {
+            size_t last = my_recent.back();
+            my_used -= my_chunks[last]->memory();
+            my_chunks[last].reset();
+            my_recent.pop_back();
+        }
+
+        my_chunks[id] = chunk;
+        my_recent.push_front(id);
+        my_positions[id] = my_recent.begin();
+        my_used += required;
+        return chunk;
+    }
+
+    size_t used() {
+        std::lock_guard<std::mutex> lock(my_mutex);
+        return my_used;
+    }
+
+    // The limit is never modified so no locking is required.
+    bool fits(size_t required) const {
+        return required <= my_limit;
+    }
+};
+
+enum class CachedSelection : char { FULL, BLOCK, INDEX };
+
+template<typename Value_, typename Index_>
+class CachedExtractorCore {
+public:
+    CachedExtractorCore(
+        const tatami::Matrix<Value_, Index_>* matrix,
+        bool row,
+        size_t chunk_size,
+        ChunkCache<Value_, Index_>* cache,
+        CachedSelection selection,
+        Index_ block_start,
+        Index_ block_length,
+        tatami::VectorPtr<Index_> indices) :
+        my_matrix(matrix),
+        my_row(row),
+        my_chunk_size(chunk_size),
+        my_cache(cache),
+        my_extent(row ? matrix->ncol() : matrix->nrow()),
+        my_selection(selection),
+        my_block_start(block_start),
+        my_block_length(block_length),
+        my_indices(std::move(indices))
+    {
+        if (my_selection == CachedSelection::FULL) {
+            my_block_start = 0;
+            my_block_length = my_extent;
+        } else if (my_selection == CachedSelection::INDEX) {
+            // Mapping each index of the other dimension to its position (plus 1) in the selection.
+            my_remap.resize(my_extent);
+            const auto& idx = *my_indices;
+            for (size_t j = 0, end = idx.size(); j < end; ++j) {
+                my_remap[idx[j]] = j + 1;
+            }
+        }
+    }
+
+private:
+    const tatami::Matrix<Value_, Index_>* my_matrix;
+    bool my_row;
+    size_t my_chunk_size;
+    ChunkCache<Value_, Index_>* my_cache;
+    Index_ my_extent;
+
+public:
+    CachedSelection my_selection;
+    Index_ my_block_start, my_block_length;
+    tatami::VectorPtr<Index_> my_indices;
+    std::vector<Index_> my_remap;
+
+private:
+    std::shared_ptr<const CachedChunk<Value_, Index_> > my_current;
+    bool my_uncacheable = false;
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > my_sparse_ext;
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > my_dense_ext;
+    std::vector<Value_> my_vbuffer;
+    std::vector<Index_> my_ibuffer;
+
+    std::shared_ptr<const CachedChunk<Value_, Index_> > compute(size_t id) {
+        auto chunk = std::make_shared<CachedChunk<Value_, Index_> >();
+        Index_ primary = (my_row ? my_matrix->nrow() : my_matrix->ncol());
+        chunk->start = id * my_chunk_size;
+        chunk->length = std::min(static_cast<size_t>(primary - chunk->start), my_chunk_size);
+        chunk->sparse = my_matrix->is_sparse();
+        my_vbuffer.resize(my_extent);
+
+        if (chunk->sparse) {
+            if (!my_sparse_ext) {
+                my_sparse_ext = my_matrix->sparse(my_row, tatami::Options());
+                my_ibuffer.resize(my_extent);
+            }
+            chunk->pointers.reserve(static_cast<size_t>(chunk->length) + 1);
+            chunk->pointers.push_back(0);
+            for (Index_ p = 0; p < chunk->length; ++p) {
+                auto range = my_sparse_ext->fetch(chunk->start + p, my_vbuffer.data(), my_ibuffer.data());
+                chunk->values.insert(chunk->values.end(), range.value, range.value + range.number);
+                chunk->indices.insert(chunk->indices.end(), range.index, range.index + range.number);
+                chunk->pointers.push_back(chunk->values.size());
+            }
+            chunk->values.shrink_to_fit();
+            chunk->indices.shrink_to_fit();
+
+        } else {
+            if (!my_dense_ext) {
+                my_dense_ext = my_matrix->dense(my_row, tatami::Options());
+            }
+            chunk->values.resize(static_cast<size_t>(chunk->length) * static_cast<size_t>(my_extent));
+            for (Index_ p = 0; p < chunk->length; ++p) {
+                auto dest = chunk->values.data() + static_cast<size_t>(p) * static_cast<size_t>(my_extent);
+                auto ptr = my_dense_ext->fetch(chunk->start + p, dest);
+                tatami::copy_n(ptr, my_extent, dest);
+            }
+        }
+
+        return chunk;
+    }
+
+public:
+    const CachedChunk<Value_, Index_>& get(Index_ i) {
+        if (my_current && i >= my_current->start && i - my_current->start < my_current->length) {
+            return *my_current;
+        }
+
+        size_t id = i / my_chunk_size;
+        auto found = my_cache->find(id);
+        if (found) {
+            my_current = std::move(found);
+        } else {
+            auto chunk = compute(id);
+            if (!my_cache->fits(chunk->memory())) {
+                my_uncacheable = true;
+            }
+            my_current = my_cache->insert(id, std::move(chunk));
+        }
+        return *my_current;
+    }
+
+    // Whether a computed chunk was too large to be cached. If so, the
+    // extractor should switch to extracting its selection directly from the
+    // wrapped matrix, as the full-extent chunks will just be discarded.
+    bool uncacheable() const {
+        return my_uncacheable;
+    }
+
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > uncached_dense(const tatami::Options& options) const {
+        if (my_selection == CachedSelection::FULL) {
+            return my_matrix->dense(my_row, options);
+        } else if (my_selection == CachedSelection::BLOCK) {
+            return my_matrix->dense(my_row, my_block_start, my_block_length, options);
+        } else {
+            return my_matrix->dense(my_row, my_indices, options);
+        }
+    }
+
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > uncached_sparse(const tatami::Options& options) const {
+        if (my_selection == CachedSelection::FULL) {
+            return my_matrix->sparse(my_row, options);
+        } else if (my_selection == CachedSelection::BLOCK) {
+            return my_matrix->sparse(my_row, my_block_start, my_block_length, options);
+        } else {
+            return my_matrix->sparse(my_row, my_indices, options);
+        }
+    }
+};
+
+template<typename Value_, typename Index_>
+class CachedDenseExtractor : public tatami::MyopicDenseExtractor<Value_, Index_> {
+public:
+    CachedDenseExtractor(CachedExtractorCore<Value_, Index_> core, const tatami::Options& options) : my_core(std::move(core)), my_options(options) {}
+
+private:
+    CachedExtractorCore<Value_, Index_> my_core;
+    tatami::Options my_options;
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > my_uncached;
+
+public:
+    const Value_* fetch(Index_ i, Value_* buffer) {
+        if (my_uncached) {
+            return my_uncached->fetch(i, buffer);
+        }
+        const auto& chunk = my_core.get(i);
+        if (my_core.uncacheable()) {
+            my_uncached = my_core.uncached_dense(my_options);
+        }
+        size_t offset = i - chunk.start;
+        auto selection = my_core.my_selection;
+
+        if (!chunk.sparse) {
+            size_t extent = (chunk.length ? chunk.values.size() / chunk.length : 0);
+            auto ptr = chunk.values.data() + offset * extent;
+            if (selection == CachedSelection::INDEX) {
+                const auto& idx = *(my_core.my_indices);
+                for (size_t j = 0, end = idx.size(); j < end; ++j) {
+                    buffer[j] = ptr[idx[j]];
+                }
+                return buffer;
+            } else {
+                // No need to copy, we can just return a pointer into the cached chunk.
+                return ptr + my_core.my_block_start;
+            }
+        }
+
+        auto start = chunk.pointers[offset], end = chunk.pointers[offset + 1];
+        auto iptr = chunk.indices.data();
+        auto vptr = chunk.values.data();
+
+        if (selection == CachedSelection::INDEX) {
+            std::fill_n(buffer, my_core.my_indices->size(), 0);
+            const auto& remap = my_core.my_remap;
+            for (auto k = start; k < end; ++k) {
+                auto pos = remap[iptr[k]];
+                if (pos) {
+                    buffer[pos - 1] = vptr[k];
+                }
+            }
+        } else {
+            Index_ block_start = my_core.my_block_start, block_end = block_start + my_core.my_block_length;
+            std::fill_n(buffer, my_core.my_block_length, 0);
+            if (selection == CachedSelection::BLOCK) {
+                start = std::lower_bound(iptr + start, iptr + end, block_start) - iptr;
+            }
+            for (auto k = start; k < end && iptr[k] < block_end; ++k) {
+                buffer[iptr[k] - block_start] = vptr[k];
+            }
+        }
+
+        return buffer;
+    }
+};
+
+template<typename Value_, typename Index_>
+class CachedSparseExtractor : public tatami::MyopicSparseExtractor<Value_, Index_> {
+public:
+    CachedSparseExtractor(CachedExtractorCore<Value_, Index_> core, const tatami::Options& options) :
+        my_core(std::move(core)), my_options(options), my_needs_value(options.sparse_extract_value), my_needs_index(options.sparse_extract_index) {}
+
+private:
+    CachedExtractorCore<Value_, Index_> my_core;
+    tatami::Options my_options;
+    bool my_needs_value, my_needs_index;
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > my_uncached;
+
+public:
+    tatami::SparseRange<Value_, Index_> fetch(Index_ i, Value_* value_buffer, Index_* index_buffer) {
+        if (my_uncached) {
+            return my_uncached->fetch(i, value_buffer, index_buffer);
+        }
+        const auto& chunk = my_core.get(i);
+        if (my_core.uncacheable()) {
+            my_uncached = my_core.uncached_sparse(my_options);
+        }
+        size_t offset = i - chunk.start;
+        auto selection = my_core.my_selection;
+        tatami::SparseRange<Value_, Index_> output;
+
+        if (chunk.sparse) {
+            auto start = chunk.pointers[offset], end = chunk.pointers[offset + 1];
+            auto iptr = chunk.indices.data();
+            auto vptr = chunk.values.data();
+
+            if (selection != CachedSelection::INDEX) {
+                // No need to copy, we can just return pointers into the cached chunk.
+                if (selection == CachedSelection::BLOCK) {
+                    Index_ block_start = my_core.my_block_start;
+                    start = std::lower_bound(iptr + start, iptr + end, block_start) - iptr;
+                    end = std::lower_bound(iptr + start, iptr + end, block_start + my_core.my_block_length) - iptr;
+                }
+                output.number = end - start;
+                output.value = (my_needs_value ? vptr + start : NULL);
+                output.index = (my_needs_index ? iptr + start : NULL);
+                return output;
+            }
+
+            const auto& remap = my_core.my_remap;
+            for (auto k = start; k < end; ++k) {
+                if (remap[iptr[k]]) {
+                    if (my_needs_value) {
+                        value_buffer[output.number] = vptr[k];
+                    }
+                    if (my_needs_index) {
+                        index_buffer[output.number] = iptr[k];
+                    }
+                    ++output.number;
+                }
+            }
+
+        } else {
+            size_t extent = (chunk.length ? chunk.values.size() / chunk.length : 0);
+            auto ptr = chunk.values.data() + offset * extent;
+            auto add = [&](Index_ j) -> void {
+                auto val = ptr[j];
+                if (val) {
+                    if (my_needs_value) {
+                        value_buffer[output.number] = val;
+                    }
+                    if (my_needs_index) {
+                        index_buffer[output.number] = j;
+                    }
+                    ++output.number;
+                }
+            };
+
+            if (selection == CachedSelection::INDEX) {
+                for (auto j : *(my_core.my_indices)) {
+                    add(j);
+                }
+            } else {
+                for (Index_ j = my_core.my_block_start, end = my_core.my_block_start + my_core.my_block_length; j < end; ++j) {
+                    add(j);
+                }
+            }
+        }
+
+        output.value = (my_needs_value ? value_buffer : NULL);
+        output.index = (my_needs_index ? index_buffer : NULL);
+        return output;
+    }
+};
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * @brief Matrix of normalized expression values with a chunk-level cache.
+ *
+ * This wraps a `tatami::Matrix` of normalized expression values, typically from `normalize_counts()`,
+ * and caches chunks of consecutive rows (or columns) after they are first extracted.
+ * Subsequent extraction of the same rows (or columns) is then served from the cache without recomputing the log-transformation.
+ * This is intended for workflows where the same normalized matrix is iterated over multiple times, e.g., for feature selection, PCA and marker detection.
+ * It provides a compromise between a fully delayed matrix and a fully realized matrix, where the memory usage is capped by `CacheNormalizedCountsOptions::cache_size`.
+ *
+ * Chunks are populated lazily during extraction and are stored in compressed sparse form if the wrapped matrix is sparse.
+ * When the cache is full, the least recently used chunks are evicted.
+ * The cache is shared between all extractors created from the same `CachedNormalizedMatrix`, and is protected by a mutex so that extractors can be used in different threads.
+ * The mutex is only locked when an extractor moves to a new chunk, so contention is limited to once per chunk rather than once per row/column.
+ * It is possible for multiple threads to compute the same uncached chunk simultaneously, in which case only one copy is retained in the cache.
+ *
+ * Only extraction along the chunked dimension (i.e., rows if `CacheNormalizedCountsOptions::row = true`) is cached.
+ * Extraction along the other dimension is passed through to the wrapped matrix.
+ *
+ * Each chunk is always populated with the full extent of the other dimension, even if the extractor only requested a block or subset of indices.
+ * This allows the same chunk to be re-used by extractors with different selections,
+ * but it also means that the first pass over a narrow selection is more expensive than the same extraction from the wrapped matrix.
+ * The cache is only beneficial if chunks are re-used often enough to offset this initial cost.
+ * If `CacheNormalizedCountsOptions::cache_size` is too small to hold a single chunk, extraction is passed through to the wrapped matrix instead.
+ * For sparse matrices, the size of each chunk is only known after it is computed,
+ * so an extractor is switched to the wrapped matrix after encountering the first chunk that is too large to be cached.
+ *
+ * @tparam Value_ Numeric type for the matrix values.
+ * @tparam Index_ Integer type for the row/column indices.
+ */
+template<typename Value_, typename Index_>
+class CachedNormalizedMatrix : public tatami::Matrix<Value_, Index_> {
+public:
+    /**
+     * @param matrix Pointer to a matrix of normalized expression values.
+     * @param options Further options.
+     */
+    CachedNormalizedMatrix(std::shared_ptr<const tatami::Matrix<Value_, Index_> > matrix, const CacheNormalizedCountsOptions& options) :
+        my_matrix(std::move(matrix)),
+        my_row(options.row),
+        my_chunk_size(std::max(static_cast<size_t>(1), options.chunk_size))
+    {
+        size_t primary = (my_row ? my_matrix->nrow() : my_matrix->ncol());
+        size_t num_chunks = (primary + my_chunk_size - 1) / my_chunk_size;
+        my_cache.reset(new internal::ChunkCache<Value_, Index_>(num_chunks, options.cache_size));
+
+        // Checking if the cache can hold at least one chunk. For sparse
+        // matrices, we can only use the pointers as a lower bound.
+        size_t secondary = (my_row ? my_matrix->ncol() : my_matrix->nrow());
+        size_t chunk_length = std::min(my_chunk_size, primary);
+        size_t minimum = (my_matrix->is_sparse() ? (chunk_length + 1) * sizeof(size_t) : chunk_length * secondary * sizeof(Value_));
+        my_uncached = (options.cache_size == 0 || minimum > options.cache_size);
+    }
+
+private:
+    std::shared_ptr<const tatami::Matrix<Value_, Index_> > my_matrix;
+    bool my_row;
+    size_t my_chunk_size;
+    std::unique_ptr<internal::ChunkCache<Value_, Index_> > my_cache;
+    bool my_uncached;
+
+    bool passthrough(bool row) const {
+        return row != my_row || my_uncached;
+    }
+
+public:
+    /**
+     * @return Current memory usage of the cache, in bytes.
+     */
+    size_t cache_usage() const {
+        return my_cache->used();
+    }
+
+public:
+    Index_ nrow() const {
+        return my_matrix->nrow();
+    }
+
+    Index_ ncol() const {
+        return my_matrix->ncol();
+    }
+
+    bool is_sparse() const {
+        return my_matrix->is_sparse();
+    }
+
+    double is_sparse_proportion() const {
+        return my_matrix->is_sparse_proportion();
+    }
+
+    bool prefer_rows() const {
+        return my_row;
+    }
+
+    double prefer_rows_proportion() const {
+        return static_cast<double>(my_row);
+    }
+
+    bool uses_oracle(bool row) const {
+        return (passthrough(row) ? my_matrix->uses_oracle(row) : false);
+    }
+
+private:
+    internal::CachedExtractorCore<Value_, Index_> core(internal::CachedSelection selection, Index_ block_start, Index_ block_length, tatami::VectorPtr<Index_> indices) const {
+        return internal::CachedExtractorCore<Value_, Index_>(my_matrix.get(), my_row, my_chunk_size, my_cache.get(), selection, block_start, block_length, std::move(indices));
+    }
+
+    /********************
+     *** Myopic dense ***
+     ********************/
+public:
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > dense(bool row, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, opt);
+        }
+        return std::make_unique<internal::CachedDenseExtractor<Value_, Index_> >(core(internal::CachedSelection::FULL, 0, 0, nullptr), opt);
+    }
+
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > dense(bool row, Index_ block_start, Index_ block_length, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, block_start, block_length, opt);
+        }
+        return std::make_unique<internal::CachedDenseExtractor<Value_, Index_> >(core(internal::CachedSelection::BLOCK, block_start, block_length, nullptr), opt);
+    }
+
+    std::unique_ptr<tatami::MyopicDenseExtractor<Value_, Index_> > dense(bool row, tatami::VectorPtr<Index_> indices_ptr, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, std::move(indices_ptr), opt);
+        }
+        return std::make_unique<internal::CachedDenseExtractor<Value_, Index_> >(core(internal::CachedSelection::INDEX, 0, 0, std::move(indices_ptr)), opt);
+    }
+
+    /*********************
+     *** Myopic sparse ***
+     *********************/
+public:
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > sparse(bool row, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, opt);
+        }
+        return std::make_unique<internal::CachedSparseExtractor<Value_, Index_> >(core(internal::CachedSelection::FULL, 0, 0, nullptr), opt);
+    }
+
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > sparse(bool row, Index_ block_start, Index_ block_length, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, block_start, block_length, opt);
+        }
+        return std::make_unique<internal::CachedSparseExtractor<Value_, Index_> >(core(internal::CachedSelection::BLOCK, block_start, block_length, nullptr), opt);
+    }
+
+    std::unique_ptr<tatami::MyopicSparseExtractor<Value_, Index_> > sparse(bool row, tatami::VectorPtr<Index_> indices_ptr, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, std::move(indices_ptr), opt);
+        }
+        return std::make_unique<internal::CachedSparseExtractor<Value_, Index_> >(core(internal::CachedSelection::INDEX, 0, 0, std::move(indices_ptr)), opt);
+    }
+
+    /**********************
+     *** Oracular dense ***
+     **********************/
+public:
+    std::unique_ptr<tatami::OracularDenseExtractor<Value_, Index_> > dense(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, std::move(oracle), opt);
+        }
+        return std::make_unique<tatami::PseudoOracularDenseExtractor<Value_, Index_> >(std::move(oracle), dense(row, opt));
+    }
+
+    std::unique_ptr<tatami::OracularDenseExtractor<Value_, Index_> > dense(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, Index_ block_start, Index_ block_length, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, std::move(oracle), block_start, block_length, opt);
+        }
+        return std::make_unique<tatami::PseudoOracularDenseExtractor<Value_, Index_> >(std::move(oracle), dense(row, block_start, block_length, opt));
+    }
+
+    std::unique_ptr<tatami::OracularDenseExtractor<Value_, Index_> > dense(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, tatami::VectorPtr<Index_> indices_ptr, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->dense(row, std::move(oracle), std::move(indices_ptr), opt);
+        }
+        return std::make_unique<tatami::PseudoOracularDenseExtractor<Value_, Index_> >(std::move(oracle), dense(row, std::move(indices_ptr), opt));
+    }
+
+    /***********************
+     *** Oracular sparse ***
+     ***********************/
+public:
+    std::unique_ptr<tatami::OracularSparseExtractor<Value_, Index_> > sparse(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, std::move(oracle), opt);
+        }
+        return std::make_unique<tatami::PseudoOracularSparseExtractor<Value_, Index_> >(std::move(oracle), sparse(row, opt));
+    }
+
+    std::unique_ptr<tatami::OracularSparseExtractor<Value_, Index_> > sparse(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, Index_ block_start, Index_ block_length, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, std::move(oracle), block_start, block_length, opt);
+        }
+        return std::make_unique<tatami::PseudoOracularSparseExtractor<Value_, Index_> >(std::move(oracle), sparse(row, block_start, block_length, opt));
+    }
+
+    std::unique_ptr<tatami::OracularSparseExtractor<Value_, Index_> > sparse(bool row, std::shared_ptr<const tatami::Oracle<Index_> > oracle, tatami::VectorPtr<Index_> indices_ptr, const tatami::Options& opt) const {
+        if (passthrough(row)) {
+            return my_matrix->sparse(row, std::move(oracle), std::move(indices_ptr), opt);
+        }
+        return std::make_unique<tatami::PseudoOracularSparseExtractor<Value_, Index_> >(std::move(oracle), sparse(row, std::move(indices_ptr), opt));
+    }
+};
+
+/**
+ * Wrap a matrix of normalized expression values in a `CachedNormalizedMatrix`,
+ * so that repeated extraction along the rows (or columns) does not recompute the normalized values.
+ *
+ * @tparam Value_ Numeric type for the matrix values.
+ * @tparam Index_ Integer type for the row/column indices.
+ *
+ * @param normalized Pointer to a matrix of normalized expression values, typically from `normalize_counts()`.
+ * @param options Further options.
+ *
+ * @return Pointer to a `CachedNormalizedMatrix`.
+ */
+template<typename Value_, typename Index_>
+std::shared_ptr<tatami::Matrix<Value_, Index_> > cache_normalized_counts(std::shared_ptr<const tatami::Matrix<Value_, Index_> > normalized, const CacheNormalizedCountsOptions& options) {
+    return std::make_shared<CachedNormalizedMatrix<Value_, Index_> >(std::move(normalized), options);
+}
+
+/**
+ * @cond
+ */
+// Overload for template deduction.
+template<typename Value_, typename Index_>
+std::shared_ptr<tatami::Matrix<Value_, Index_> > cache_normalized_counts(std::shared_ptr<tatami::Matrix<Value_, Index_> > normalized, const CacheNormalizedCountsOptions& options) {
+    return cache_normalized_counts(std::shared_ptr<const tatami::Matrix<Value_, Index_> >(std::move(normalized)), options);
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
@@ -1,14 +1,19 @@
 #ifndef SCRAN_NORM_CENTER_SIZE_FACTORS_HPP
 #define SCRAN_NORM_CENTER_SIZE_FACTORS_HPP
 
+#include "tatami/tatami.hpp"
 #include "tatami_stats/tatami_stats.hpp"
 
 #include <vector>
 #include <numeric>
 #include <algorithm>
 #include <type_traits>
+#include <stdexcept>
+#include <cmath>
 
 #include "sanitize_size_factors.hpp"
+#include "instrumentation.hpp"
+#include "serialize.hpp"
 
 /**
  * @file center_size_factors.hpp
@@ -54,8 +59,339 @@ struct CenterSizeFactorsOptions {
      * If users know that invalid size factors cannot be present, they can set this flag to false for greater efficiency.
      */
     bool ignore_invalid = true;
+
+    /**
+     * Whether to use compensated summation when computing the mean size factors.
+     * This uses the Kahan-Babuska-Neumaier algorithm to track the round-off error of the running sum within each chunk and when combining the per-chunk sums.
+     * The mean is then accurate to the precision of the sum even for very large numbers of cells, at the cost of some extra computation.
+     * This is mostly relevant for double-precision `SizeFactor_`, as single-precision size factors are already summed in double precision.
+     * Note that compensation is not preserved by compiler flags that allow reassociation of floating-point operations, e.g., `-ffast-math`.
+     *
+     * Ignored by `SizeFactorCenterer` and `BlockedCenteringState`, which add each chunk to the running sums without compensation.
+     */
+    bool compensated_sum = false;
+
+    /**
+     * Number of threads to use.
+     * The size factors are always summed in the same chunks and the per-chunk sums are always combined in the same order,
+     * so the results are identical for any number of threads.
+     */
+    int num_threads = 1;
 };
 
+/**
+ * @cond
+ */
+namespace internal {
+
+// Sums are accumulated in at least double precision, as single-precision sums
+// lose accuracy quickly when many size factors are added together.
+template<typename SizeFactor_>
+using SizeFactorSum = typename std::conditional<(sizeof(SizeFactor_) < sizeof(double)), double, SizeFactor_>::type;
+
+inline size_t centering_chunk_size(size_t num) {
+    // Chunk boundaries only depend on 'num', so that the order of summation
+    // does not depend on the number of threads. We use at least 64k cells per
+    // chunk, such that smaller arrays are just processed in a single chunk.
+    constexpr size_t min_chunk_size = 65536, max_num_chunks = 128;
+    return std::max(min_chunk_size, (num + max_num_chunks - 1) / max_num_chunks);
+}
+
+template<typename Sum_>
+void compensated_add(Sum_& sum, Sum_& compensation, Sum_ val) {
+    Sum_ total = sum + val;
+    if (std::abs(sum) >= std::abs(val)) {
+        compensation += (sum - total) + val;
+    } else {
+        compensation += (val - total) + sum;
+    }
+    sum = total;
+}
+
+template<typename Sum_>
+void fold_compensation(size_t ngroups, Sum_* sums, const Sum_* compensation) {
+    for (size_t g = 0; g < ngroups; ++g) {
+        // Non-finite sums would otherwise become NaN from the compensation.
+        if (std::isfinite(sums[g])) {
+            sums[g] += compensation[g];
+        }
+    }
+}
+
+template<bool blocked_, bool compensated_, typename SizeFactor_, typename Block_>
+void accumulate_size_factors(
+    size_t start,
+    size_t length,
+    const SizeFactor_* size_factors,
+    const Block_* block,
+    SizeFactorDiagnostics& diagnostics,
+    bool ignore_invalid,
+    SizeFactorSum<SizeFactor_>* sums,
+    SizeFactorSum<SizeFactor_>* compensation,
+    size_t* counts)
+{
+    for (size_t i = start, end = start + length; i < end; ++i) {
+        auto val = size_factors[i];
+        if (ignore_invalid && is_invalid(val, diagnostics)) {
+            continue;
+        }
+
+        size_t b = 0;
+        if constexpr(blocked_) {
+            b = block[i];
+        }
+        if constexpr(compensated_) {
+            compensated_add<SizeFactorSum<SizeFactor_> >(sums[b], compensation[b], val);
+        } else {
+            sums[b] += val;
+        }
+        ++(counts[b]);
+    }
+}
+
+// The per-chunk compensation is NULL if compensated summation is not requested.
+template<bool blocked_, typename SizeFactor_, typename Block_>
+void accumulate_size_factors(
+    size_t start,
+    size_t length,
+    const SizeFactor_* size_factors,
+    const Block_* block,
+    SizeFactorDiagnostics& diagnostics,
+    bool ignore_invalid,
+    SizeFactorSum<SizeFactor_>* sums,
+    SizeFactorSum<SizeFactor_>* compensation,
+    size_t* counts)
+{
+    if (compensation) {
+        accumulate_size_factors<blocked_, true>(start, length, size_factors, block, diagnostics, ignore_invalid, sums, compensation, counts);
+    } else {
+        accumulate_size_factors<blocked_, false>(start, length, size_factors, block, diagnostics, ignore_invalid, sums, compensation, counts);
+    }
+}
+
+// Partial sums for chunk 'c' start at 'c * stride'. This is always combined
+// in order of the chunks, so the result does not depend on the number of threads.
+template<typename Sum_>
+void combine_chunk_sums(
+    size_t num_chunks,
+    size_t stride,
+    size_t ngroups,
+    const Sum_* partial_sums,
+    const size_t* partial_counts,
+    bool compensated,
+    Sum_* sums,
+    size_t* counts)
+{
+    std::vector<Sum_> compensation(compensated ? ngroups : 0);
+    for (size_t c = 0; c < num_chunks; ++c) {
+        size_t offset = c * stride;
+        for (size_t g = 0; g < ngroups; ++g) {
+            if (compensated) {
+                compensated_add(sums[g], compensation[g], partial_sums[offset + g]);
+            } else {
+                sums[g] += partial_sums[offset + g];
+            }
+            counts[g] += partial_counts[offset + g];
+        }
+    }
+    if (compensated) {
+        fold_compensation(ngroups, sums, compensation.data());
+    }
+}
+
+inline void combine_diagnostics(SizeFactorDiagnostics& diag, const SizeFactorDiagnostics& curdiag) {
+    diag.has_negative = diag.has_negative || curdiag.has_negative;
+    diag.has_zero = diag.has_zero || curdiag.has_zero;
+    diag.has_nan = diag.has_nan || curdiag.has_nan;
+    diag.has_infinite = diag.has_infinite || curdiag.has_infinite;
+}
+
+template<typename SizeFactor_, class Function_>
+void accumulate_size_factors_chunked(
+    size_t num,
+    size_t ngroups,
+    SizeFactorDiagnostics* diagnostics,
+    bool compensated,
+    int num_threads,
+    SizeFactorSum<SizeFactor_>* sums,
+    size_t* counts,
+    Function_ fun)
+{
+    SizeFactorDiagnostics tmpdiag;
+    auto& diag = (diagnostics == NULL ? tmpdiag : *diagnostics);
+
+    size_t chunk_size = centering_chunk_size(num);
+    size_t num_chunks = (num + chunk_size - 1) / chunk_size;
+    if (num_chunks <= 1) {
+        std::vector<SizeFactorSum<SizeFactor_> > compensation(compensated ? ngroups : 0);
+        fun(0, num, diag, sums, (compensated ? compensation.data() : NULL), counts);
+        if (compensated) {
+            fold_compensation(ngroups, sums, compensation.data());
+        }
+        return;
+    }
+
+    std::vector<SizeFactorSum<SizeFactor_> > partial_sums(num_chunks * ngroups);
+    std::vector<size_t> partial_counts(num_chunks * ngroups);
+    std::vector<SizeFactorDiagnostics> partial_diag(num_chunks);
+
+    tatami::parallelize([&](int, size_t start, size_t length) -> void {
+        std::vector<SizeFactorSum<SizeFactor_> > compensation(compensated ? ngroups : 0);
+        for (size_t c = start, end = start + length; c < end; ++c) {
+            size_t first = c * chunk_size; 
+            size_t last = std::min(num, first + chunk_size);
+            size_t offset = c * ngroups;
+            auto cursums = partial_sums.data() + offset;
+            if (compensated) {
+                std::fill(compensation.begin(), compensation.end(), 0);
+                fun(first, last - first, partial_diag[c], cursums, compensation.data(), partial_counts.data() + offset);
+                fold_compensation(ngroups, cursums, compensation.data());
+            } else {
+                fun(first, last - first, partial_diag[c], cursums, static_cast<SizeFactorSum<SizeFactor_>*>(NULL), partial_counts.data() + offset);
+            }
+        }
+    }, num_chunks, num_threads);
+
+    combine_chunk_sums(num_chunks, ngroups, ngroups, partial_sums.data(), partial_counts.data(), compensated, sums, counts);
+    for (size_t c = 0; c < num_chunks; ++c) {
+        combine_diagnostics(diag, partial_diag[c]);
+    }
+}
+
+template<bool blocked_, typename SizeFactor_, typename Block_>
+void accumulate_size_factors(
+    size_t num,
+    const SizeFactor_* size_factors,
+    const Block_* block,
+    size_t ngroups,
+    SizeFactorDiagnostics* diagnostics,
+    bool ignore_invalid,
+    bool compensated,
+    int num_threads,
+    SizeFactorSum<SizeFactor_>* sums,
+    size_t* counts)
+{
+    accumulate_size_factors_chunked<SizeFactor_>(
+        num,
+        ngroups,
+        diagnostics,
+        compensated,
+        num_threads,
+        sums,
+        counts,
+        [&](size_t start, size_t length, SizeFactorDiagnostics& diag, SizeFactorSum<SizeFactor_>* cursums, SizeFactorSum<SizeFactor_>* curcomp, size_t* curcounts) -> void {
+            accumulate_size_factors<blocked_>(start, length, size_factors, block, diag, ignore_invalid, cursums, curcomp, curcounts);
+        }
+    );
+}
+
+template<typename Offset_>
+size_t find_sorted_block(size_t num_blocks, const Offset_* block_offsets, size_t position) {
+    // Last block that starts at or before 'position', which skips any empty blocks.
+    return (std::upper_bound(block_offsets, block_offsets + num_blocks + 1, position) - block_offsets) - 1;
+}
+
+// Each chunk contains contiguous runs of size factors for consecutive blocks,
+// so the sums are computed without any scattered updates. Each run is summed
+// in the same order as accumulate_size_factors(), and each block only has one
+// run per chunk, so the results are identical to the unsorted case.
+template<typename SizeFactor_, typename Offset_>
+void accumulate_size_factors_sorted(
+    size_t start,
+    size_t length,
+    const SizeFactor_* size_factors,
+    size_t num_blocks,
+    const Offset_* block_offsets,
+    SizeFactorDiagnostics& diagnostics,
+    bool ignore_invalid,
+    SizeFactorSum<SizeFactor_>* sums,
+    SizeFactorSum<SizeFactor_>* compensation,
+    size_t* counts)
+{
+    if (length == 0) {
+        return;
+    }
+
+    size_t end = start + length;
+    size_t b = find_sorted_block(num_blocks, block_offsets, start);
+    size_t i = start; 
+    while (i < end) {
+        size_t run_end = std::min(end, static_cast<size_t>(block_offsets[b + 1]));
+
+        SizeFactorSum<SizeFactor_> cursum = 0, curcomp = 0;
+        size_t curcount = 0;
+        auto run_start = i;
+        if (compensation) {
+            accumulate_size_factors<false, true>(run_start, run_end - run_start, size_factors, static_cast<const char*>(NULL), diagnostics, ignore_invalid, &cursum, &curcomp, &curcount);
+            compensation[b] += curcomp;
+        } else if (ignore_invalid) {
+            accumulate_size_factors<false, false>(run_start, run_end - run_start, size_factors, static_cast<const char*>(NULL), diagnostics, ignore_invalid, &cursum, &curcomp, &curcount);
+        } else {
+            // Simple contiguous sum that the compiler can unroll.
+            curcount = run_end - run_start;
+            for (; i < run_end; ++i) {
+                cursum += size_factors[i];
+            }
+        }
+
+        sums[b] += cursum;
+        counts[b] += curcount;
+        i = run_end;
+        ++b;
+    }
+}
+
+template<typename Offset_>
+void check_block_offsets(size_t num_blocks, const Offset_* block_offsets) {
+    if (block_offsets[0] != 0) {
+        throw std::runtime_error("first entry of 'block_offsets' should be zero");
+    }
+    for (size_t b = 0; b < num_blocks; ++b) {
+        if (block_offsets[b] > block_offsets[b + 1]) {
+            throw std::runtime_error("'block_offsets' should be non-decreasing");
+        }
+    }
+}
+
+template<typename SizeFactor_>
+SizeFactor_ find_lowest_mean(size_t ngroups, const SizeFactor_* group_mean) {
+    SizeFactor_ min = 0;
+    bool found = false;
+    for (size_t g = 0; g < ngroups; ++g) {
+        auto m = group_mean[g];
+        // Ignore groups with means of zeros, either because they're full
+        // of zeros themselves or they have no cells associated with them.
+        if (m) {
+            if (!found || m < min) {
+                min = m;
+                found = true;
+            }
+        }
+    }
+    return min;
+}
+
+template<typename SizeFactor_>
+SizeFactor_ find_lowest_mean(const std::vector<SizeFactor_>& group_mean) {
+    return find_lowest_mean(group_mean.size(), group_mean.data());
+}
+
+template<class Function_>
+void parallel_scale(size_t num, int num_threads, Function_ fun) {
+    if (num_threads <= 1) {
+        fun(0, num);
+    } else {
+        tatami::parallelize([&](int, size_t start, size_t length) -> void {
+            fun(start, length);
+        }, num, num_threads);
+    }
+}
+
+}
+/**
+ * @endcond
+ */
+
 /**
  * Compute the mean size factor but do not scale the size factors themselves.
  *
@@ -69,27 +405,26 @@ struct CenterSizeFactorsOptions {
  * @param options Further options.
  *
  * @return The mean size factor, to be used to divide each element of `size_factors`.
+ * For single-precision `SizeFactor_`, the sum is accumulated in double precision before conversion back to `SizeFactor_`.
  */
 template<typename SizeFactor_>
 SizeFactor_ center_size_factors_mean(size_t num, const SizeFactor_* size_factors, SizeFactorDiagnostics* diagnostics, const CenterSizeFactorsOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS_MEAN, num);
     static_assert(std::is_floating_point<SizeFactor_>::value);
-    SizeFactor_ mean = 0;
+    internal::SizeFactorSum<SizeFactor_> mean = 0;
     size_t denom = 0;
-
-    if (options.ignore_invalid) {
-        SizeFactorDiagnostics tmpdiag;
-        auto& diag = (diagnostics == NULL ? tmpdiag : *diagnostics);
-        for (size_t i = 0; i < num; ++i) {
-            auto val = size_factors[i];
-            if (!internal::is_invalid(val, diag)) {
-                mean += val;
-                ++denom;
-            }
-        }
-    } else {
-        mean = std::accumulate(size_factors, size_factors + num, static_cast<SizeFactor_>(0));
-        denom = num;
-    }
+    internal::accumulate_size_factors<false>(
+        num,
+        size_factors,
+        static_cast<const char*>(NULL),
+        1,
+        (options.ignore_invalid ? diagnostics : NULL),
+        options.ignore_invalid,
+        options.compensated_sum,
+        options.num_threads,
+        &mean,
+        &denom
+    );
 
     if (denom) {
         return mean/denom;
@@ -118,15 +453,100 @@ SizeFactor_ center_size_factors_mean(size_t num, const SizeFactor_* size_factors
  */
 template<typename SizeFactor_>
 SizeFactor_ center_size_factors(size_t num, SizeFactor_* size_factors, SizeFactorDiagnostics* diagnostics, const CenterSizeFactorsOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS, num);
     auto mean = center_size_factors_mean(num, size_factors, diagnostics, options);
     if (mean) {
-        for (size_t i = 0; i < num; ++i){
-            size_factors[i] /= mean;
-        }
+        internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+            for (size_t i = start, end = start + length; i < end; ++i) {
+                size_factors[i] /= mean;
+            }
+        });
     }
     return mean;
 }
 
+/**
+ * @brief Workspace for repeated calls to `center_size_factors_blocked_mean()` and `center_size_factors_blocked()`.
+ *
+ * Re-using the same workspace across calls avoids repeated allocations of the per-block statistics,
+ * which is helpful for applications that perform many calls on small arrays of size factors.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+struct CenterSizeFactorsWorkspace {
+    /**
+     * @cond
+     */
+    std::vector<internal::SizeFactorSum<SizeFactor_> > sums;
+    std::vector<size_t> counts;
+    /**
+     * @endcond
+     */
+};
+
+/**
+ * Compute the mean size factor for each block, but do not scale the size factors themselves.
+ * This overload uses a pre-specified number of blocks and a re-usable workspace, 
+ * avoiding the initial scan over `block` and the allocation of any intermediate buffers.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param num Number of cells.
+ * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
+ * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param num_blocks Number of blocks, i.e., \f$N\f$.
+ * @param[out] diagnostics Diagnostics for invalid size factors, see `center_size_factors_blocked_mean()` for details.
+ * @param workspace Workspace for intermediate buffers.
+ * This can be re-used across calls with any number of blocks.
+ * @param[out] group_mean Pointer to an array of length \f$N\f$.
+ * On output, this contains the mean size factor for each block.
+ * @param options Further options.
+ */
+template<typename SizeFactor_, typename Block_>
+void center_size_factors_blocked_mean(
+    size_t num,
+    const SizeFactor_* size_factors,
+    const Block_* block,
+    size_t num_blocks,
+    SizeFactorDiagnostics* diagnostics,
+    CenterSizeFactorsWorkspace<SizeFactor_>& workspace,
+    SizeFactor_* group_mean,
+    const CenterSizeFactorsOptions& options)
+{
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS_MEAN, num);
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+    auto& group_sum = workspace.sums;
+    auto& group_num = workspace.counts;
+    group_sum.clear();
+    group_sum.resize(num_blocks);
+    group_num.clear();
+    group_num.resize(num_blocks);
+
+    internal::accumulate_size_factors<true>(
+        num,
+        size_factors,
+        block,
+        num_blocks,
+        (options.ignore_invalid ? diagnostics : NULL),
+        options.ignore_invalid,
+        options.compensated_sum,
+        options.num_threads,
+        group_sum.data(),
+        group_num.data()
+    );
+
+    for (size_t g = 0; g < num_blocks; ++g) {
+        if (group_num[g]) {
+            group_mean[g] = group_sum[g] / group_num[g];
+        } else {
+            group_mean[g] = 0;
+        }
+    }
+}
+
 /**
  * Compute the mean size factor for each block, but do not scale the size factors themselves.
  *
@@ -147,92 +567,840 @@ SizeFactor_ center_size_factors(size_t num, SizeFactor_* size_factors, SizeFacto
  */
 template<typename SizeFactor_, typename Block_>
 std::vector<SizeFactor_> center_size_factors_blocked_mean(size_t num, const SizeFactor_* size_factors, const Block_* block, SizeFactorDiagnostics* diagnostics, const CenterSizeFactorsOptions& options) {
-    static_assert(std::is_floating_point<SizeFactor_>::value);
     size_t ngroups = tatami_stats::total_groups(block, num);
     std::vector<SizeFactor_> group_mean(ngroups);
-    std::vector<size_t> group_num(ngroups);
+    CenterSizeFactorsWorkspace<SizeFactor_> workspace;
+    center_size_factors_blocked_mean(num, size_factors, block, ngroups, diagnostics, workspace, group_mean.data(), options);
+    return group_mean;
+}
 
-    if (options.ignore_invalid) {
-        SizeFactorDiagnostics tmpdiag;
-        auto& diag = (diagnostics == NULL ? tmpdiag : *diagnostics);
-        for (size_t i = 0; i < num; ++i) {
-            auto val = size_factors[i];
-            if (!internal::is_invalid(val, diag)) {
-                auto b = block[i];
-                group_mean[b] += val;
-                ++(group_num[b]);
+/**
+ * Center size factors within each block, using the strategy specified in `CenterSizeFactorsOptions::block_mode`.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param num Number of cells.
+ * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
+ * On output, this contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode`.
+ * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param[out] diagnostics Diagnostics for invalid size factors.
+ * This is only used if `CenterSizeFactorsOptions::ignore_invalid = true`, in which case it is filled with invalid diagnostics for values in `size_factors`.
+ * It can also be NULL, in which case it is ignored.
+ * @param options Further options.
+ *
+ * @return Vector of length \f$N\f$ containing the mean size factor for each block.
+ */
+template<typename SizeFactor_, typename Block_>
+std::vector<SizeFactor_> center_size_factors_blocked(size_t num, SizeFactor_* size_factors, const Block_* block, SizeFactorDiagnostics* diagnostics, const CenterSizeFactorsOptions& options) {
+    size_t ngroups = tatami_stats::total_groups(block, num);
+    std::vector<SizeFactor_> group_mean(ngroups);
+    CenterSizeFactorsWorkspace<SizeFactor_> workspace;
+    center_size_factors_blocked(num, size_factors, block, ngroups, diagnostics, workspace, group_mean.data(), options);
+    return group_mean;
+}
+
+/**
+ * Center size factors within each block, using the strategy specified in `CenterSizeFactorsOptions::block_mode`.
+ * This overload uses a pre-specified number of blocks and a re-usable workspace, 
+ * avoiding the initial scan over `block` and the allocation of any intermediate buffers.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param num Number of cells.
+ * @param[in,out] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
+ * On output, this contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode`.
+ * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param num_blocks Number of blocks, i.e., \f$N\f$.
+ * @param[out] diagnostics Diagnostics for invalid size factors, see `center_size_factors_blocked()` for details.
+ * @param workspace Workspace for intermediate buffers.
+ * This can be re-used across calls with any number of blocks.
+ * @param[out] group_mean Pointer to an array of length \f$N\f$.
+ * On output, this contains the mean size factor for each block.
+ * @param options Further options.
+ */
+template<typename SizeFactor_, typename Block_>
+void center_size_factors_blocked(
+    size_t num,
+    SizeFactor_* size_factors,
+    const Block_* block,
+    size_t num_blocks,
+    SizeFactorDiagnostics* diagnostics,
+    CenterSizeFactorsWorkspace<SizeFactor_>& workspace,
+    SizeFactor_* group_mean,
+    const CenterSizeFactorsOptions& options)
+{
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS, num);
+    center_size_factors_blocked_mean(num, size_factors, block, num_blocks, diagnostics, workspace, group_mean, options);
+
+    if (options.block_mode == CenterBlockMode::PER_BLOCK) {
+        internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+            for (size_t i = start, end = start + length; i < end; ++i) {
+                const auto& div = group_mean[block[i]];
+                if (div) {
+                    size_factors[i] /= div;
+                }
             }
-        }
-    } else {
-        for (size_t i = 0; i < num; ++i) {
-            auto b = block[i];
-            group_mean[b] += size_factors[i];
-            ++(group_num[b]);
+        });
+
+    } else if (options.block_mode == CenterBlockMode::LOWEST) {
+        auto min = internal::find_lowest_mean(num_blocks, group_mean);
+        if (min > 0) {
+            internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+                for (size_t i = start, end = start + length; i < end; ++i) {
+                    size_factors[i] /= min;
+                }
+            });
         }
     }
+}
 
-    for (size_t g = 0; g < ngroups; ++g) {
+/**
+ * Compute the mean size factor for each block, but do not scale the size factors themselves.
+ * This overload assumes that the cells are sorted by block, such that the size factors for each block are stored contiguously.
+ * The block sums are then computed from contiguous runs of size factors, avoiding scattered updates to the per-block statistics when there are many blocks.
+ * The results are identical to those of `center_size_factors_blocked_mean()` with an equivalent array of block assignments.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Offset_ Integer type for the block offsets.
+ *
+ * @param num_blocks Number of blocks, i.e., \f$N\f$.
+ * @param[in] block_offsets Pointer to an array of length \f$N + 1\f$, containing the offsets for each block.
+ * The size factors for block \f$b\f$ are stored at positions \f$[o_b, o_{b + 1})\f$ of `size_factors`, where \f$o_b\f$ is `block_offsets[b]`.
+ * The first entry should be zero and the offsets should be non-decreasing, such that the last entry is the total number of cells.
+ * @param[in] size_factors Pointer to an array of length `block_offsets[num_blocks]`, containing the size factor for each cell.
+ * @param[out] diagnostics Diagnostics for invalid size factors, see `center_size_factors_blocked_mean()` for details.
+ * @param options Further options.
+ *
+ * @return Vector of length \f$N\f$ containing the mean size factor for each block.
+ */
+template<typename SizeFactor_, typename Offset_>
+std::vector<SizeFactor_> center_size_factors_blocked_mean_sorted(
+    size_t num_blocks,
+    const Offset_* block_offsets,
+    const SizeFactor_* size_factors,
+    SizeFactorDiagnostics* diagnostics,
+    const CenterSizeFactorsOptions& options)
+{
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+    internal::check_block_offsets(num_blocks, block_offsets);
+    size_t num = block_offsets[num_blocks];
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS_MEAN, num);
+
+    std::vector<internal::SizeFactorSum<SizeFactor_> > group_sum(num_blocks);
+    std::vector<size_t> group_num(num_blocks);
+    internal::accumulate_size_factors_chunked<SizeFactor_>(
+        num,
+        num_blocks,
+        (options.ignore_invalid ? diagnostics : NULL),
+        options.compensated_sum,
+        options.num_threads,
+        group_sum.data(),
+        group_num.data(),
+        [&](
+            size_t start,
+            size_t length,
+            SizeFactorDiagnostics& diag,
+            internal::SizeFactorSum<SizeFactor_>* cursums,
+            internal::SizeFactorSum<SizeFactor_>* curcomp,
+            size_t* curcounts
+        ) -> void {
+            internal::accumulate_size_factors_sorted(start, length, size_factors, num_blocks, block_offsets, diag, options.ignore_invalid, cursums, curcomp, curcounts);
+        }
+    );
+
+    std::vector<SizeFactor_> group_mean(num_blocks);
+    for (size_t g = 0; g < num_blocks; ++g) {
         if (group_num[g]) {
-            group_mean[g] /= group_num[g];
+            group_mean[g] = group_sum[g] / group_num[g];
         }
     }
-
     return group_mean;
 }
 
 /**
  * Center size factors within each block, using the strategy specified in `CenterSizeFactorsOptions::block_mode`.
+ * This overload assumes that the cells are sorted by block, see `center_size_factors_blocked_mean_sorted()` for details.
+ * For the `PER_BLOCK` strategy, each block's size factors are scaled as a contiguous run.
+ * The results are identical to those of `center_size_factors_blocked()` with an equivalent array of block assignments.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Offset_ Integer type for the block offsets.
+ *
+ * @param num_blocks Number of blocks, i.e., \f$N\f$.
+ * @param[in] block_offsets Pointer to an array of length \f$N + 1\f$, containing the offsets for each block, see `center_size_factors_blocked_mean_sorted()` for details.
+ * @param[in,out] size_factors Pointer to an array of length `block_offsets[num_blocks]`, containing the size factor for each cell.
+ * On output, this contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode`.
+ * @param[out] diagnostics Diagnostics for invalid size factors, see `center_size_factors_blocked()` for details.
+ * @param options Further options.
+ *
+ * @return Vector of length \f$N\f$ containing the mean size factor for each block.
+ */
+template<typename SizeFactor_, typename Offset_>
+std::vector<SizeFactor_> center_size_factors_blocked_sorted(
+    size_t num_blocks,
+    const Offset_* block_offsets,
+    SizeFactor_* size_factors,
+    SizeFactorDiagnostics* diagnostics,
+    const CenterSizeFactorsOptions& options)
+{
+    size_t num = block_offsets[num_blocks];
+    internal::InstrumentationScope scope(InstrumentationEvent::CENTER_SIZE_FACTORS, num);
+    auto group_mean = center_size_factors_blocked_mean_sorted(num_blocks, block_offsets, size_factors, diagnostics, options);
+
+    if (options.block_mode == CenterBlockMode::PER_BLOCK) {
+        internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+            if (length == 0) {
+                return;
+            }
+            size_t end = start + length;
+            size_t b = internal::find_sorted_block(num_blocks, block_offsets, start);
+            size_t i = start;
+            while (i < end) {
+                size_t run_end = std::min(end, static_cast<size_t>(block_offsets[b + 1]));
+                auto div = group_mean[b];
+                if (div) {
+                    for (; i < run_end; ++i) {
+                        size_factors[i] /= div;
+                    }
+                } else {
+                    i = run_end;
+                }
+                ++b;
+            }
+        });
+
+    } else if (options.block_mode == CenterBlockMode::LOWEST) {
+        auto min = internal::find_lowest_mean(group_mean);
+        if (min > 0) {
+            internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+                for (size_t i = start, end = start + length; i < end; ++i) {
+                    size_factors[i] /= min;
+                }
+            });
+        }
+    }
+
+    return group_mean;
+}
+
+/**
+ * Center multiple sets of size factors for the same cells within each block, e.g., for different modalities in a multimodal dataset.
+ * This is equivalent to calling `center_size_factors_blocked()` on each set of size factors and gives the same results,
+ * but the total number of blocks is only computed once and each chunk of `block` is re-used for all sets while it is still in the cache.
+ * All sets are also processed with a single pool of threads rather than starting new threads for each set.
  *
  * @tparam SizeFactor_ Floating-point type for the size factors.
  * @tparam Block_ Integer type for the block assignments.
  *
  * @param num Number of cells.
- * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
- * On output, this contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode`.
+ * @param[in,out] size_factors Vector of pointers to arrays of length `num`, each containing one set of size factors for all cells.
+ * On output, each array contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode`.
  * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
  * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
- * @param[out] diagnostics Diagnostics for invalid size factors.
- * This is only used if `CenterSizeFactorsOptions::ignore_invalid = true`, in which case it is filled with invalid diagnostics for values in `size_factors`.
+ * @param[out] diagnostics Vector of diagnostics for invalid size factors in each set.
+ * This is only used if `CenterSizeFactorsOptions::ignore_invalid = true`, in which case it is resized to the number of sets and filled with the diagnostics for each set.
  * It can also be NULL, in which case it is ignored.
  * @param options Further options.
  *
- * @return Vector of length \f$N\f$ containing the mean size factor for each block.
+ * @return Vector of length equal to the number of sets.
+ * Each entry is a vector of length \f$N\f$ containing the mean size factor for each block in the corresponding set.
  */
 template<typename SizeFactor_, typename Block_>
-std::vector<SizeFactor_> center_size_factors_blocked(size_t num, SizeFactor_* size_factors, const Block_* block, SizeFactorDiagnostics* diagnostics, const CenterSizeFactorsOptions& options) {
-    auto group_mean = center_size_factors_blocked_mean(num, size_factors, block, diagnostics, options);
+std::vector<std::vector<SizeFactor_> > center_size_factors_blocked_multiple(
+    size_t num,
+    const std::vector<SizeFactor_*>& size_factors,
+    const Block_* block,
+    std::vector<SizeFactorDiagnostics>* diagnostics,
+    const CenterSizeFactorsOptions& options)
+{
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+    size_t nsets = size_factors.size();
+    size_t ngroups = tatami_stats::total_groups(block, num);
+
+    // Using the same chunks as internal::accumulate_size_factors() so that we get the same sums.
+    size_t chunk_size = internal::centering_chunk_size(num);
+    size_t num_chunks = (num + chunk_size - 1) / chunk_size;
+    size_t stride = nsets * ngroups;
+    std::vector<internal::SizeFactorSum<SizeFactor_> > partial_sums(num_chunks * stride);
+    std::vector<size_t> partial_counts(num_chunks * stride);
+    std::vector<SizeFactorDiagnostics> partial_diag(num_chunks * nsets);
+
+    auto accumulate = [&](size_t c, std::vector<internal::SizeFactorSum<SizeFactor_> >& compensation) -> void {
+        size_t first = c * chunk_size; 
+        size_t last = std::min(num, first + chunk_size);
+        for (size_t s = 0; s < nsets; ++s) {
+            size_t offset = c * stride + s * ngroups;
+            auto cursums = partial_sums.data() + offset;
+            std::fill(compensation.begin(), compensation.end(), 0);
+            internal::accumulate_size_factors<true>(
+                first,
+                last - first,
+                size_factors[s],
+                block,
+                partial_diag[c * nsets + s],
+                options.ignore_invalid,
+                cursums,
+                (options.compensated_sum ? compensation.data() : NULL),
+                partial_counts.data() + offset
+            );
+            if (options.compensated_sum) {
+                internal::fold_compensation(ngroups, cursums, compensation.data());
+            }
+        }
+    };
+
+    if (num_chunks <= 1 || options.num_threads <= 1) {
+        std::vector<internal::SizeFactorSum<SizeFactor_> > compensation(options.compensated_sum ? ngroups : 0);
+        for (size_t c = 0; c < num_chunks; ++c) {
+            accumulate(c, compensation);
+        }
+    } else {
+        tatami::parallelize([&](int, size_t start, size_t length) -> void {
+            std::vector<internal::SizeFactorSum<SizeFactor_> > compensation(options.compensated_sum ? ngroups : 0);
+            for (size_t c = start, end = start + length; c < end; ++c) {
+                accumulate(c, compensation);
+            }
+        }, num_chunks, options.num_threads);
+    }
+
+    // Deterministic reduction in order of the chunks.
+    std::vector<std::vector<SizeFactor_> > output(nsets, std::vector<SizeFactor_>(ngroups));
+    if (diagnostics && options.ignore_invalid) {
+        diagnostics->clear();
+        diagnostics->resize(nsets);
+    }
+
+    for (size_t s = 0; s < nsets; ++s) {
+        std::vector<internal::SizeFactorSum<SizeFactor_> > sums(ngroups);
+        std::vector<size_t> counts(ngroups);
+        size_t offset = s * ngroups;
+        internal::combine_chunk_sums(
+            num_chunks,
+            stride,
+            ngroups,
+            partial_sums.data() + offset,
+            partial_counts.data() + offset,
+            options.compensated_sum,
+            sums.data(),
+            counts.data()
+        );
+
+        if (diagnostics && options.ignore_invalid) {
+            auto& diag = (*diagnostics)[s];
+            for (size_t c = 0; c < num_chunks; ++c) {
+                internal::combine_diagnostics(diag, partial_diag[c * nsets + s]);
+            }
+        }
+
+        auto& group_mean = output[s];
+        for (size_t g = 0; g < ngroups; ++g) {
+            if (counts[g]) {
+                group_mean[g] = sums[g] / counts[g];
+            }
+        }
+    }
 
     if (options.block_mode == CenterBlockMode::PER_BLOCK) {
+        internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+            for (size_t s = 0; s < nsets; ++s) {
+                auto sptr = size_factors[s];
+                const auto& group_mean = output[s];
+                for (size_t i = start, end = start + length; i < end; ++i) {
+                    const auto& div = group_mean[block[i]];
+                    if (div) {
+                        sptr[i] /= div;
+                    }
+                }
+            }
+        });
+
+    } else if (options.block_mode == CenterBlockMode::LOWEST) {
+        std::vector<SizeFactor_> mins;
+        mins.reserve(nsets);
+        for (const auto& group_mean : output) {
+            mins.push_back(internal::find_lowest_mean(group_mean));
+        }
+        internal::parallel_scale(num, options.num_threads, [&](size_t start, size_t length) -> void {
+            for (size_t s = 0; s < nsets; ++s) {
+                auto min = mins[s];
+                if (min > 0) {
+                    auto sptr = size_factors[s];
+                    for (size_t i = start, end = start + length; i < end; ++i) {
+                        sptr[i] /= min;
+                    }
+                }
+            }
+        });
+    }
+
+    return output;
+}
+
+/**
+ * @brief Center size factors that are supplied in chunks.
+ *
+ * This is the streaming counterpart to `center_size_factors()` and `center_size_factors_blocked()`,
+ * for applications where the size factors for all cells cannot be held in memory at once.
+ * In the first pass, each chunk of size factors is supplied to `add()`, which only updates per-block statistics.
+ * Once all chunks have been added, `finalize()` computes the mean size factor for each block.
+ * In the second pass, each chunk is supplied again to `center()` to perform the actual scaling.
+ *
+ * The results are the same as those of `center_size_factors_blocked()` on the concatenated chunks,
+ * except for differences due to the order of summation when computing the means.
+ * The memory usage is proportional to the number of blocks, not the number of cells.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+class SizeFactorCenterer {
+public:
+    /**
+     * @param options Further options.
+     * `CenterSizeFactorsOptions::num_threads` is ignored.
+     */
+    SizeFactorCenterer(const CenterSizeFactorsOptions& options) : my_options(options) {}
+
+private:
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+    CenterSizeFactorsOptions my_options;
+
+    std::vector<internal::SizeFactorSum<SizeFactor_> > my_sums, my_chunk_sums;
+    std::vector<SizeFactor_> my_smallest, my_largest;
+    std::vector<size_t> my_counts;
+    std::vector<unsigned char> my_found;
+    SizeFactorDiagnostics my_diagnostics;
+
+    std::vector<SizeFactor_> my_scale;
+    SizeFactor_ my_smallest_valid = 1, my_largest_valid = 1;
+
+    // Only these options affect the partial statistics or their interpretation in finalize().
+    bool same_options(const CenterSizeFactorsOptions& other) const {
+        return my_options.block_mode == other.block_mode && my_options.ignore_invalid == other.ignore_invalid;
+    }
+
+    void ensure_groups(size_t ngroups) {
+        if (ngroups > my_sums.size()) {
+            my_sums.resize(ngroups);
+            my_smallest.resize(ngroups);
+            my_largest.resize(ngroups);
+            my_chunk_sums.resize(ngroups);
+            my_counts.resize(ngroups);
+            my_found.resize(ngroups);
+        }
+    }
+
+    template<bool blocked_, typename Block_>
+    void add_internal(size_t num, const SizeFactor_* size_factors, const Block_* block) {
+        ensure_groups(1);
+        std::fill(my_chunk_sums.begin(), my_chunk_sums.end(), 0);
+
         for (size_t i = 0; i < num; ++i) {
-            const auto& div = group_mean[block[i]];
-            if (div) {
-                size_factors[i] /= div;
+            auto val = size_factors[i];
+            size_t b = 0;
+            if constexpr(blocked_) {
+                b = block[i];
+                ensure_groups(b + 1);
+            }
+
+            if (internal::is_invalid(val, my_diagnostics)) {
+                if (!my_options.ignore_invalid) {
+                    my_chunk_sums[b] += val;
+                    ++(my_counts[b]);
+                }
+                continue;
+            }
+
+            my_chunk_sums[b] += val;
+            ++(my_counts[b]);
+            if (!my_found[b]) {
+                my_smallest[b] = val;
+                my_largest[b] = val;
+                my_found[b] = true;
+            } else if (val < my_smallest[b]) {
+                my_smallest[b] = val;
+            } else if (val > my_largest[b]) {
+                my_largest[b] = val;
             }
         }
 
-    } else if (options.block_mode == CenterBlockMode::LOWEST) {
-        SizeFactor_ min = 0;
+        // Summing within each chunk before adding to the total, to reduce round-off error for very many chunks.
+        for (size_t g = 0, end = my_sums.size(); g < end; ++g) {
+            my_sums[g] += my_chunk_sums[g];
+        }
+    }
+
+public:
+    /**
+     * Add a chunk of size factors, without any blocking.
+     * All size factors are considered to belong to the same block.
+     *
+     * @param num Number of cells in this chunk.
+     * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell in this chunk.
+     */
+    void add(size_t num, const SizeFactor_* size_factors) {
+        add_internal<false>(num, size_factors, static_cast<const char*>(NULL));
+    }
+
+    /**
+     * Add a chunk of size factors with their block assignments.
+     *
+     * @tparam Block_ Integer type for the block assignments.
+     *
+     * @param num Number of cells in this chunk.
+     * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell in this chunk.
+     * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell in this chunk.
+     * Blocks do not need to be present in every chunk.
+     */
+    template<typename Block_>
+    void add(size_t num, const SizeFactor_* size_factors, const Block_* block) {
+        add_internal<true>(num, size_factors, block);
+    }
+
+    /**
+     * Merge the partial statistics from another instance, e.g., computed from a different shard of cells in a distributed analysis.
+     * After merging, `finalize()` returns the same block means as if all chunks had been supplied to this instance,
+     * except for differences due to the order of summation.
+     * To obtain identical results on each node, all nodes should merge the partial statistics in the same order, e.g., by rank.
+     *
+     * @param other Another instance, constructed with the same options.
+     * An error is raised if `CenterSizeFactorsOptions::block_mode` or `CenterSizeFactorsOptions::ignore_invalid` are different.
+     */
+    void merge(const SizeFactorCenterer& other) {
+        if (!same_options(other.my_options)) {
+            throw std::runtime_error("instances should be constructed with the same options");
+        }
+        size_t ngroups = other.my_sums.size();
+        ensure_groups(ngroups);
+        for (size_t g = 0; g < ngroups; ++g) {
+            my_sums[g] += other.my_sums[g];
+            my_counts[g] += other.my_counts[g];
+            if (!other.my_found[g]) {
+                continue;
+            }
+            if (!my_found[g]) {
+                my_smallest[g] = other.my_smallest[g];
+                my_largest[g] = other.my_largest[g];
+                my_found[g] = true;
+            } else {
+                my_smallest[g] = std::min(my_smallest[g], other.my_smallest[g]);
+                my_largest[g] = std::max(my_largest[g], other.my_largest[g]);
+            }
+        }
+
+        my_diagnostics.has_negative |= other.my_diagnostics.has_negative;
+        my_diagnostics.has_zero |= other.my_diagnostics.has_zero;
+        my_diagnostics.has_nan |= other.my_diagnostics.has_nan;
+        my_diagnostics.has_infinite |= other.my_diagnostics.has_infinite;
+    }
+
+    /**
+     * Serialize the partial statistics, e.g., for sending to other nodes in a distributed analysis.
+     * The size of the serialized output is proportional to the number of blocks, not the number of cells.
+     *
+     * @return Serialized statistics, to be passed to `deserialize()`.
+     * This uses the native representation of each value, so it should only be deserialized on the same architecture.
+     */
+    std::vector<unsigned char> serialize() const {
+        internal::StatisticsWriter writer(internal::statistics_tag<SizeFactor_>(2));
+        writer.write(static_cast<unsigned char>(my_options.block_mode));
+        writer.write(static_cast<unsigned char>(my_options.ignore_invalid));
+        writer.write(my_sums);
+        writer.write(my_counts);
+        writer.write(my_smallest);
+        writer.write(my_largest);
+        writer.write(my_found);
+        writer.write(static_cast<unsigned char>(my_diagnostics.has_negative));
+        writer.write(static_cast<unsigned char>(my_diagnostics.has_zero));
+        writer.write(static_cast<unsigned char>(my_diagnostics.has_nan));
+        writer.write(static_cast<unsigned char>(my_diagnostics.has_infinite));
+        return writer.release();
+    }
+
+    /**
+     * Replace the partial statistics with those from `serialize()`.
+     * This is typically followed by `merge()` into another instance.
+     *
+     * @param[in] data Pointer to an array of serialized statistics, generated by `serialize()` on an instance with the same options.
+     * The relevant options are stored in the serialized statistics, and an error is raised if any of them are different.
+     * If an error is raised, the existing statistics in this instance are left unchanged.
+     * @param size Length of the array pointed to by `data`.
+     */
+    void deserialize(const unsigned char* data, size_t size) {
+        internal::StatisticsReader reader(data, size, internal::statistics_tag<SizeFactor_>(2));
+        CenterSizeFactorsOptions other;
+        other.block_mode = static_cast<CenterBlockMode>(reader.read<unsigned char>());
+        other.ignore_invalid = reader.read<unsigned char>();
+        if (!same_options(other)) {
+            throw std::runtime_error("serialized statistics were computed with different options");
+        }
+
+        auto sums = reader.read_vector<internal::SizeFactorSum<SizeFactor_> >();
+        auto counts = reader.read_vector<size_t>();
+        auto smallest = reader.read_vector<SizeFactor_>();
+        auto largest = reader.read_vector<SizeFactor_>();
+        auto found = reader.read_vector<unsigned char>();
+        SizeFactorDiagnostics diagnostics;
+        diagnostics.has_negative = reader.read<unsigned char>();
+        diagnostics.has_zero = reader.read<unsigned char>();
+        diagnostics.has_nan = reader.read<unsigned char>();
+        diagnostics.has_infinite = reader.read<unsigned char>();
+        reader.finish();
+
+        size_t ngroups = sums.size();
+        if (counts.size() != ngroups || smallest.size() != ngroups || largest.size() != ngroups || found.size() != ngroups) {
+            throw std::runtime_error("inconsistent number of blocks in serialized statistics");
+        }
+
+        // Only replacing the existing statistics once everything is validated.
+        my_sums.swap(sums);
+        my_counts.swap(counts);
+        my_smallest.swap(smallest);
+        my_largest.swap(largest);
+        my_found.swap(found);
+        my_diagnostics = diagnostics;
+        my_chunk_sums.clear();
+        my_chunk_sums.resize(ngroups);
+    }
+
+    /**
+     * Compute the mean size factor for each block from all chunks that were supplied to `add()`.
+     * This should be called before `center()`, `get_smallest_valid()` or `get_largest_valid()`.
+     *
+     * @return Vector containing the mean size factor for each block, see `center_size_factors_blocked_mean()`.
+     * The number of blocks is defined as one plus the largest block assignment across all chunks.
+     * If only the unblocked `add()` was used, this vector is of length 1.
+     */
+    std::vector<SizeFactor_> finalize() {
+        size_t ngroups = my_sums.size();
+        std::vector<SizeFactor_> group_mean(ngroups);
+        for (size_t g = 0; g < ngroups; ++g) {
+            if (my_counts[g]) {
+                group_mean[g] = my_sums[g] / my_counts[g];
+            }
+        }
+
+        if (my_options.block_mode == CenterBlockMode::PER_BLOCK) {
+            my_scale = group_mean;
+        } else {
+            my_scale.clear();
+            my_scale.resize(ngroups, internal::find_lowest_mean(group_mean));
+        }
+
+        // Pre-computing the extremes of the centered size factors for sanitization.
         bool found = false;
-        for (auto m : group_mean) {
-            // Ignore groups with means of zeros, either because they're full
-            // of zeros themselves or they have no cells associated with them.
-            if (m) {
-                if (!found || m < min) {
-                    min = m;
-                    found = true;
-                }
+        my_smallest_valid = 1;
+        my_largest_valid = 1;
+        for (size_t g = 0; g < ngroups; ++g) {
+            if (!my_found[g]) {
+                continue;
+            }
+            auto div = my_scale[g];
+            auto cursmall = (div > 0 ? my_smallest[g] / div : my_smallest[g]);
+            auto curlarge = (div > 0 ? my_largest[g] / div : my_largest[g]);
+            if (!found) {
+                my_smallest_valid = cursmall;
+                my_largest_valid = curlarge;
+                found = true;
+            } else {
+                my_smallest_valid = std::min(my_smallest_valid, cursmall);
+                my_largest_valid = std::max(my_largest_valid, curlarge);
             }
         }
 
-        if (min > 0) {
+        return group_mean;
+    }
+
+    /**
+     * Center a chunk of size factors, without any blocking.
+     * This should only be called after `finalize()`, and only if the unblocked `add()` was used.
+     *
+     * @param num Number of cells in this chunk.
+     * @param[in,out] size_factors Pointer to an array of length `num`, containing the size factor for each cell in this chunk.
+     * On output, this contains the centered size factors.
+     */
+    void center(size_t num, SizeFactor_* size_factors) const {
+        if (my_scale.empty()) {
+            return;
+        }
+        auto div = my_scale.front();
+        if (div) {
             for (size_t i = 0; i < num; ++i) {
-                size_factors[i] /= min;
+                size_factors[i] /= div;
             }
         }
     }
 
-    return group_mean;
-}
+    /**
+     * Center a chunk of size factors according to their blocks, using the strategy specified in `CenterSizeFactorsOptions::block_mode`.
+     * This should only be called after `finalize()`.
+     *
+     * @tparam Block_ Integer type for the block assignments.
+     *
+     * @param num Number of cells in this chunk.
+     * @param[in,out] size_factors Pointer to an array of length `num`, containing the size factor for each cell in this chunk.
+     * On output, this contains the centered size factors.
+     * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell in this chunk.
+     * All assignments should refer to blocks that were observed in the chunks supplied to `add()`.
+     */
+    template<typename Block_>
+    void center(size_t num, SizeFactor_* size_factors, const Block_* block) const {
+        for (size_t i = 0; i < num; ++i) {
+            const auto& div = my_scale[block[i]];
+            if (div) {
+                size_factors[i] /= div;
+            }
+        }
+    }
+
+    /**
+     * @return Diagnostics for invalid size factors across all chunks that were supplied to `add()`.
+     * Unlike `center_size_factors()`, this is always filled regardless of `CenterSizeFactorsOptions::ignore_invalid`.
+     */
+    const SizeFactorDiagnostics& get_diagnostics() const {
+        return my_diagnostics;
+    }
+
+    /**
+     * @return Smallest valid size factor after centering, across all chunks.
+     * This is equal to 1 if no valid size factors were observed.
+     * It should only be called after `finalize()`,
+     * and can be used as the replacement value for zero and negative size factors in `sanitize_size_factors()`.
+     */
+    SizeFactor_ get_smallest_valid() const {
+        return my_smallest_valid;
+    }
+
+    /**
+     * @return Largest valid size factor after centering, across all chunks.
+     * This is equal to 1 if no valid size factors were observed.
+     * It should only be called after `finalize()`,
+     * and can be used as the replacement value for infinite size factors in `sanitize_size_factors()`.
+     */
+    SizeFactor_ get_largest_valid() const {
+        return my_largest_valid;
+    }
+};
+
+/**
+ * @brief Persistent state for centering size factors as new cells are appended.
+ *
+ * This class keeps the per-block sums and counts of the uncentered size factors,
+ * so that new cells can be appended without revisiting the size factors of existing cells.
+ * Each call to `append()` updates the block means, centers the new size factors in place,
+ * and reports how the previously centered size factors should be rescaled to match the updated centering.
+ * The cost of each append is proportional to the number of new cells and blocks, not the total number of cells.
+ *
+ * In `CenterBlockMode::LOWEST` mode, all existing size factors are rescaled by the same factor,
+ * so existing normalized matrices can be updated lazily via `NormalizeCountsOptions::size_factor_scale` instead of modifying the size factors.
+ * In `CenterBlockMode::PER_BLOCK` mode, only the size factors in blocks that received new cells need to be rescaled.
+ *
+ * The centered size factors are the same as those from `center_size_factors_blocked()` on the concatenation of all appended cells,
+ * except for differences due to the order of summation and the accumulation of rescaling factors.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+class BlockedCenteringState {
+public:
+    /**
+     * @param options Further options.
+     * `CenterSizeFactorsOptions::num_threads` is ignored.
+     */
+    BlockedCenteringState(const CenterSizeFactorsOptions& options) : my_centerer(options), my_block_mode(options.block_mode) {}
+
+private:
+    SizeFactorCenterer<SizeFactor_> my_centerer;
+    CenterBlockMode my_block_mode;
+    std::vector<SizeFactor_> my_means, my_scale;
+
+    static SizeFactor_ effective_scale(SizeFactor_ scale) {
+        // A scale of zero means that no division was performed.
+        return (scale ? scale : static_cast<SizeFactor_>(1));
+    }
+
+public:
+    /**
+     * Append a batch of new cells.
+     *
+     * @tparam Block_ Integer type for the block assignments.
+     *
+     * @param num Number of new cells.
+     * @param[in,out] size_factors Pointer to an array of length `num`, containing the uncentered size factor for each new cell.
+     * On output, this contains the centered size factors according to the updated block means.
+     * @param[in] block Pointer to an array of length `num`, containing the block assignment for each new cell.
+     * Blocks do not need to be present in every batch, and new blocks may be introduced at any time.
+     *
+     * @return Vector of length equal to the number of blocks prior to this call.
+     * Each entry contains the factor by which the previously centered size factors in the corresponding block should be multiplied,
+     * to obtain the size factors that would be computed from the updated block means.
+     * In `CenterBlockMode::LOWEST` mode, all entries are equal.
+     */
+    template<typename Block_>
+    std::vector<SizeFactor_> append(size_t num, SizeFactor_* size_factors, const Block_* block) {
+        my_centerer.add(num, size_factors, block);
+        my_means = my_centerer.finalize();
+
+        size_t old_ngroups = my_scale.size(), ngroups = my_means.size();
+        std::vector<SizeFactor_> old_scale;
+        old_scale.swap(my_scale);
+        if (my_block_mode == CenterBlockMode::PER_BLOCK) {
+            my_scale = my_means;
+        } else {
+            my_scale.resize(ngroups, internal::find_lowest_mean(my_means));
+        }
+
+        std::vector<SizeFactor_> rescale(old_ngroups);
+        for (size_t g = 0; g < old_ngroups; ++g) {
+            rescale[g] = effective_scale(old_scale[g]) / effective_scale(my_scale[g]);
+        }
+
+        my_centerer.center(num, size_factors, block);
+        return rescale;
+    }
+
+    /**
+     * @return Mean of the uncentered size factors for each block, across all appended cells.
+     * This has the same interpretation as the return value of `center_size_factors_blocked()`. 
+     */
+    const std::vector<SizeFactor_>& get_block_means() const {
+        return my_means;
+    }
+
+    /**
+     * @return Divisor used to center the size factors in each block, based on all appended cells.
+     * A value of zero indicates that the size factors in the corresponding block are not divided.
+     */
+    const std::vector<SizeFactor_>& get_scale() const {
+        return my_scale;
+    }
+
+    /**
+     * @return Diagnostics for invalid size factors across all appended cells.
+     */
+    const SizeFactorDiagnostics& get_diagnostics() const {
+        return my_centerer.get_diagnostics();
+    }
+
+    /**
+     * @return Smallest valid size factor after centering with the current block means, across all appended cells.
+     * This can be used as the replacement value for zero and negative size factors in `sanitize_size_factors()`.
+     */
+    SizeFactor_ get_smallest_valid() const {
+        return my_centerer.get_smallest_valid();
+    }
+
+    /**
+     * @return Largest valid size factor after centering with the current block means, across all appended cells.
+     * This can be used as the replacement value for infinite size factors in `sanitize_size_factors()`.
+     */
+    SizeFactor_ get_largest_valid() const {
+        return my_centerer.get_largest_valid();
+    }
+};
 
 }
 
@@ -3,6 +3,13 @@
 
 #include <algorithm>
 #include <vector>
+#include <cmath>
+#include <utility>
+#include <cstddef>
+#include <stdexcept>
+
+#include "instrumentation.hpp"
+#include "serialize.hpp"
 
 /**
  * @file choose_pseudo_count.hpp
@@ -32,6 +39,21 @@ struct ChoosePseudoCountOptions {
      * Defaults to 1 to stabilize near-zero normalized expression values, otherwise these manifest as avoid large negative values.
      */
     double min_value = 1;
+
+    /**
+     * Whether to compute approximate quantiles of the size factors.
+     * If true, the size factors are binned into a histogram with logarithmically-spaced bins,
+     * and the quantiles are computed from the bin positions rather than the exact values.
+     * This avoids a copy of the size factors and any partial sorting, which is useful for very large datasets.
+     * Ignored if `ChoosePseudoCountOptions::quantile = 0`, as the minimum and maximum are cheap to compute exactly.
+     */
+    bool approximate = false;
+
+    /**
+     * Maximum relative error of the approximate quantiles, when `ChoosePseudoCountOptions::approximate = true`.
+     * This should lie in \f$(0, 1)\f$; smaller values yield more accurate quantiles at the cost of a larger histogram.
+     */
+    double approximate_error = 0.01;
 };
 
 /**
@@ -40,14 +62,227 @@ struct ChoosePseudoCountOptions {
 namespace internal {
 
 template<typename Float_>
-Float_ find_quantile(Float_ quantile, size_t n, Float_* ptr) {
+double interpolate_quantile(double raw, size_t index, double lower, double upper) {
+    return lower * (index - raw) + upper * (raw - (index - 1));
+}
+
+template<typename Float_>
+Float_ find_quantile(double quantile, size_t n, Float_* ptr) {
     double raw = static_cast<double>(n - 1) * quantile;
     size_t index = std::ceil(raw);
     std::nth_element(ptr, ptr + index, ptr + n);
     double upper = *(ptr + index);
-    std::nth_element(ptr, ptr + index - 1, ptr + index);
-    double lower = *(ptr + index - 1);
-    return lower * (index - raw) + upper * (raw - (index - 1));
+    // Everything before 'index' is no greater than 'upper', so the preceding order statistic is just the maximum.
+    double lower = *std::max_element(ptr, ptr + index);
+    return interpolate_quantile<Float_>(raw, index, lower, upper);
+}
+
+/*
+ * Finds two quantiles with only two partial sorts, by selecting the larger
+ * order statistic first and then only searching the partition before it for
+ * the smaller order statistic. Both quantiles should be positive.
+ */
+template<typename Float_>
+std::pair<double, double> find_quantile_pair(double first, double second, size_t n, Float_* ptr) {
+    double raw_first = static_cast<double>(n - 1) * first;
+    size_t index_first = std::ceil(raw_first);
+    double raw_second = static_cast<double>(n - 1) * second;
+    size_t index_second = std::ceil(raw_second);
+
+    bool first_is_larger = index_first >= index_second;
+    size_t big = (first_is_larger ? index_first : index_second);
+    size_t small = (first_is_larger ? index_second : index_first);
+
+    std::nth_element(ptr, ptr + big, ptr + n);
+    double big_upper = *(ptr + big);
+    double big_lower = *std::max_element(ptr, ptr + big);
+
+    double small_upper = big_upper, small_lower = big_lower;
+    if (small < big) {
+        std::nth_element(ptr, ptr + small, ptr + big);
+        small_upper = *(ptr + small);
+        small_lower = *std::max_element(ptr, ptr + small);
+    }
+
+    if (first_is_larger) {
+        return std::make_pair(
+            interpolate_quantile<Float_>(raw_first, index_first, big_lower, big_upper),
+            interpolate_quantile<Float_>(raw_second, index_second, small_lower, small_upper)
+        );
+    } else {
+        return std::make_pair(
+            interpolate_quantile<Float_>(raw_first, index_first, small_lower, small_upper),
+            interpolate_quantile<Float_>(raw_second, index_second, big_lower, big_upper)
+        );
+    }
+}
+
+/*
+ * Histogram of positive finite values with a bounded relative error. Each
+ * value is split into its binary exponent and mantissa, and each power of 2
+ * is divided into equally-sized bins to avoid calling std::log. The bin's
+ * midpoint is within 1/(2 * subbins) of any value in the bin, relative to the
+ * lower bound of the bin, so the relative error is also bounded by this.
+ */
+class SizeFactorHistogram {
+public:
+    SizeFactorHistogram(double relative_error) : my_subbins(std::max(1.0, std::ceil(0.5 / relative_error))) {}
+
+private:
+    long long my_subbins;
+    long long my_offset = 0;
+    std::vector<size_t> my_counts;
+    size_t my_total = 0;
+
+public:
+    template<typename Float_>
+    void add(Float_ x) {
+        int exponent;
+        double mantissa = std::frexp(static_cast<double>(x), &exponent); // in [0.5, 1).
+        long long sub = (mantissa - 0.5) * 2 * my_subbins;
+        sub = std::min(sub, my_subbins - 1); // protect against rounding.
+        add_bin(static_cast<long long>(exponent) * my_subbins + sub, 1);
+    }
+
+    void add_bin(long long bin, size_t count) {
+        if (my_counts.empty()) {
+            my_offset = bin;
+            my_counts.push_back(0);
+        } else if (bin < my_offset) {
+            my_counts.insert(my_counts.begin(), my_offset - bin, 0);
+            my_offset = bin;
+        } else if (bin - my_offset >= static_cast<long long>(my_counts.size())) {
+            my_counts.resize(bin - my_offset + 1);
+        }
+        my_counts[bin - my_offset] += count;
+        my_total += count;
+    }
+
+    size_t size() const {
+        return my_total;
+    }
+
+    // Merging is exact as the bin counts are just added together.
+    void merge(const SizeFactorHistogram& other) {
+        if (other.my_subbins != my_subbins) {
+            throw std::runtime_error("histograms should have the same relative error");
+        }
+        for (size_t b = 0, end = other.my_counts.size(); b < end; ++b) {
+            if (other.my_counts[b]) {
+                add_bin(other.my_offset + static_cast<long long>(b), other.my_counts[b]);
+            }
+        }
+    }
+
+    void serialize(StatisticsWriter& writer) const {
+        writer.write(static_cast<int64_t>(my_subbins));
+        writer.write(static_cast<int64_t>(my_offset));
+        writer.write(static_cast<uint64_t>(my_counts.size()));
+        for (auto c : my_counts) {
+            writer.write(static_cast<uint64_t>(c));
+        }
+    }
+
+    void deserialize(StatisticsReader& reader) {
+        if (reader.read<int64_t>() != my_subbins) {
+            throw std::runtime_error("histograms should have the same relative error");
+        }
+        my_offset = reader.read<int64_t>();
+        auto counts = reader.read_vector<uint64_t>();
+        my_counts.assign(counts.begin(), counts.end());
+        my_total = 0;
+        for (auto c : my_counts) {
+            my_total += c;
+        }
+    }
+
+    double bin_value(long long bin) const {
+        long long exponent = bin / my_subbins;
+        long long sub = bin % my_subbins;
+        if (sub < 0) {
+            sub += my_subbins;
+            --exponent;
+        }
+        return std::ldexp(0.5 + (sub + 0.5) / (2 * my_subbins), exponent);
+    }
+
+    // Same definition as find_quantile(), but using the bin midpoints.
+    double quantile(double quantile) const {
+        double raw = static_cast<double>(my_total - 1) * quantile;
+        size_t index = std::ceil(raw);
+        size_t lower_rank = (index ? index - 1 : 0);
+
+        double lower = 0, upper = 0;
+        size_t cumulative = 0;
+        bool found_lower = false;
+        for (size_t b = 0, end = my_counts.size(); b < end; ++b) {
+            cumulative += my_counts[b];
+            if (!found_lower && cumulative > lower_rank) {
+                lower = bin_value(my_offset + static_cast<long long>(b));
+                found_lower = true;
+            }
+            if (cumulative > index) {
+                upper = bin_value(my_offset + static_cast<long long>(b));
+                break;
+            }
+        }
+
+        return interpolate_quantile<double>(raw, index, lower, upper);
+    }
+};
+
+template<typename Float_>
+bool is_valid_size_factor(Float_ val) {
+    return std::isfinite(val) && val > 0;
+}
+
+template<typename Float_>
+Float_ compute_pseudo_count(double lower_sf, double upper_sf, const ChoosePseudoCountOptions& options) {
+    // Very confusing formulation in Equation 3, but whatever.
+    Float_ pseudo_count = (1.0 / lower_sf - 1.0 / upper_sf) / (8 * options.max_bias);
+    return std::max(static_cast<Float_>(options.min_value), pseudo_count);
+}
+
+// Assumes that all size factors are valid.
+template<typename Float_>
+Float_ choose_pseudo_count_exact(size_t num, Float_* size_factors, const ChoosePseudoCountOptions& options) {
+    if (num <= 1) {
+        return options.min_value;
+    }
+
+    double lower_sf, upper_sf;
+    if (options.quantile == 0) {
+        auto minmax = std::minmax_element(size_factors, size_factors + num);
+        lower_sf = *(minmax.first);
+        upper_sf = *(minmax.second);
+    } else {
+        auto quantiles = find_quantile_pair(options.quantile, 1 - options.quantile, num, size_factors);
+        lower_sf = quantiles.first;
+        upper_sf = quantiles.second;
+    }
+
+    return compute_pseudo_count<Float_>(lower_sf, upper_sf, options);
+}
+
+template<typename Float_>
+Float_ choose_pseudo_count_histogram(const SizeFactorHistogram& hist, const ChoosePseudoCountOptions& options) {
+    if (hist.size() <= 1) {
+        return options.min_value;
+    }
+    return compute_pseudo_count<Float_>(hist.quantile(options.quantile), hist.quantile(1 - options.quantile), options);
+}
+
+template<typename Float_>
+Float_ choose_pseudo_count_approximate(size_t num, const Float_* size_factors, const ChoosePseudoCountOptions& options) {
+    SizeFactorHistogram hist(options.approximate_error);
+    for (size_t i = 0; i < num; ++i) {
+        auto val = size_factors[i];
+        if (is_valid_size_factor(val)) {
+            hist.add(val);
+        }
+    }
+
+    return choose_pseudo_count_histogram<Float_>(hist, options);
 }
 
 }
@@ -79,50 +314,97 @@ Float_ find_quantile(Float_ quantile, size_t n, Float_* ptr) {
  * @param[in] size_factors Pointer to an array of size factors of length `num`.
  * Values should be positive, and all non-positive values are ignored.
  * On output, this array is arbitrarily permuted and should not be used.
+ * (Unless `ChoosePseudoCountOptions::approximate = true`, in which case it is left unchanged.)
  * @param options Further options.
  *
  * @return The suggested pseudo-count to control the log-transformation-induced bias below the specified threshold.
  */
 template<typename Float_>
 Float_ choose_pseudo_count_raw(size_t num, Float_* size_factors, const ChoosePseudoCountOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::CHOOSE_PSEUDO_COUNT, num);
     if (num <= 1) {
         return options.min_value;
     }
 
+    if (options.approximate && options.quantile != 0) {
+        return internal::choose_pseudo_count_approximate(num, size_factors, options);
+    }
+
     // Avoid problems with zeros.
     size_t counter = 0;
     for (size_t i = 0; i < num; ++i) {
         auto val = size_factors[i];
-        if (std::isfinite(val) && val > 0) {
+        if (internal::is_valid_size_factor(val)) {
             if (i != counter) {
                 size_factors[counter] = val;
             }
             ++counter;
         }
     }
-    num = counter;
 
-    if (num <= 1) {
-        return options.min_value;
-    }
+    return internal::choose_pseudo_count_exact(counter, size_factors, options);
+}
 
-    double lower_sf, upper_sf;
-    if (options.quantile == 0) {
-        lower_sf = *std::min_element(size_factors, size_factors + num);
-        upper_sf = *std::max_element(size_factors, size_factors + num);
-    } else {
-        lower_sf = internal::find_quantile(options.quantile, num, size_factors);
-        upper_sf = internal::find_quantile(1 - options.quantile, num, size_factors);
+/**
+ * @brief Workspace for repeated calls to `choose_pseudo_count()`.
+ *
+ * Re-using the same workspace across calls avoids repeated allocations of the writeable buffer for the size factors,
+ * which is helpful for applications that perform many calls on small arrays of size factors.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ */
+template<typename Float_>
+struct ChoosePseudoCountWorkspace {
+    /**
+     * @cond
+     */
+    std::vector<Float_> buffer;
+    /**
+     * @endcond
+     */
+};
+
+/**
+ * Overload of `choose_pseudo_count()` that uses a re-usable workspace, with the same results as `choose_pseudo_count_raw()` on a copy of `size_factors`.
+ * For exact quantiles, the valid size factors are copied into the workspace's buffer, which is then partially sorted to find the quantiles.
+ * If `ChoosePseudoCountOptions::approximate = true` and `ChoosePseudoCountOptions::quantile` is non-zero,
+ * the approximate quantiles are computed directly from `size_factors` via a histogram, and the workspace is not used at all.
+ *
+ * @param num Number of size factors.
+ * @param[in] size_factors Pointer to an array of size factors of length `n`.
+ * Values should be positive, and all non-positive values are ignored.
+ * @param workspace Workspace for the writeable buffer.
+ * This can be re-used across calls with any number of size factors.
+ * @param options Further options.
+ *
+ * @return The suggested pseudo-count to control the log-transformation-induced bias below the specified threshold.
+ */
+template<typename Float_>
+Float_ choose_pseudo_count(size_t num, const Float_* size_factors, ChoosePseudoCountWorkspace<Float_>& workspace, const ChoosePseudoCountOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::CHOOSE_PSEUDO_COUNT, num);
+    if (options.approximate && options.quantile != 0) {
+        return internal::choose_pseudo_count_approximate(num, size_factors, options);
     }
 
-    // Very confusing formulation in Equation 3, but whatever.
-    Float_ pseudo_count = (1.0 / lower_sf - 1.0 / upper_sf) / (8 * options.max_bias);
+    // Only copying the valid size factors, which avoids a second pass to remove the invalid ones.
+    auto& buffer = workspace.buffer;
+    buffer.clear();
+    buffer.reserve(num);
+    for (size_t i = 0; i < num; ++i) {
+        auto val = size_factors[i];
+        if (internal::is_valid_size_factor(val)) {
+            buffer.push_back(val);
+        }
+    }
 
-    return std::max(options.min_value, pseudo_count);
+    return internal::choose_pseudo_count_exact(buffer.size(), buffer.data(), options);
 }
 
 /**
- * This function just wraps `choose_pseudo_count_raw()` with the automatic creation of a writeable buffer for the size factors.
+ * Choose a pseudo-count without modifying `size_factors`.
+ * By default, this copies the valid size factors into a newly allocated buffer and computes the exact quantiles, with the same results as `choose_pseudo_count_raw()`.
+ * If `ChoosePseudoCountOptions::approximate = true` and `ChoosePseudoCountOptions::quantile` is non-zero,
+ * the approximate quantiles are instead computed directly from `size_factors` via a histogram, without allocating any buffer for the size factors.
  *
  * @param num Number of size factors.
  * @param[in] size_factors Pointer to an array of size factors of length `n`.
@@ -133,10 +415,227 @@ Float_ choose_pseudo_count_raw(size_t num, Float_* size_factors, const ChoosePse
  */
 template<typename Float_>
 Float_ choose_pseudo_count(size_t num, const Float_* size_factors, const ChoosePseudoCountOptions& options) {
-    std::vector<Float_> buffer(size_factors, size_factors + num);
-    return choose_pseudo_count_raw(num, buffer.data(), options);
+    ChoosePseudoCountWorkspace<Float_> workspace;
+    return choose_pseudo_count(num, size_factors, workspace, options);
 }
 
+/**
+ * Choose a separate pseudo-count for each block of cells, e.g., for use in `normalize_counts_blocked()`.
+ * This is equivalent to calling `choose_pseudo_count()` on the size factors for each block,
+ * but only requires a single pass over `size_factors` and `block`.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param num Number of cells.
+ * @param[in] size_factors Pointer to an array of size factors of length `num`.
+ * Values should be positive, and all non-positive values are ignored.
+ * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param options Further options.
+ *
+ * @return Vector of length \f$N\f$ containing the chosen pseudo-count for each block.
+ * Blocks with no more than one valid size factor are assigned `ChoosePseudoCountOptions::min_value`.
+ */
+template<typename Float_, typename Block_>
+std::vector<Float_> choose_pseudo_count_blocked(size_t num, const Float_* size_factors, const Block_* block, const ChoosePseudoCountOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::CHOOSE_PSEUDO_COUNT, num);
+    std::vector<Float_> output;
+
+    if (options.approximate && options.quantile != 0) {
+        std::vector<internal::SizeFactorHistogram> histograms;
+        for (size_t i = 0; i < num; ++i) {
+            size_t b = block[i];
+            if (b >= histograms.size()) {
+                histograms.resize(b + 1, internal::SizeFactorHistogram(options.approximate_error));
+            }
+            auto val = size_factors[i];
+            if (internal::is_valid_size_factor(val)) {
+                histograms[b].add(val);
+            }
+        }
+
+        output.reserve(histograms.size());
+        for (const auto& hist : histograms) {
+            output.push_back(internal::choose_pseudo_count_histogram<Float_>(hist, options));
+        }
+
+    } else {
+        std::vector<std::vector<Float_> > buffers;
+        for (size_t i = 0; i < num; ++i) {
+            size_t b = block[i];
+            if (b >= buffers.size()) {
+                buffers.resize(b + 1);
+            }
+            auto val = size_factors[i];
+            if (internal::is_valid_size_factor(val)) {
+                buffers[b].push_back(val);
+            }
+        }
+
+        output.reserve(buffers.size());
+        for (auto& buffer : buffers) {
+            output.push_back(internal::choose_pseudo_count_exact(buffer.size(), buffer.data(), options));
+        }
+    }
+
+    return output;
+}
+
+/**
+ * @brief Choose a pseudo-count from size factors that are supplied in chunks.
+ *
+ * This is the streaming counterpart to `choose_pseudo_count()`,
+ * for applications where the size factors for all cells cannot be held in memory at once.
+ * Each chunk of size factors is supplied to `add()`, after which `finalize()` returns the chosen pseudo-count.
+ *
+ * Quantiles are always computed approximately, as if `ChoosePseudoCountOptions::approximate = true`;
+ * the memory usage depends on `ChoosePseudoCountOptions::approximate_error` and the range of the size factors, not on the number of cells.
+ * If `ChoosePseudoCountOptions::quantile = 0`, the exact minimum and maximum are used instead,
+ * so the result is the same as that of `choose_pseudo_count()` on the concatenated chunks.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ */
+template<typename Float_>
+class PseudoCountChooser {
+public:
+    /**
+     * @param options Further options.
+     */
+    PseudoCountChooser(const ChoosePseudoCountOptions& options) : my_options(options), my_histogram(options.approximate_error) {}
+
+private:
+    ChoosePseudoCountOptions my_options;
+    internal::SizeFactorHistogram my_histogram;
+    size_t my_count = 0;
+    Float_ my_min = 0, my_max = 0;
+
+    // All options affect the result of finalize(), so partial statistics can only be combined if every option is the same.
+    bool same_options(const ChoosePseudoCountOptions& other) const {
+        return my_options.quantile == other.quantile &&
+            my_options.max_bias == other.max_bias &&
+            my_options.min_value == other.min_value &&
+            my_options.approximate == other.approximate &&
+            my_options.approximate_error == other.approximate_error;
+    }
+
+public:
+    /**
+     * Add a chunk of size factors.
+     *
+     * @param num Number of cells in this chunk.
+     * @param[in] size_factors Pointer to an array of length `num`, containing the size factor for each cell in this chunk.
+     * Non-positive and non-finite values are ignored.
+     */
+    void add(size_t num, const Float_* size_factors) {
+        bool use_histogram = (my_options.quantile != 0);
+        for (size_t i = 0; i < num; ++i) {
+            auto val = size_factors[i];
+            if (!internal::is_valid_size_factor(val)) {
+                continue;
+            }
+
+            if (use_histogram) {
+                my_histogram.add(val);
+            }
+            if (my_count == 0) {
+                my_min = val;
+                my_max = val;
+            } else if (val < my_min) {
+                my_min = val;
+            } else if (val > my_max) {
+                my_max = val;
+            }
+            ++my_count;
+        }
+    }
+
+    /**
+     * Merge the partial statistics from another instance, e.g., computed from a different shard of cells in a distributed analysis.
+     * After merging, `finalize()` returns the same pseudo-count as if all chunks had been supplied to this instance,
+     * regardless of the order in which instances are merged.
+     *
+     * @param other Another instance, constructed with the same options.
+     * An error is raised if any of the options are different.
+     */
+    void merge(const PseudoCountChooser& other) {
+        if (!same_options(other.my_options)) {
+            throw std::runtime_error("instances should be constructed with the same options");
+        }
+        my_histogram.merge(other.my_histogram);
+        if (other.my_count) {
+            if (my_count == 0) {
+                my_min = other.my_min;
+                my_max = other.my_max;
+            } else {
+                my_min = std::min(my_min, other.my_min);
+                my_max = std::max(my_max, other.my_max);
+            }
+            my_count += other.my_count;
+        }
+    }
+
+    /**
+     * Serialize the partial statistics, e.g., for sending to other nodes in a distributed analysis.
+     * The size of the serialized output depends on `ChoosePseudoCountOptions::approximate_error` and the range of the size factors, but not on the number of cells.
+     *
+     * @return Serialized statistics, to be passed to `deserialize()`.
+     * This uses the native representation of each value, so it should only be deserialized on the same architecture.
+     */
+    std::vector<unsigned char> serialize() const {
+        internal::StatisticsWriter writer(internal::statistics_tag<Float_>(1));
+        writer.write(my_options.quantile);
+        writer.write(my_options.max_bias);
+        writer.write(my_options.min_value);
+        writer.write(static_cast<unsigned char>(my_options.approximate));
+        writer.write(my_options.approximate_error);
+        writer.write(static_cast<uint64_t>(my_count));
+        writer.write(my_min);
+        writer.write(my_max);
+        my_histogram.serialize(writer);
+        return writer.release();
+    }
+
+    /**
+     * Replace the partial statistics with those from `serialize()`.
+     * This is typically followed by `merge()` into another instance.
+     *
+     * @param[in] data Pointer to an array of serialized statistics, generated by `serialize()` on an instance with the same options.
+     * The options are stored in the serialized statistics, and an error is raised if any of them are different.
+     * @param size Length of the array pointed to by `data`.
+     */
+    void deserialize(const unsigned char* data, size_t size) {
+        internal::StatisticsReader reader(data, size, internal::statistics_tag<Float_>(1));
+        ChoosePseudoCountOptions other;
+        other.quantile = reader.read<double>();
+        other.max_bias = reader.read<double>();
+        other.min_value = reader.read<double>();
+        other.approximate = reader.read<unsigned char>();
+        other.approximate_error = reader.read<double>();
+        if (!same_options(other)) {
+            throw std::runtime_error("serialized statistics were computed with different options");
+        }
+        my_count = reader.read<uint64_t>();
+        my_min = reader.read<Float_>();
+        my_max = reader.read<Float_>();
+        my_histogram.deserialize(reader);
+        reader.finish();
+    }
+
+    /**
+     * @return The chosen pseudo-count for all chunks that were supplied to `add()`, see `choose_pseudo_count()` for details.
+     */
+    Float_ finalize() const {
+        if (my_count <= 1) {
+            return my_options.min_value;
+        }
+        if (my_options.quantile == 0) {
+            return internal::compute_pseudo_count<Float_>(my_min, my_max, my_options);
+        }
+        return internal::choose_pseudo_count_histogram<Float_>(my_histogram, my_options);
+    }
+};
+
 }
 
 #endif
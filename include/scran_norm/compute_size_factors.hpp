@@ -0,0 +1,395 @@
+#ifndef SCRAN_NORM_COMPUTE_SIZE_FACTORS_HPP
+#define SCRAN_NORM_COMPUTE_SIZE_FACTORS_HPP
+
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <algorithm>
+
+#include "tatami/tatami.hpp"
+
+#include "center_size_factors.hpp"
+#include "sanitize_size_factors.hpp"
+
+/**
+ * @file compute_size_factors.hpp
+ * @brief Compute library size factors from a count matrix.
+ */
+
+namespace scran_norm {
+
+/**
+ * @brief Options for `compute_size_factors()` and `compute_size_factors_blocked()`.
+ */
+struct ComputeSizeFactorsOptions {
+    /**
+     * Whether to center the library sizes to obtain size factors, see `center_size_factors()` and `center_size_factors_blocked()` for details.
+     * If false, the raw library sizes are reported as the size factors.
+     */
+    bool center = true;
+
+    /**
+     * Options for centering.
+     * Only used if `ComputeSizeFactorsOptions::center = true`.
+     */
+    CenterSizeFactorsOptions center_options;
+
+    /**
+     * Number of threads to use when computing the library sizes.
+     */
+    int num_threads = 1;
+};
+
+/**
+ * @brief Results of `compute_size_factors()`.
+ * @tparam Float_ Floating-point type for the size factors.
+ */
+template<typename Float_>
+struct ComputeSizeFactorsResults {
+    /**
+     * Size factor for each cell.
+     * This is the centered library size if `ComputeSizeFactorsOptions::center = true`, otherwise it is the library size itself.
+     */
+    std::vector<Float_> size_factors;
+
+    /**
+     * Diagnostics for invalid size factors, e.g., zeros from cells with no counts.
+     * This can be passed to `sanitize_size_factors()` to avoid an extra pass over `ComputeSizeFactorsResults::size_factors`.
+     */
+    SizeFactorDiagnostics diagnostics;
+
+    /**
+     * Mean library size used for centering.
+     * This is only set if `ComputeSizeFactorsOptions::center = true`, otherwise it is set to 1.
+     */
+    Float_ mean = 1;
+};
+
+/**
+ * @brief Results of `compute_size_factors_blocked()`.
+ * @tparam Float_ Floating-point type for the size factors.
+ */
+template<typename Float_>
+struct ComputeSizeFactorsBlockedResults {
+    /**
+     * Size factor for each cell.
+     * This is the centered library size if `ComputeSizeFactorsOptions::center = true`, otherwise it is the library size itself.
+     */
+    std::vector<Float_> size_factors;
+
+    /**
+     * Diagnostics for invalid size factors, e.g., zeros from cells with no counts.
+     * This can be passed to `sanitize_size_factors()` to avoid an extra pass over `ComputeSizeFactorsBlockedResults::size_factors`.
+     */
+    SizeFactorDiagnostics diagnostics;
+
+    /**
+     * Mean library size in each block, as reported by `center_size_factors_blocked()`.
+     * This is only filled if `ComputeSizeFactorsOptions::center = true`.
+     */
+    std::vector<Float_> block_means;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Index_, typename Subset_>
+std::vector<Index_> subset_to_indices(Index_ n, const Subset_* subset) {
+    std::vector<Index_> output;
+    for (Index_ r = 0; r < n; ++r) {
+        if (subset[r]) {
+            output.push_back(r);
+        }
+    }
+    return output;
+}
+
+template<bool sparse_, typename Float_, typename Value_, typename Index_>
+void library_sizes_by_row(const tatami::Matrix<Value_, Index_>& matrix, const std::vector<Index_>* subset, Float_* output, int num_threads) {
+    Index_ NR = matrix.nrow();
+    Index_ NC = matrix.ncol();
+
+    // Each thread takes a contiguous block of columns and iterates over all (selected) rows,
+    // so all threads write to disjoint parts of 'output' and no reduction is required.
+    tatami::parallelize([&](int, Index_ start, Index_ length) -> void {
+        std::vector<Value_> vbuffer(length);
+        [[maybe_unused]] typename std::conditional<sparse_, std::vector<Index_>, int>::type ibuffer;
+        if constexpr(sparse_) {
+            ibuffer.resize(length);
+        }
+
+        std::vector<SizeFactorSum<Float_> > sums(length);
+        auto process = [&](auto& ext, Index_ r) -> void {
+            if constexpr(sparse_) {
+                auto range = ext->fetch(r, vbuffer.data(), ibuffer.data());
+                for (Index_ k = 0; k < range.number; ++k) {
+                    sums[range.index[k] - start] += range.value[k];
+                }
+            } else {
+                auto ptr = ext->fetch(r, vbuffer.data());
+                for (Index_ c = 0; c < length; ++c) {
+                    sums[c] += ptr[c];
+                }
+            }
+        };
+
+        tatami::Options opt;
+        if (subset) {
+            auto ext = tatami::new_extractor<sparse_, true>(
+                &matrix,
+                true,
+                std::make_shared<tatami::FixedViewOracle<Index_> >(subset->data(), subset->size()),
+                start,
+                length,
+                opt
+            );
+            for (auto r : *subset) {
+                process(ext, r);
+            }
+        } else {
+            auto ext = tatami::consecutive_extractor<sparse_>(&matrix, true, static_cast<Index_>(0), NR, start, length, opt);
+            for (Index_ r = 0; r < NR; ++r) {
+                process(ext, r);
+            }
+        }
+
+        std::copy(sums.begin(), sums.end(), output + start);
+    }, NC, num_threads);
+}
+
+template<bool sparse_, typename Float_, typename Value_, typename Index_>
+void library_sizes_by_column(const tatami::Matrix<Value_, Index_>& matrix, const std::vector<Index_>* subset, Float_* output, int num_threads) {
+    Index_ NR = matrix.nrow();
+    Index_ NC = matrix.ncol();
+
+    tatami::parallelize([&](int, Index_ start, Index_ length) -> void {
+        Index_ extent = (subset ? static_cast<Index_>(subset->size()) : NR);
+        std::vector<Value_> vbuffer(extent);
+        [[maybe_unused]] typename std::conditional<sparse_, std::vector<Index_>, int>::type ibuffer;
+        if constexpr(sparse_) {
+            ibuffer.resize(extent);
+        }
+
+        auto process = [&](auto& ext) -> void {
+            for (Index_ c = start, end = start + length; c < end; ++c) {
+                SizeFactorSum<Float_> sum = 0;
+                if constexpr(sparse_) {
+                    auto range = ext->fetch(c, vbuffer.data(), ibuffer.data());
+                    for (Index_ k = 0; k < range.number; ++k) {
+                        sum += range.value[k];
+                    }
+                } else {
+                    auto ptr = ext->fetch(c, vbuffer.data());
+                    for (Index_ k = 0; k < extent; ++k) {
+                        sum += ptr[k];
+                    }
+                }
+                output[c] = sum;
+            }
+        };
+
+        tatami::Options opt;
+        if constexpr(sparse_) {
+            opt.sparse_extract_index = false;
+        }
+
+        if (subset) {
+            auto ext = tatami::consecutive_extractor<sparse_>(&matrix, false, start, length, std::make_shared<const std::vector<Index_> >(*subset), opt);
+            process(ext);
+        } else {
+            auto ext = tatami::consecutive_extractor<sparse_>(&matrix, false, start, length, opt);
+            process(ext);
+        }
+    }, NC, num_threads);
+}
+
+template<typename Float_, typename Value_, typename Index_, typename Subset_>
+void compute_library_sizes(const tatami::Matrix<Value_, Index_>& matrix, const Subset_* subset, Float_* output, int num_threads) {
+    std::vector<Index_> subset_indices;
+    if (subset) {
+        subset_indices = subset_to_indices(matrix.nrow(), subset);
+    }
+    const std::vector<Index_>* subset_ptr = (subset ? &subset_indices : NULL);
+
+    Index_ NC = matrix.ncol();
+    std::fill_n(output, NC, static_cast<Float_>(0));
+
+    if (matrix.prefer_rows()) {
+        if (matrix.is_sparse()) {
+            library_sizes_by_row<true>(matrix, subset_ptr, output, num_threads);
+        } else {
+            library_sizes_by_row<false>(matrix, subset_ptr, output, num_threads);
+        }
+    } else {
+        if (matrix.is_sparse()) {
+            library_sizes_by_column<true>(matrix, subset_ptr, output, num_threads);
+        } else {
+            library_sizes_by_column<false>(matrix, subset_ptr, output, num_threads);
+        }
+    }
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute the library size for each cell, i.e., the column sums of the count matrix.
+ * This is done in a single parallelized pass over the matrix that respects its preferred layout (row- or column-major) and sparsity.
+ *
+ * @tparam Float_ Floating-point type for the library sizes.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ * @tparam Subset_ Boolean type for the row subset.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param[in] subset Pointer to an array of length equal to the number of rows in `matrix`, specifying whether each row should be used to compute the library size.
+ * This can be used to, e.g., exclude mitochondrial genes or spike-in transcripts.
+ * Alternatively NULL, in which case all rows are used.
+ * @param[out] library_sizes Pointer to an array of length equal to the number of columns in `matrix`.
+ * On output, this contains the library size for each cell.
+ * @param num_threads Number of threads to use.
+ */
+template<typename Float_, typename Value_, typename Index_, typename Subset_>
+void compute_library_sizes(const tatami::Matrix<Value_, Index_>& matrix, const Subset_* subset, Float_* library_sizes, int num_threads) {
+    static_assert(std::is_floating_point<Float_>::value);
+    internal::compute_library_sizes(matrix, subset, library_sizes, num_threads);
+}
+
+/**
+ * Overload of `compute_library_sizes()` that uses all rows of `matrix`.
+ *
+ * @tparam Float_ Floating-point type for the library sizes.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param[out] library_sizes Pointer to an array of length equal to the number of columns in `matrix`.
+ * On output, this contains the library size for each cell.
+ * @param num_threads Number of threads to use.
+ */
+template<typename Float_, typename Value_, typename Index_>
+void compute_library_sizes(const tatami::Matrix<Value_, Index_>& matrix, Float_* library_sizes, int num_threads) {
+    compute_library_sizes(matrix, static_cast<const char*>(NULL), library_sizes, num_threads);
+}
+
+/**
+ * Compute size factors from the library sizes of each cell, i.e., the "library size factors".
+ * This combines `compute_library_sizes()` with `center_size_factors()`,
+ * where the diagnostics from the centering can be directly passed to `sanitize_size_factors()` without another pass over the size factors.
+ * Note that the centering is still a separate pass over the library sizes after the pass over `matrix`, as the mean must be known before any library size can be scaled.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ * @tparam Subset_ Boolean type for the row subset.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param[in] subset Pointer to an array of length equal to the number of rows in `matrix`, specifying whether each row should be used to compute the library size.
+ * Alternatively NULL, in which case all rows are used.
+ * @param options Further options.
+ *
+ * @return Size factors for all cells, along with some diagnostics.
+ */
+template<typename Float_ = double, typename Value_, typename Index_, typename Subset_>
+ComputeSizeFactorsResults<Float_> compute_size_factors(const tatami::Matrix<Value_, Index_>& matrix, const Subset_* subset, const ComputeSizeFactorsOptions& options) {
+    ComputeSizeFactorsResults<Float_> output;
+    size_t NC = matrix.ncol();
+    output.size_factors.resize(NC);
+    compute_library_sizes(matrix, subset, output.size_factors.data(), options.num_threads);
+
+    if (options.center && options.center_options.ignore_invalid) {
+        output.mean = center_size_factors(NC, output.size_factors.data(), &(output.diagnostics), options.center_options);
+    } else {
+        if (options.center) {
+            output.mean = center_size_factors(NC, output.size_factors.data(), NULL, options.center_options);
+        }
+        output.diagnostics = check_size_factor_sanity(NC, output.size_factors.data());
+    }
+
+    return output;
+}
+
+/**
+ * Overload of `compute_size_factors()` that uses all rows of `matrix`.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param options Further options.
+ *
+ * @return Size factors for all cells, along with some diagnostics.
+ */
+template<typename Float_ = double, typename Value_, typename Index_>
+ComputeSizeFactorsResults<Float_> compute_size_factors(const tatami::Matrix<Value_, Index_>& matrix, const ComputeSizeFactorsOptions& options) {
+    return compute_size_factors<Float_>(matrix, static_cast<const char*>(NULL), options);
+}
+
+/**
+ * Compute size factors from the library sizes of each cell in the presence of multiple blocks.
+ * This combines `compute_library_sizes()` with `center_size_factors_blocked()`,
+ * where the diagnostics from the centering can be directly passed to `sanitize_size_factors()` without another pass over the size factors.
+ * Note that the centering is still a separate pass over the library sizes after the pass over `matrix`, as the mean must be known before any library size can be scaled.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ * @tparam Block_ Integer type for the block assignments.
+ * @tparam Subset_ Boolean type for the row subset.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param[in] subset Pointer to an array of length equal to the number of rows in `matrix`, specifying whether each row should be used to compute the library size.
+ * Alternatively NULL, in which case all rows are used.
+ * @param[in] block Pointer to an array of length equal to the number of columns in `matrix`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param options Further options.
+ *
+ * @return Size factors for all cells, along with some diagnostics.
+ */
+template<typename Float_ = double, typename Value_, typename Index_, typename Block_, typename Subset_>
+ComputeSizeFactorsBlockedResults<Float_> compute_size_factors_blocked(const tatami::Matrix<Value_, Index_>& matrix, const Subset_* subset, const Block_* block, const ComputeSizeFactorsOptions& options) {
+    ComputeSizeFactorsBlockedResults<Float_> output;
+    size_t NC = matrix.ncol();
+    output.size_factors.resize(NC);
+    compute_library_sizes(matrix, subset, output.size_factors.data(), options.num_threads);
+
+    if (options.center && options.center_options.ignore_invalid) {
+        output.block_means = center_size_factors_blocked(NC, output.size_factors.data(), block, &(output.diagnostics), options.center_options);
+    } else {
+        if (options.center) {
+            output.block_means = center_size_factors_blocked(NC, output.size_factors.data(), block, NULL, options.center_options);
+        }
+        output.diagnostics = check_size_factor_sanity(NC, output.size_factors.data());
+    }
+
+    return output;
+}
+
+/**
+ * Overload of `compute_size_factors_blocked()` that uses all rows of `matrix`.
+ *
+ * @tparam Float_ Floating-point type for the size factors.
+ * @tparam Value_ Data type for the count matrix.
+ * @tparam Index_ Integer type for the count matrix.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param matrix A `tatami::Matrix` containing counts, where rows are genes and columns are cells.
+ * @param[in] block Pointer to an array of length equal to the number of columns in `matrix`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param options Further options.
+ *
+ * @return Size factors for all cells, along with some diagnostics.
+ */
+template<typename Float_ = double, typename Value_, typename Index_, typename Block_>
+ComputeSizeFactorsBlockedResults<Float_> compute_size_factors_blocked(const tatami::Matrix<Value_, Index_>& matrix, const Block_* block, const ComputeSizeFactorsOptions& options) {
+    return compute_size_factors_blocked<Float_>(matrix, static_cast<const char*>(NULL), block, options);
+}
+
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SCRAN_NORM_INSTRUMENTATION_HPP
+#define SCRAN_NORM_INSTRUMENTATION_HPP
+
+#include <cstddef>
+
+#ifdef SCRAN_NORM_CUSTOM_INSTRUMENTATION
+#include <chrono>
+#endif
+
+/**
+ * @file instrumentation.hpp
+ * @brief Optional compile-time instrumentation of the normalization routines.
+ *
+ * Users can define the `SCRAN_NORM_CUSTOM_INSTRUMENTATION` macro to the name of a function that accepts a `const scran_norm::InstrumentationRecord&`.
+ * This function should be declared before including any **scran_norm** header (forward-declaring `scran_norm::InstrumentationRecord` as a `struct`),
+ * and is called upon completion of each instrumented routine.
+ * The macro should be consistently defined in all translation units that include **scran_norm** headers.
+ * It may be called from multiple threads, e.g., when a delayed normalized matrix is extracted in parallel, so it should be thread-safe.
+ * If the macro is not defined, all instrumentation is compiled out and there is no overhead.
+ */
+
+namespace scran_norm {
+
+/**
+ * Routines that report to the instrumentation hook, see `InstrumentationRecord`:
+ *
+ * - `NORMALIZE_DENSE`: dense extraction of a single row or column from `DelayedLogNormalize`.
+ *   The count is the number of extracted values.
+ * - `NORMALIZE_SPARSE`: sparse extraction of a single row or column from `DelayedLogNormalize`.
+ *   The count is the number of structural non-zero values.
+ * - `NORMALIZE_LOOKUP_MISS`: values that were not found in the lookup table of `DelayedLogNormalize` (see `NormalizeCountsOptions::lookup_table_size`) during a single extraction.
+ *   The count is the number of misses, and the elapsed time is always zero.
+ * - `CENTER_SIZE_FACTORS_MEAN`: `center_size_factors_mean()`, `center_size_factors_blocked_mean()` or `center_size_factors_blocked_mean_sorted()`.
+ *   The count is the number of size factors.
+ * - `CENTER_SIZE_FACTORS`: `center_size_factors()`, `center_size_factors_blocked()` or `center_size_factors_blocked_sorted()`.
+ *   The count is the number of size factors, and the elapsed time includes the nested `CENTER_SIZE_FACTORS_MEAN`.
+ * - `SANITIZE_SIZE_FACTORS`: `sanitize_size_factors()`.
+ *   The count is the number of size factors.
+ * - `CHOOSE_PSEUDO_COUNT`: `choose_pseudo_count()`, `choose_pseudo_count_raw()` or `choose_pseudo_count_blocked()`.
+ *   The count is the number of size factors.
+ */
+enum class InstrumentationEvent : char {
+    NORMALIZE_DENSE,
+    NORMALIZE_SPARSE,
+    NORMALIZE_LOOKUP_MISS,
+    CENTER_SIZE_FACTORS_MEAN,
+    CENTER_SIZE_FACTORS,
+    SANITIZE_SIZE_FACTORS,
+    CHOOSE_PSEUDO_COUNT
+};
+
+/**
+ * @brief Record passed to the instrumentation hook.
+ */
+struct InstrumentationRecord {
+    /**
+     * Instrumented routine.
+     */
+    InstrumentationEvent event;
+
+    /**
+     * Whether a row was extracted.
+     * Only relevant for the `NORMALIZE_*` events, otherwise this is always false.
+     */
+    bool row;
+
+    /**
+     * Number of elements that were processed by the routine, see `InstrumentationEvent` for details.
+     */
+    size_t count;
+
+    /**
+     * Wall-clock time spent in the routine, in nanoseconds.
+     */
+    long long elapsed;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+#ifdef SCRAN_NORM_CUSTOM_INSTRUMENTATION
+constexpr bool instrumented = true;
+
+class InstrumentationScope {
+public:
+    InstrumentationScope(InstrumentationEvent event, size_t count, bool row = false) :
+        my_event(event), my_row(row), my_count(count), my_start(std::chrono::steady_clock::now()) {}
+
+    ~InstrumentationScope() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - my_start);
+        SCRAN_NORM_CUSTOM_INSTRUMENTATION(InstrumentationRecord{ my_event, my_row, my_count, static_cast<long long>(elapsed.count()) });
+    }
+
+    InstrumentationScope(const InstrumentationScope&) = delete;
+    InstrumentationScope& operator=(const InstrumentationScope&) = delete;
+
+private:
+    InstrumentationEvent my_event;
+    bool my_row;
+    size_t my_count;
+    std::chrono::steady_clock::time_point my_start;
+};
+
+inline void instrument_count(InstrumentationEvent event, size_t count, bool row = false) {
+    SCRAN_NORM_CUSTOM_INSTRUMENTATION(InstrumentationRecord{ event, row, count, 0 });
+}
+
+#else
+constexpr bool instrumented = false;
+
+// Empty class that is optimized away completely.
+class InstrumentationScope {
+public:
+    InstrumentationScope(InstrumentationEvent, size_t, bool = false) {}
+};
+
+inline void instrument_count(InstrumentationEvent, size_t, bool = false) {}
+#endif
+
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
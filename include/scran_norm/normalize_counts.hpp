@@ -4,9 +4,16 @@
 #include <type_traits>
 #include <vector>
 #include <memory>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
 
 #include "tatami/tatami.hpp"
 
+#include "instrumentation.hpp"
+
 /**
  * @file normalize_counts.hpp
  * @brief Normalize and log-transform counts.
@@ -46,11 +53,966 @@ struct NormalizeCountsOptions {
      * Only used if `NormalizeCountsOptions::log = true`.
      */
     double log_base = 2;
+
+    /**
+     * Multiplier to apply to all size factors.
+     * This is useful when the size factors have been globally rescaled, e.g., by `BlockedCenteringState::append()`,
+     * as an existing (possibly shared) array of size factors can be re-used without modifying every element.
+     */
+    double size_factor_scale = 1;
+
+    /**
+     * Number of threads to use.
+     * Only used by `normalize_counts_realized()`, `normalize_counts_sparse_inplace()` and `normalize_counts_dense_inplace()`,
+     * as the delayed matrix returned by `normalize_counts()` does no work until its values are extracted.
+     */
+    int num_threads = 1;
+
+    /**
+     * Size of the per-cell lookup table for small counts.
+     * If positive, the normalized values for all counts in \f$[0, t)\f$ are precomputed for each cell, where \f$t\f$ is `lookup_table_size`.
+     * Extraction of such counts is then reduced to a table lookup, avoiding the log-transformation for the most common values in typical UMI count data. 
+     * Larger counts are still transformed directly.
+     * This is only used for integer types of counts and if `NormalizeCountsOptions::log = true`. 
+     *
+     * The table requires \f$nt\f$ values for \f$n\f$ cells, so it is only worthwhile if the same matrix is accessed repeatedly.
+     * Small values (e.g., 8 to 16) are sufficient for most datasets as counts of 1 or 2 make up the bulk of the non-zero entries.
+     * The table is filled with the same calculations that are used for direct transformation, so the lookup has no effect on the results.
+     */
+    size_t lookup_table_size = 0;
+
+    /**
+     * Whether to precompute the reciprocal of each cell's size factor.
+     * Normalization of each count is then reduced to a multiplication, and row extraction reads from a contiguous array of reciprocals instead of gathering and dividing by the size factors.
+     * This is most useful for repeated row access to matrices stored in a gene-major (e.g., compressed sparse row) layout.
+     *
+     * The reciprocals require one value per cell, at the precision of the output type.
+     * Results may differ slightly from the default division, though row and column extraction will still be consistent with each other.
+     * This has no effect if `NormalizeCountsOptions::log = true` with a non-unity `pseudo_count` (without `preserve_sparsity`),
+     * as a division-free calculation is already used in that case.
+     */
+    bool precompute_reciprocals = false;
+
+    /**
+     * Whether to use a fast approximation of the log-transformation instead of `std::log()` and `std::log1p()`.
+     * Each approximate log has a maximum relative error of \f$10^{-5}\f$ and a maximum absolute error of \f$5 \times 10^{-6}\f$.
+     * For a unity pseudo-count or with `NormalizeCountsOptions::preserve_sparsity = true`, the output is a single log-transformed value,
+     * so the relative error bound also applies to each output value, including the small values near zero.
+     * For other pseudo-counts, the output is computed as the difference of two logs (see `DelayedLogNormalize`),
+     * so only the absolute error bound of \f$10^{-5}\f$ in the natural log is guaranteed, i.e., \f$10^{-5} / \log(b)\f$ in the output for log-base \f$b\f$.
+     * This is usually negligible for downstream analyses like PCA and clustering, and can be several times faster than the exact log.
+     * Zero, negative, subnormal and non-finite inputs are passed to the exact log, so their results are the same as those from `std::log()`.
+     * Zeros are still transformed to exactly zero when sparsity is preserved.
+     * Only used if `NormalizeCountsOptions::log = true` and the output type is `float` or `double`.
+     */
+    bool approximate_log = false;
+};
+
+/**
+ * @brief Resolved parameters for the normalization.
+ *
+ * This describes the calculations performed by `DelayedLogNormalize` for a given `NormalizeCountsOptions`, after folding the pseudo-count into the size factors for `NormalizeCountsOptions::preserve_sparsity`.
+ * For each count \f$x\f$ in a cell with size factor \f$s\f$, the normalized value is defined as \f$y = x / (sk)\f$ where \f$k\f$ is `size_factor_scale`.
+ * If `log = true`, this is further transformed to \f$\log(y + c) / L\f$, where \f$c\f$ is `pseudo_count` and \f$L\f$ is `log_of_base`;
+ * for \f$c = 1\f$, this is computed as \f$\mathrm{log1p}(y) / L\f$.
+ *
+ * These parameters are intended for external implementations of the normalization, e.g., GPU kernels for bulk processing of raw buffers,
+ * so that they can reproduce the semantics of `NormalizeCountsOptions` without re-implementing its interpretation.
+ *
+ * @tparam Float_ Floating-point type for the parameters.
+ */
+template<typename Float_>
+struct ResolvedNormalizeCountsOptions {
+    /**
+     * Whether to log-transform the normalized values.
+     */
+    bool log = true;
+
+    /**
+     * Pseudo-count to add to each normalized value before log-transformation.
+     * This is always 1 if the pseudo-count was folded into the size factors.
+     */
+    Float_ pseudo_count = 1;
+
+    /**
+     * Natural log of the base for the log-transformation.
+     */
+    Float_ log_of_base = 1;
+
+    /**
+     * Multiplier for each size factor.
+     */
+    Float_ size_factor_scale = 1;
+};
+
+/**
+ * @tparam Float_ Floating-point type for the parameters.
+ * @param options Options for normalization.
+ * @return The resolved normalization parameters.
+ */
+template<typename Float_ = double>
+ResolvedNormalizeCountsOptions<Float_> resolve_normalize_counts_options(const NormalizeCountsOptions& options) {
+    ResolvedNormalizeCountsOptions<Float_> output;
+    output.size_factor_scale = options.size_factor_scale;
+    output.log = options.log;
+    if (!options.log) {
+        return output;
+    }
+
+    output.log_of_base = std::log(static_cast<Float_>(options.log_base));
+    output.pseudo_count = options.pseudo_count;
+    if (options.preserve_sparsity && output.pseudo_count != 1) {
+        // log(x / s + c) = log1p(x / (s * c)) + log(c), and we drop the log(c) to preserve sparsity.
+        output.size_factor_scale *= options.pseudo_count;
+        output.pseudo_count = 1;
+    }
+    return output;
+}
+
+/**
+ * @cond
+ */
+namespace internal {
+
+// The *_BASE2 and *_NATURAL transforms are specializations for the most
+// common log-bases, where the division by log(base) is replaced by a
+// multiplication by a compile-time constant or omitted altogether.
+enum class LogNormalizeTransform : char { NONE, LOG1P, LOG1P_BASE2, LOG1P_NATURAL, LOG, LOG_BASE2, LOG_NATURAL };
+
+inline constexpr bool is_shifted_log(LogNormalizeTransform transform) {
+    return transform == LogNormalizeTransform::LOG || transform == LogNormalizeTransform::LOG_BASE2 || transform == LogNormalizeTransform::LOG_NATURAL;
+}
+
+template<typename OutputValue_>
+LogNormalizeTransform choose_log_transform(OutputValue_ log_base, bool unit_pseudo_count) {
+    // Checking log(base) rather than the base itself, so that any base that
+    // gives a natural log (e.g., M_E or std::exp(1)) uses the faster path.
+    if (log_base == 1) {
+        return (unit_pseudo_count ? LogNormalizeTransform::LOG1P_NATURAL : LogNormalizeTransform::LOG_NATURAL);
+    } else if (log_base == std::log(static_cast<OutputValue_>(2))) {
+        return (unit_pseudo_count ? LogNormalizeTransform::LOG1P_BASE2 : LogNormalizeTransform::LOG_BASE2);
+    } else {
+        return (unit_pseudo_count ? LogNormalizeTransform::LOG1P : LogNormalizeTransform::LOG);
+    }
+}
+
+template<typename OutputValue_>
+struct LogNormalizeParameters {
+    OutputValue_ pseudo_count = 1;
+    OutputValue_ log_base = 1;
+
+    // Multiplier for each size factor, also used to fold in the pseudo-count when preserving sparsity.
+    OutputValue_ size_factor_scale = 1;
+};
+
+// Fast approximation of the natural log for positive, finite, normal values.
+// We split x into 2^e * m for m in [sqrt(0.5), sqrt(2)), and then compute
+// log(m) = 2 * atanh((m - 1) / (m + 1)) with the first three terms of its
+// series. This has an absolute error below 5e-6 (about 1.3e-6 for doubles)
+// and a relative error below 4e-6, as e = 0 whenever x is close to 1. Other
+// values are rare, so we just use a (predictable) branch to the exact log.
+template<typename Float_>
+Float_ approximate_log(Float_ x) {
+    static_assert(std::is_same<Float_, double>::value || std::is_same<Float_, float>::value);
+    if (!(x >= std::numeric_limits<Float_>::min() && x <= std::numeric_limits<Float_>::max())) {
+        return std::log(x);
+    }
+    typedef typename std::conditional<std::is_same<Float_, double>::value, uint64_t, uint32_t>::type Bits;
+    constexpr int mantissa_bits = std::numeric_limits<Float_>::digits - 1;
+    constexpr Bits exponent_bias = std::numeric_limits<Float_>::max_exponent - 1;
+    constexpr Bits mantissa_mask = (static_cast<Bits>(1) << mantissa_bits) - 1;
+
+    Bits bits;
+    std::memcpy(&bits, &x, sizeof(Float_));
+    Float_ exponent = static_cast<Float_>(static_cast<int>(bits >> mantissa_bits) - static_cast<int>(exponent_bias));
+    Bits mantissa_bits_only = (bits & mantissa_mask) | (exponent_bias << mantissa_bits);
+    Float_ mantissa;
+    std::memcpy(&mantissa, &mantissa_bits_only, sizeof(Float_));
+
+    constexpr Float_ sqrt2 = 1.414213562373095048801688724209698079;
+    bool upper = mantissa > sqrt2;
+    mantissa = (upper ? mantissa * static_cast<Float_>(0.5) : mantissa);
+    exponent = (upper ? exponent + 1 : exponent);
+
+    Float_ t = (mantissa - 1) / (mantissa + 1);
+    Float_ t2 = t * t;
+    constexpr Float_ ln2 = 0.693147180559945309417232121458176568;
+    constexpr Float_ third = static_cast<Float_>(1) / 3, fifth = static_cast<Float_>(1) / 5;
+    return exponent * ln2 + 2 * t * (1 + t2 * (third + t2 * fifth));
+}
+
+// Other floating-point types (e.g., long double) always use the exact log.
+template<typename Float_>
+constexpr bool has_approximate_log = std::is_same<Float_, double>::value || std::is_same<Float_, float>::value;
+
+template<bool approximate_, typename Float_>
+Float_ compute_log(Float_ x) {
+    if constexpr(approximate_ && has_approximate_log<Float_>) {
+        return approximate_log(x);
+    } else {
+        return std::log(x);
+    }
+}
+
+template<bool approximate_, typename Float_>
+Float_ compute_log1p(Float_ x) {
+    if constexpr(approximate_ && has_approximate_log<Float_>) {
+        // Correcting for the rounding error in 1 + x, so that the relative
+        // error of approximate_log() also holds for small x.
+        if (!std::isfinite(x)) {
+            return std::log1p(x);
+        }
+        Float_ u = 1 + x;
+        if (u == 1) {
+            return x;
+        }
+        return approximate_log(u) * (x / (u - 1));
+    } else {
+        return std::log1p(x);
+    }
+}
+
+template<LogNormalizeTransform transform_, typename OutputValue_>
+OutputValue_ rescale_log(OutputValue_ val, const LogNormalizeParameters<OutputValue_>& params) {
+    constexpr OutputValue_ log2_e = 1.442695040888963407359924681001892137;
+    if constexpr(transform_ == LogNormalizeTransform::LOG1P || transform_ == LogNormalizeTransform::LOG) {
+        return val / params.log_base;
+    } else if constexpr(transform_ == LogNormalizeTransform::LOG1P_BASE2 || transform_ == LogNormalizeTransform::LOG_BASE2) {
+        return val * log2_e;
+    } else {
+        return val;
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_>
+OutputValue_ log_normalize(OutputValue_ val, const LogNormalizeParameters<OutputValue_>& params) {
+    if constexpr(transform_ == LogNormalizeTransform::NONE) {
+        return val;
+    } else if constexpr(is_shifted_log(transform_)) {
+        return rescale_log<transform_>(compute_log<approximate_>(val + params.pseudo_count), params);
+    } else {
+        return rescale_log<transform_>(compute_log1p<approximate_>(val), params);
+    }
+}
+
+// For the shifted log-transforms, we use log(x / s + c) = log(x + s * c) - log(s)
+// with precomputed per-cell values of s * c and log(s), which avoids a division
+// for each element. Zeros are set to the result of log_normalize() so that they
+// are exactly equal to the fill value for sparse inputs; this is a select
+// rather than a branch, so it doesn't interfere with vectorization.
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_>
+OutputValue_ log_normalize_shifted(OutputValue_ val, OutputValue_ shift, OutputValue_ log_size_factor, OutputValue_ zero, const LogNormalizeParameters<OutputValue_>& params) {
+    static_assert(is_shifted_log(transform_));
+    OutputValue_ output = rescale_log<transform_>(compute_log<approximate_>(val + shift) - log_size_factor, params);
+    return (val == 0 ? zero : output);
+}
+
+/*
+ * The kernels below are written as simple counted loops without any
+ * data-dependent branches, so that compilers can vectorize them for whatever
+ * instruction set is being targeted (e.g., with vector math libraries like
+ * libmvec or SVML providing the log). All mode checks are hoisted out of the
+ * loops via the transform_ template parameter.
+ */
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_constant(Index_ num, const InputValue_* input, OutputValue_ size_factor, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) / size_factor, params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_, class SizeFactors_>
+void log_normalize_block(Index_ num, const InputValue_* input, const SizeFactors_& size_factors, Index_ start, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) / (static_cast<OutputValue_>(size_factors[start + j]) * params.size_factor_scale), params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_, class SizeFactors_>
+void log_normalize_gathered(Index_ num, const InputValue_* input, const SizeFactors_& size_factors, const Index_* index, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) / (static_cast<OutputValue_>(size_factors[index[j]]) * params.size_factor_scale), params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_reciprocal_constant(Index_ num, const InputValue_* input, OutputValue_ reciprocal, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) * reciprocal, params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_reciprocal_block(Index_ num, const InputValue_* input, const OutputValue_* reciprocals, Index_ start, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    reciprocals += start;
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) * reciprocals[j], params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_reciprocal_gathered(Index_ num, const InputValue_* input, const OutputValue_* reciprocals, const Index_* index, const LogNormalizeParameters<OutputValue_>& params, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize<transform_, approximate_>(static_cast<OutputValue_>(input[j]) * reciprocals[index[j]], params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_shifted_constant(
+    Index_ num,
+    const InputValue_* input,
+    OutputValue_ shift,
+    OutputValue_ log_size_factor,
+    OutputValue_ zero,
+    const LogNormalizeParameters<OutputValue_>& params,
+    OutputValue_* output)
+{
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize_shifted<transform_, approximate_>(static_cast<OutputValue_>(input[j]), shift, log_size_factor, zero, params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_shifted_block(
+    Index_ num,
+    const InputValue_* input,
+    const OutputValue_* shifts,
+    const OutputValue_* log_size_factors,
+    Index_ start,
+    OutputValue_ zero,
+    const LogNormalizeParameters<OutputValue_>& params,
+    OutputValue_* output)
+{
+    shifts += start;
+    log_size_factors += start;
+    for (Index_ j = 0; j < num; ++j) {
+        output[j] = log_normalize_shifted<transform_, approximate_>(static_cast<OutputValue_>(input[j]), shifts[j], log_size_factors[j], zero, params);
+    }
+}
+
+template<LogNormalizeTransform transform_, bool approximate_, typename OutputValue_, typename InputValue_, typename Index_>
+void log_normalize_shifted_gathered(
+    Index_ num,
+    const InputValue_* input,
+    const OutputValue_* shifts,
+    const OutputValue_* log_size_factors,
+    const Index_* index,
+    OutputValue_ zero,
+    const LogNormalizeParameters<OutputValue_>& params,
+    OutputValue_* output)
+{
+    for (Index_ j = 0; j < num; ++j) {
+        auto c = index[j];
+        output[j] = log_normalize_shifted<transform_, approximate_>(static_cast<OutputValue_>(input[j]), shifts[c], log_size_factors[c], zero, params);
+    }
+}
+
+template<typename InputValue_>
+bool in_lookup_table(InputValue_ x, size_t table_size) {
+    if constexpr(std::is_signed<InputValue_>::value) {
+        if (x < 0) {
+            return false;
+        }
+    }
+    return static_cast<size_t>(x) < table_size;
+}
+
+// The lookup kernels accept a 'direct' function to compute the normalized
+// value for counts outside of the table, given the count (and the cell index,
+// for the block and gathered kernels). This should use the same calculation
+// that was used to fill the table.
+template<typename OutputValue_, typename InputValue_, typename Index_, class Direct_>
+void log_normalize_constant_lookup(Index_ num, const InputValue_* input, const OutputValue_* table, size_t table_size, Direct_ direct, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        auto x = input[j];
+        if (in_lookup_table(x, table_size)) {
+            output[j] = table[static_cast<size_t>(x)];
+        } else {
+            output[j] = direct(static_cast<OutputValue_>(x));
+        }
+    }
+}
+
+template<typename OutputValue_, typename InputValue_, typename Index_, class Direct_>
+void log_normalize_block_lookup(Index_ num, const InputValue_* input, Index_ start, const OutputValue_* table, size_t table_size, Direct_ direct, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        auto x = input[j];
+        Index_ c = start + j;
+        if (in_lookup_table(x, table_size)) {
+            output[j] = table[static_cast<size_t>(c) * table_size + static_cast<size_t>(x)];
+        } else {
+            output[j] = direct(static_cast<OutputValue_>(x), c);
+        }
+    }
+}
+
+template<typename OutputValue_, typename InputValue_, typename Index_, class Direct_>
+void log_normalize_gathered_lookup(Index_ num, const InputValue_* input, const Index_* index, const OutputValue_* table, size_t table_size, Direct_ direct, OutputValue_* output) {
+    for (Index_ j = 0; j < num; ++j) {
+        auto x = input[j];
+        Index_ c = index[j];
+        if (in_lookup_table(x, table_size)) {
+            output[j] = table[static_cast<size_t>(c) * table_size + static_cast<size_t>(x)];
+        } else {
+            output[j] = direct(static_cast<OutputValue_>(x), c);
+        }
+    }
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * @brief Size factors in a shared buffer.
+ *
+ * This wraps a `std::shared_ptr` to a vector of size factors so that it can be used as the `SizeFactors_` container in `DelayedLogNormalize`.
+ * Multiple normalized matrices can then share the same size factors without copying them,
+ * while the shared pointer keeps the buffer alive for the lifetime of each matrix.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+class SharedSizeFactors {
+public:
+    /**
+     * @param size_factors Pointer to a vector of size factors.
+     * This should not be modified while any normalized matrix is using it.
+     */
+    SharedSizeFactors(std::shared_ptr<const std::vector<SizeFactor_> > size_factors) : my_size_factors(std::move(size_factors)), my_data(my_size_factors->data()) {}
+
+    /**
+     * @return Number of size factors.
+     */
+    size_t size() const {
+        return my_size_factors->size();
+    }
+
+    /**
+     * @param i Index of the cell.
+     * @return Size factor for cell `i`.
+     */
+    const SizeFactor_& operator[](size_t i) const {
+        return my_data[i];
+    }
+
+    /**
+     * @return Pointer to the start of the size factors.
+     */
+    const SizeFactor_* begin() const {
+        return my_data;
+    }
+
+    /**
+     * @return Pointer to the end of the size factors.
+     */
+    const SizeFactor_* end() const {
+        return my_data + size();
+    }
+
+private:
+    std::shared_ptr<const std::vector<SizeFactor_> > my_size_factors;
+    const SizeFactor_* my_data;
+};
+
+/**
+ * @brief Fused scaling normalization and log-transformation.
+ *
+ * This class implements the operation interface for `tatami::DelayedUnaryIsometricOperation`,
+ * computing \f$\log_b(x / s + c)\f$ for each count \f$x\f$ in a cell with size factor \f$s\f$, given a pseudo-count \f$c\f$ and log-base \f$b\f$.
+ * All steps are performed in a single pass over each extracted row or column,
+ * which avoids the overhead of stacking separate delayed operations for the division, addition and log-transformation.
+ * For \f$c \ne 1\f$, the values are computed as \f$\log_b(x + sc) - \log_b(s)\f$ with per-cell precomputed \f$sc\f$ and \f$\log(s)\f$, so no division is required for each element.
+ * This class is usually constructed by `normalize_counts()` but can also be used directly with `tatami::make_DelayedUnaryIsometricOperation()`.
+ *
+ * @tparam OutputValue_ Floating-point type for the output values.
+ * This is also used for all intermediate calculations.
+ * @tparam InputValue_ Data type for the input values.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods.
+ * The container is never modified, so non-owning views like `tatami::ArrayView` or `SharedSizeFactors` can be used to avoid a copy.
+ */
+template<typename OutputValue_, typename InputValue_, class SizeFactors_>
+class DelayedLogNormalize {
+public:
+    /**
+     * @param size_factors Vector of length equal to the number of columns in the count matrix, containing the size factor for each cell.
+     * All values should be positive. 
+     * @param options Further options.
+     */
+    DelayedLogNormalize(SizeFactors_ size_factors, const NormalizeCountsOptions& options) : my_size_factors(std::move(size_factors)) {
+        static_assert(std::is_floating_point<OutputValue_>::value);
+        my_approximate = options.approximate_log;
+
+        // Scaling is applied during extraction, so as to avoid modifying (or copying) the size factors.
+        auto resolved = resolve_normalize_counts_options<OutputValue_>(options);
+        my_params.size_factor_scale = resolved.size_factor_scale;
+
+        if (!resolved.log) {
+            my_transform = internal::LogNormalizeTransform::NONE;
+            if (options.precompute_reciprocals) {
+                fill_reciprocals();
+            }
+            return;
+        }
+
+        my_params.log_base = resolved.log_of_base;
+        my_params.pseudo_count = resolved.pseudo_count;
+
+        my_transform = internal::choose_log_transform(my_params.log_base, my_params.pseudo_count == 1);
+
+        if (internal::is_shifted_log(my_transform)) {
+            size_t ncells = my_size_factors.size();
+            my_shifts.reserve(ncells);
+            my_log_size_factors.reserve(ncells);
+            for (size_t c = 0; c < ncells; ++c) {
+                OutputValue_ sf = static_cast<OutputValue_>(my_size_factors[c]) * my_params.size_factor_scale;
+                my_shifts.push_back(sf * my_params.pseudo_count);
+                my_log_size_factors.push_back(std::log(sf));
+            }
+        }
+
+        if (options.precompute_reciprocals && !internal::is_shifted_log(my_transform)) {
+            fill_reciprocals();
+        }
+
+        if constexpr(std::is_integral<InputValue_>::value) {
+            if (options.lookup_table_size) {
+                fill_lookup_table(options.lookup_table_size);
+            }
+        }
+    }
+
+    /**
+     * @tparam PseudoCounts_ Container of floats for the pseudo-counts.
+     * This should have the `size()` and `operator[]` methods.
+     *
+     * @param size_factors Vector of length equal to the number of columns in the count matrix, containing the size factor for each cell.
+     * All values should be positive. 
+     * @param pseudo_counts Vector of length equal to the number of columns in the count matrix, containing the pseudo-count for each cell.
+     * All values should be positive.
+     * This is used instead of `NormalizeCountsOptions::pseudo_count`.
+     * @param options Further options.
+     */
+    template<class PseudoCounts_>
+    DelayedLogNormalize(SizeFactors_ size_factors, const PseudoCounts_& pseudo_counts, const NormalizeCountsOptions& options) : my_size_factors(std::move(size_factors)) {
+        static_assert(std::is_floating_point<OutputValue_>::value);
+        my_approximate = options.approximate_log;
+        my_params.size_factor_scale = options.size_factor_scale;
+
+        if (!options.log) {
+            my_transform = internal::LogNormalizeTransform::NONE;
+            if (options.precompute_reciprocals) {
+                fill_reciprocals();
+            }
+            return;
+        }
+
+        my_params.log_base = std::log(static_cast<OutputValue_>(options.log_base));
+        my_transform = internal::choose_log_transform(my_params.log_base, true);
+
+        // We use log(x / s + c) = log1p(x / (s * c)) + log(c), so that each cell's
+        // pseudo-count can be folded into its size factor. The log(c) is then
+        // just a per-cell offset that is omitted if we want to preserve sparsity.
+        size_t ncells = my_size_factors.size();
+        bool all_unity = true;
+        for (size_t c = 0; c < ncells; ++c) {
+            if (pseudo_counts[c] != 1) {
+                all_unity = false;
+                break;
+            }
+        }
+
+        if (!all_unity) {
+            my_combined.reserve(ncells);
+            for (size_t c = 0; c < ncells; ++c) {
+                my_combined.push_back(static_cast<OutputValue_>(my_size_factors[c]) * static_cast<OutputValue_>(pseudo_counts[c]));
+            }
+            my_use_combined = true;
+            if (!options.preserve_sparsity) {
+                my_offsets.reserve(ncells);
+                for (size_t c = 0; c < ncells; ++c) {
+                    my_offsets.push_back(std::log(static_cast<OutputValue_>(pseudo_counts[c])) / my_params.log_base);
+                }
+            }
+        }
+
+        if (options.precompute_reciprocals && !internal::is_shifted_log(my_transform)) {
+            fill_reciprocals();
+        }
+
+        if constexpr(std::is_integral<InputValue_>::value) {
+            if (options.lookup_table_size) {
+                fill_lookup_table(options.lookup_table_size);
+            }
+        }
+    }
+
+private:
+    SizeFactors_ my_size_factors;
+    internal::LogNormalizeTransform my_transform;
+    internal::LogNormalizeParameters<OutputValue_> my_params;
+    bool my_approximate = false;
+
+    std::vector<OutputValue_> my_table;
+    size_t my_table_size = 0;
+
+    std::vector<OutputValue_> my_offsets;
+
+    // Per-cell values of s * c and log(s) for the shifted log-transforms, see internal::log_normalize_shifted().
+    std::vector<OutputValue_> my_shifts;
+    std::vector<OutputValue_> my_log_size_factors;
+
+    // Per-cell reciprocals of the (scaled) size factors, see NormalizeCountsOptions::precompute_reciprocals.
+    std::vector<OutputValue_> my_reciprocals;
+
+    // Per-cell products of the size factors and pseudo-counts, if each cell has its own pseudo-count.
+    std::vector<OutputValue_> my_combined;
+    bool my_use_combined = false;
+
+    template<typename Index_>
+    void count_lookup_misses([[maybe_unused]] bool row, [[maybe_unused]] Index_ num, [[maybe_unused]] const InputValue_* input) const {
+        if constexpr(internal::instrumented) {
+            if (my_table_size) {
+                size_t misses = 0;
+                for (Index_ j = 0; j < num; ++j) {
+                    misses += !internal::in_lookup_table(input[j], my_table_size);
+                }
+                internal::instrument_count(InstrumentationEvent::NORMALIZE_LOOKUP_MISS, misses, row);
+            }
+        }
+    }
+
+    template<class Function_>
+    void with_size_factors(Function_ fun) const {
+        if (my_use_combined) {
+            fun(my_combined);
+        } else {
+            fun(my_size_factors);
+        }
+    }
+
+    template<typename Index_>
+    void add_offsets_block(bool row, Index_ i, Index_ start, Index_ length, OutputValue_* output) const {
+        if (my_offsets.empty()) {
+            return;
+        }
+        if (row) {
+            auto optr = my_offsets.data() + static_cast<size_t>(start);
+            for (Index_ j = 0; j < length; ++j) {
+                output[j] += optr[j];
+            }
+        } else {
+            add_offset_constant(my_offsets[i], length, output);
+        }
+    }
+
+    template<typename Index_>
+    void add_offsets_gathered(bool row, Index_ i, Index_ num, const Index_* index, OutputValue_* output) const {
+        if (my_offsets.empty()) {
+            return;
+        }
+        if (row) {
+            for (Index_ j = 0; j < num; ++j) {
+                output[j] += my_offsets[index[j]];
+            }
+        } else {
+            add_offset_constant(my_offsets[i], num, output);
+        }
+    }
+
+    template<typename Index_>
+    static void add_offset_constant(OutputValue_ offset, Index_ num, OutputValue_* output) {
+        for (Index_ j = 0; j < num; ++j) {
+            output[j] += offset;
+        }
+    }
+
+    void fill_reciprocals() {
+        size_t ncells = my_size_factors.size();
+        my_reciprocals.reserve(ncells);
+        with_size_factors([&](const auto& size_factors) {
+            for (size_t c = 0; c < ncells; ++c) {
+                my_reciprocals.push_back(static_cast<OutputValue_>(1) / (static_cast<OutputValue_>(size_factors[c]) * my_params.size_factor_scale));
+            }
+        });
+    }
+
+    void fill_lookup_table(size_t table_size) {
+        my_table_size = table_size;
+        size_t ncells = my_size_factors.size();
+        my_table.resize(ncells * my_table_size);
+        dispatch([&](auto transform, auto approximate) {
+            constexpr auto transform_ = decltype(transform)::value;
+            constexpr bool approximate_ = decltype(approximate)::value;
+            auto tptr = my_table.data();
+            if constexpr(internal::is_shifted_log(transform_)) {
+                auto zero = internal::log_normalize<transform_, approximate_>(static_cast<OutputValue_>(0), my_params);
+                for (size_t c = 0; c < ncells; ++c) {
+                    for (size_t x = 0; x < my_table_size; ++x, ++tptr) {
+                        *tptr = internal::log_normalize_shifted<transform_, approximate_>(static_cast<OutputValue_>(x), my_shifts[c], my_log_size_factors[c], zero, my_params);
+                    }
+                }
+            } else if (!my_reciprocals.empty()) {
+                for (size_t c = 0; c < ncells; ++c) {
+                    for (size_t x = 0; x < my_table_size; ++x, ++tptr) {
+                        *tptr = internal::log_normalize<transform_, approximate_>(static_cast<OutputValue_>(x) * my_reciprocals[c], my_params);
+                    }
+                }
+            } else {
+                with_size_factors([&](const auto& size_factors) {
+                    for (size_t c = 0; c < ncells; ++c) {
+                        OutputValue_ sf = static_cast<OutputValue_>(size_factors[c]) * my_params.size_factor_scale;
+                        for (size_t x = 0; x < my_table_size; ++x, ++tptr) {
+                            *tptr = internal::log_normalize<transform_, approximate_>(static_cast<OutputValue_>(x) / sf, my_params);
+                        }
+                    }
+                });
+            }
+        });
+    }
+
+    template<internal::LogNormalizeTransform transform_, bool approximate_, typename Index_>
+    void normalize_block(bool row, Index_ i, Index_ start, Index_ length, const InputValue_* input, OutputValue_* output) const {
+        if constexpr(internal::is_shifted_log(transform_)) {
+            auto zero = internal::log_normalize<transform_, approximate_>(static_cast<OutputValue_>(0), my_params);
+            auto sptr = my_shifts.data();
+            auto lptr = my_log_size_factors.data();
+            if (my_table_size) {
+                if (row) {
+                    internal::log_normalize_block_lookup(length, input, start, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                        return internal::log_normalize_shifted<transform_, approximate_>(x, sptr[c], lptr[c], zero, my_params);
+                    }, output);
+                } else {
+                    internal::log_normalize_constant_lookup(length, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                        return internal::log_normalize_shifted<transform_, approximate_>(x, sptr[i], lptr[i], zero, my_params);
+                    }, output);
+                }
+            } else if (row) {
+                internal::log_normalize_shifted_block<transform_, approximate_>(length, input, sptr, lptr, start, zero, my_params, output);
+            } else {
+                internal::log_normalize_shifted_constant<transform_, approximate_>(length, input, sptr[i], lptr[i], zero, my_params, output);
+            }
+
+        } else if (!my_reciprocals.empty()) {
+            auto rptr = my_reciprocals.data();
+            if (my_table_size) {
+                if (row) {
+                    internal::log_normalize_block_lookup(length, input, start, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                        return internal::log_normalize<transform_, approximate_>(x * rptr[c], my_params);
+                    }, output);
+                } else {
+                    internal::log_normalize_constant_lookup(length, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                        return internal::log_normalize<transform_, approximate_>(x * rptr[i], my_params);
+                    }, output);
+                }
+            } else if (row) {
+                internal::log_normalize_reciprocal_block<transform_, approximate_>(length, input, rptr, start, my_params, output);
+            } else {
+                internal::log_normalize_reciprocal_constant<transform_, approximate_>(length, input, rptr[i], my_params, output);
+            }
+
+        } else {
+            with_size_factors([&](const auto& size_factors) {
+                if (my_table_size) {
+                    if (row) {
+                        internal::log_normalize_block_lookup(length, input, start, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                            return internal::log_normalize<transform_, approximate_>(x / (static_cast<OutputValue_>(size_factors[c]) * my_params.size_factor_scale), my_params);
+                        }, output);
+                    } else {
+                        OutputValue_ sf = static_cast<OutputValue_>(size_factors[i]) * my_params.size_factor_scale;
+                        internal::log_normalize_constant_lookup(length, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                            return internal::log_normalize<transform_, approximate_>(x / sf, my_params);
+                        }, output);
+                    }
+                } else if (row) {
+                    internal::log_normalize_block<transform_, approximate_>(length, input, size_factors, start, my_params, output);
+                } else {
+                    internal::log_normalize_constant<transform_, approximate_>(length, input, static_cast<OutputValue_>(size_factors[i]) * my_params.size_factor_scale, my_params, output);
+                }
+            });
+        }
+    }
+
+    template<internal::LogNormalizeTransform transform_, bool approximate_, typename Index_>
+    void normalize_gathered(bool row, Index_ i, Index_ num, const Index_* index, const InputValue_* input, OutputValue_* output) const {
+        if constexpr(internal::is_shifted_log(transform_)) {
+            auto zero = internal::log_normalize<transform_, approximate_>(static_cast<OutputValue_>(0), my_params);
+            auto sptr = my_shifts.data();
+            auto lptr = my_log_size_factors.data();
+            if (my_table_size) {
+                if (row) {
+                    internal::log_normalize_gathered_lookup(num, input, index, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                        return internal::log_normalize_shifted<transform_, approximate_>(x, sptr[c], lptr[c], zero, my_params);
+                    }, output);
+                } else {
+                    internal::log_normalize_constant_lookup(num, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                        return internal::log_normalize_shifted<transform_, approximate_>(x, sptr[i], lptr[i], zero, my_params);
+                    }, output);
+                }
+            } else if (row) {
+                internal::log_normalize_shifted_gathered<transform_, approximate_>(num, input, sptr, lptr, index, zero, my_params, output);
+            } else {
+                internal::log_normalize_shifted_constant<transform_, approximate_>(num, input, sptr[i], lptr[i], zero, my_params, output);
+            }
+
+        } else if (!my_reciprocals.empty()) {
+            auto rptr = my_reciprocals.data();
+            if (my_table_size) {
+                if (row) {
+                    internal::log_normalize_gathered_lookup(num, input, index, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                        return internal::log_normalize<transform_, approximate_>(x * rptr[c], my_params);
+                    }, output);
+                } else {
+                    internal::log_normalize_constant_lookup(num, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                        return internal::log_normalize<transform_, approximate_>(x * rptr[i], my_params);
+                    }, output);
+                }
+            } else if (row) {
+                internal::log_normalize_reciprocal_gathered<transform_, approximate_>(num, input, rptr, index, my_params, output);
+            } else {
+                internal::log_normalize_reciprocal_constant<transform_, approximate_>(num, input, rptr[i], my_params, output);
+            }
+
+        } else {
+            with_size_factors([&](const auto& size_factors) {
+                if (my_table_size) {
+                    if (row) {
+                        internal::log_normalize_gathered_lookup(num, input, index, my_table.data(), my_table_size, [&](OutputValue_ x, Index_ c) -> OutputValue_ {
+                            return internal::log_normalize<transform_, approximate_>(x / (static_cast<OutputValue_>(size_factors[c]) * my_params.size_factor_scale), my_params);
+                        }, output);
+                    } else {
+                        OutputValue_ sf = static_cast<OutputValue_>(size_factors[i]) * my_params.size_factor_scale;
+                        internal::log_normalize_constant_lookup(num, input, my_table.data() + static_cast<size_t>(i) * my_table_size, my_table_size, [&](OutputValue_ x) -> OutputValue_ {
+                            return internal::log_normalize<transform_, approximate_>(x / sf, my_params);
+                        }, output);
+                    }
+                } else if (row) {
+                    internal::log_normalize_gathered<transform_, approximate_>(num, input, size_factors, index, my_params, output);
+                } else {
+                    internal::log_normalize_constant<transform_, approximate_>(num, input, static_cast<OutputValue_>(size_factors[i]) * my_params.size_factor_scale, my_params, output);
+                }
+            });
+        }
+    }
+
+    template<class Function_>
+    void dispatch(Function_ fun) const {
+        if (my_approximate) {
+            dispatch(fun, std::true_type());
+        } else {
+            dispatch(fun, std::false_type());
+        }
+    }
+
+    template<class Function_, class Approximate_>
+    void dispatch(Function_ fun, Approximate_ approximate) const {
+        switch (my_transform) {
+            case internal::LogNormalizeTransform::NONE:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::NONE>(), approximate);
+                break;
+            case internal::LogNormalizeTransform::LOG1P:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG1P>(), approximate);
+                break;
+            case internal::LogNormalizeTransform::LOG1P_BASE2:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG1P_BASE2>(), approximate);
+                break;
+            case internal::LogNormalizeTransform::LOG1P_NATURAL:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG1P_NATURAL>(), approximate);
+                break;
+            case internal::LogNormalizeTransform::LOG:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG>(), approximate);
+                break;
+            case internal::LogNormalizeTransform::LOG_BASE2:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG_BASE2>(), approximate);
+                break;
+            default:
+                fun(std::integral_constant<internal::LogNormalizeTransform, internal::LogNormalizeTransform::LOG_NATURAL>(), approximate);
+        }
+    }
+
+public:
+    /**
+     * @cond
+     */
+    static constexpr bool is_basic = false;
+
+    bool zero_depends_on_row() const {
+        return false;
+    }
+
+    bool zero_depends_on_column() const {
+        // log(0 / sf + pseudo) is the same for all cells, unless each cell has its own pseudo-count.
+        return !my_offsets.empty();
+    }
+
+    bool non_zero_depends_on_row() const {
+        return false;
+    }
+
+    bool non_zero_depends_on_column() const {
+        return true;
+    }
+
+    bool is_sparse() const {
+        return !internal::is_shifted_log(my_transform) && my_offsets.empty();
+    }
+
+public:
+    template<typename Index_>
+    void dense(bool row, Index_ i, Index_ start, Index_ length, const InputValue_* input, OutputValue_* output) const {
+        internal::InstrumentationScope scope(InstrumentationEvent::NORMALIZE_DENSE, length, row);
+        count_lookup_misses(row, length, input);
+        dispatch([&](auto transform, auto approximate) {
+            normalize_block<decltype(transform)::value, decltype(approximate)::value>(row, i, start, length, input, output);
+        });
+        add_offsets_block(row, i, start, length, output);
+    }
+
+    template<typename Index_>
+    void dense(bool row, Index_ i, const std::vector<Index_>& indices, const InputValue_* input, OutputValue_* output) const {
+        Index_ length = indices.size();
+        internal::InstrumentationScope scope(InstrumentationEvent::NORMALIZE_DENSE, length, row);
+        count_lookup_misses(row, length, input);
+        dispatch([&](auto transform, auto approximate) {
+            normalize_gathered<decltype(transform)::value, decltype(approximate)::value>(row, i, length, indices.data(), input, output);
+        });
+        add_offsets_gathered(row, i, length, indices.data(), output);
+    }
+
+    template<typename Index_>
+    void sparse(bool row, Index_ i, Index_ num, const InputValue_* input_value, const Index_* index, OutputValue_* output_value) const {
+        internal::InstrumentationScope scope(InstrumentationEvent::NORMALIZE_SPARSE, num, row);
+        count_lookup_misses(row, num, input_value);
+        dispatch([&](auto transform, auto approximate) {
+            normalize_gathered<decltype(transform)::value, decltype(approximate)::value>(row, i, num, index, input_value, output_value);
+        });
+        add_offsets_gathered(row, i, num, index, output_value);
+    }
+
+    template<typename FillValue_, typename Index_>
+    FillValue_ fill(bool row, Index_ i) const {
+        if (!my_offsets.empty()) {
+            // This should only be called for columns, as the fill value depends on the column.
+            return (row ? 0 : my_offsets[i]);
+        } else {
+            // Using the same calculation as for an explicit zero, so that dense and sparse extraction give the same results.
+            OutputValue_ output = 0;
+            dispatch([&](auto transform, auto approximate) {
+                output = internal::log_normalize<decltype(transform)::value, decltype(approximate)::value>(static_cast<OutputValue_>(0), my_params);
+            });
+            return output;
+        }
+    }
+    /**
+     * @endcond
+     */
 };
 
 /**
  * Given a count matrix and a set of size factors, compute log-transformed normalized expression values.
- * All operations are done in a delayed manner using the `tatami::DelayedUnaryIsometricOperation` class.
+ * All operations are done in a delayed manner using the `tatami::DelayedUnaryIsometricOperation` class with a `DelayedLogNormalize` operation.
  *
  * For normalization, each cell's counts are divided by the cell's size factor to remove uninteresting scaling differences.
  * The simplest and most common method for defining size factors is to use the centered library sizes, see `center_size_factors()` for details.
@@ -63,10 +1025,12 @@ struct NormalizeCountsOptions {
  * The log-transformation also provides some measure of variance stabilization so that the downstream analyses are not dominated by sampling noise at large counts.
  *
  * @tparam OutputValue_ Floating-point type for the output matrix.
+ * All arithmetic is performed in this type, so setting this to `float` will divide and log-transform in single precision,
+ * e.g., for downstream applications that only use single-precision values anyway.
  * @tparam InputValue_ Data type for the input matrix.
  * @tparam InputIndex_ Integer type for the input matrix.
  * @tparam SizeFactors_ Container of floats for the size factors.
- * This should have the `size()`, `begin()`, `end()` and `operator[]` methods.
+ * This should have the `size()` and `operator[]` methods, see `DelayedLogNormalize` for details.
  *
  * @param counts Pointer to a `tatami::Matrix` containing counts.
  * Rows should correspond to genes while columns should correspond to cells.
@@ -83,55 +1047,190 @@ std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
     SizeFactors_ size_factors, 
     const NormalizeCountsOptions& options) 
 {
-    auto current_pseudo = options.pseudo_count;
-    if (options.preserve_sparsity && current_pseudo != 1 && options.log) {
-        for (auto& x : size_factors) { 
-            x *= current_pseudo;
-        }
-        current_pseudo = 1;
-    }
-
-    static_assert(std::is_floating_point<OutputValue_>::value);
-    auto div = tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
+    return tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
         std::move(counts), 
-        tatami::make_DelayedUnaryIsometricDivideVector<true, InputValue_, SizeFactors_>(
-            std::move(size_factors), 
-            false
-        )
+        DelayedLogNormalize<OutputValue_, InputValue_, SizeFactors_>(std::move(size_factors), options)
     );
+}
 
-    if (!options.log) {
-        return div;
-    }
+/**
+ * @cond
+ */
+// Overload for template deduction.
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
+    std::shared_ptr<tatami::Matrix<InputValue_, Index_> > counts,
+    SizeFactors_ size_factors,
+    const NormalizeCountsOptions& options)
+{
+    return normalize_counts<OutputValue_>(std::shared_ptr<const tatami::Matrix<InputValue_, Index_> >(std::move(counts)), std::move(size_factors), options);
+}
+/**
+ * @endcond
+ */
 
-    if (current_pseudo == 1) {
-        return tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
-            std::move(div), 
-            tatami::DelayedUnaryIsometricLog1p<OutputValue_, OutputValue_>(options.log_base)
-        );
-    } else {
-        auto add = tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
-            std::move(div), 
-            tatami::make_DelayedUnaryIsometricAddScalar<OutputValue_>(current_pseudo)
-        );
-        return tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
-            std::move(add), 
-            tatami::DelayedUnaryIsometricLog<OutputValue_, OutputValue_>(options.log_base)
-        );
+/**
+ * Variant of `normalize_counts()` where the size factors are held in a shared buffer.
+ * This avoids copying the size factors into each normalized matrix, e.g., when the same size factors are used to normalize multiple matrices.
+ *
+ * @tparam OutputValue_ Floating-point type for the output matrix.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam InputIndex_ Integer type for the input matrix.
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ *
+ * @param counts Pointer to a `tatami::Matrix` containing counts.
+ * Rows should correspond to genes while columns should correspond to cells.
+ * @param size_factors Pointer to a vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * All values should be positive. 
+ * This should not be modified while the returned matrix is in use.
+ * @param options Further options.
+ *
+ * @return Matrix of normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ */
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, typename SizeFactor_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
+    std::shared_ptr<const tatami::Matrix<InputValue_, Index_> > counts, 
+    std::shared_ptr<const std::vector<SizeFactor_> > size_factors, 
+    const NormalizeCountsOptions& options) 
+{
+    return normalize_counts<OutputValue_>(std::move(counts), SharedSizeFactors<SizeFactor_>(std::move(size_factors)), options);
+}
+
+/**
+ * @cond
+ */
+// Overload for template deduction.
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, typename SizeFactor_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
+    std::shared_ptr<tatami::Matrix<InputValue_, Index_> > counts,
+    std::shared_ptr<const std::vector<SizeFactor_> > size_factors, 
+    const NormalizeCountsOptions& options)
+{
+    return normalize_counts<OutputValue_>(std::shared_ptr<const tatami::Matrix<InputValue_, Index_> >(std::move(counts)), SharedSizeFactors<SizeFactor_>(std::move(size_factors)), options);
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Variant of `normalize_counts()` with a different pseudo-count for each cell.
+ * This is typically used with per-block pseudo-counts from `choose_pseudo_count_blocked()`, see also `normalize_counts_blocked()`.
+ * The per-cell pseudo-counts are folded into the same fused operation, so no per-block subsetting or combining of matrices is required.
+ *
+ * If `NormalizeCountsOptions::preserve_sparsity = false`, we compute \f$\log_b(x / s + c) = \log_b(x / (sc) + 1) + \log_b(c)\f$ for a cell with size factor \f$s\f$ and pseudo-count \f$c\f$.
+ * The equivalent expression on the right is used during extraction, so the results may differ slightly from those of `normalize_counts()` due to numerical imprecision.
+ * The output matrix is not sparse unless all pseudo-counts are equal to 1.
+ * If `NormalizeCountsOptions::preserve_sparsity = true`, the \f$\log_b(c)\f$ term is omitted and the output matrix is always sparse.
+ *
+ * @tparam OutputValue_ Floating-point type for the output matrix.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam InputIndex_ Integer type for the input matrix.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods, see `DelayedLogNormalize` for details.
+ * @tparam PseudoCounts_ Container of floats for the pseudo-counts.
+ * This should have the `size()` and `operator[]` methods.
+ *
+ * @param counts Pointer to a `tatami::Matrix` containing counts.
+ * Rows should correspond to genes while columns should correspond to cells.
+ * @param size_factors Vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * All values should be positive. 
+ * @param pseudo_counts Vector of length equal to the number of columns in `counts`, containing the pseudo-count for each cell.
+ * All values should be positive.
+ * This is used instead of `NormalizeCountsOptions::pseudo_count`.
+ * @param options Further options.
+ *
+ * @return Matrix of normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ */
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_, class PseudoCounts_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
+    std::shared_ptr<const tatami::Matrix<InputValue_, Index_> > counts, 
+    SizeFactors_ size_factors, 
+    const PseudoCounts_& pseudo_counts,
+    const NormalizeCountsOptions& options) 
+{
+    if (static_cast<size_t>(pseudo_counts.size()) != static_cast<size_t>(size_factors.size())) {
+        throw std::runtime_error("length of 'pseudo_counts' should be equal to the number of cells");
     }
-};
+    return tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
+        std::move(counts), 
+        DelayedLogNormalize<OutputValue_, InputValue_, SizeFactors_>(std::move(size_factors), pseudo_counts, options)
+    );
+}
 
 /**
  * @cond
  */
 // Overload for template deduction.
-template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_>
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_, class PseudoCounts_>
 std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts(
     std::shared_ptr<tatami::Matrix<InputValue_, Index_> > counts,
     SizeFactors_ size_factors,
+    const PseudoCounts_& pseudo_counts,
+    const NormalizeCountsOptions& options)
+{
+    return normalize_counts<OutputValue_>(std::shared_ptr<const tatami::Matrix<InputValue_, Index_> >(std::move(counts)), std::move(size_factors), pseudo_counts, options);
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Variant of `normalize_counts()` with a different pseudo-count for each block of cells.
+ * This expands the per-block pseudo-counts to per-cell values before calling the per-cell overload of `normalize_counts()`.
+ *
+ * @tparam OutputValue_ Floating-point type for the output matrix.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam InputIndex_ Integer type for the input matrix.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods, see `DelayedLogNormalize` for details.
+ * @tparam Block_ Integer type for the block assignments.
+ * @tparam PseudoCount_ Floating-point type for the pseudo-counts.
+ *
+ * @param counts Pointer to a `tatami::Matrix` containing counts.
+ * Rows should correspond to genes while columns should correspond to cells.
+ * @param size_factors Vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * All values should be positive. 
+ * @param[in] block Pointer to an array of length equal to the number of columns in `counts`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param block_pseudo_counts Vector of length \f$N\f$ containing the pseudo-count for each block, e.g., from `choose_pseudo_count_blocked()`.
+ * All values should be positive.
+ * @param options Further options.
+ *
+ * @return Matrix of normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ */
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_, typename Block_, typename PseudoCount_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts_blocked(
+    std::shared_ptr<const tatami::Matrix<InputValue_, Index_> > counts, 
+    SizeFactors_ size_factors, 
+    const Block_* block,
+    const std::vector<PseudoCount_>& block_pseudo_counts,
+    const NormalizeCountsOptions& options) 
+{
+    size_t ncells = counts->ncol();
+    std::vector<PseudoCount_> pseudo_counts;
+    pseudo_counts.reserve(ncells);
+    for (size_t c = 0; c < ncells; ++c) {
+        pseudo_counts.push_back(block_pseudo_counts[block[c]]);
+    }
+    return normalize_counts<OutputValue_>(std::move(counts), std::move(size_factors), pseudo_counts, options);
+}
+
+/**
+ * @cond
+ */
+// Overload for template deduction.
+template<typename OutputValue_ = double, typename InputValue_, typename Index_, class SizeFactors_, typename Block_, typename PseudoCount_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > normalize_counts_blocked(
+    std::shared_ptr<tatami::Matrix<InputValue_, Index_> > counts,
+    SizeFactors_ size_factors,
+    const Block_* block,
+    const std::vector<PseudoCount_>& block_pseudo_counts,
     const NormalizeCountsOptions& options)
 {
-    return normalize_counts(std::shared_ptr<const tatami::Matrix<InputValue_, Index_> >(std::move(counts)), std::move(size_factors), options);
+    return normalize_counts_blocked<OutputValue_>(std::shared_ptr<const tatami::Matrix<InputValue_, Index_> >(std::move(counts)), std::move(size_factors), block, block_pseudo_counts, options);
 }
 /**
  * @endcond
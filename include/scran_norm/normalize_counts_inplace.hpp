@@ -0,0 +1,137 @@
+#ifndef SCRAN_NORM_NORMALIZE_COUNTS_INPLACE_HPP
+#define SCRAN_NORM_NORMALIZE_COUNTS_INPLACE_HPP
+
+#include <stdexcept>
+#include <type_traits>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+
+#include "normalize_counts.hpp"
+
+/**
+ * @file normalize_counts_inplace.hpp
+ * @brief Compute log-normalized values in place on raw buffers.
+ */
+
+namespace scran_norm {
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Value_, typename Index_, class SizeFactors_>
+DelayedLogNormalize<Value_, Value_, SizeFactors_> create_inplace_operation(Index_ ncol, SizeFactors_ size_factors, const NormalizeCountsOptions& options) {
+    static_assert(std::is_floating_point<Value_>::value);
+    if (static_cast<size_t>(size_factors.size()) != static_cast<size_t>(ncol)) {
+        throw std::runtime_error("length of 'size_factors' should be equal to the number of columns");
+    }
+    return DelayedLogNormalize<Value_, Value_, SizeFactors_>(std::move(size_factors), options);
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute normalized expression values in place from the contents of a compressed sparse matrix of counts.
+ * This is equivalent to realizing the delayed matrix from `normalize_counts()`, but skips the `tatami::Matrix` interface and the allocation of extraction buffers.
+ * The normalized values are computed with the same calculations as `DelayedLogNormalize`, so the results are identical.
+ * Each row (or column) is processed in parallel according to `NormalizeCountsOptions::num_threads`.
+ *
+ * As the structure of the sparse matrix cannot be changed, this function requires the transformation to preserve sparsity,
+ * i.e., either `NormalizeCountsOptions::log = false`, `NormalizeCountsOptions::pseudo_count = 1` or `NormalizeCountsOptions::preserve_sparsity = true`.
+ * An error is raised otherwise.
+ *
+ * @tparam Value_ Floating-point type for the counts and normalized values.
+ * @tparam Index_ Integer type for the row/column indices.
+ * @tparam Pointer_ Integer type for the pointers.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods.
+ *
+ * @param nrow Number of rows (genes) in the matrix.
+ * @param ncol Number of columns (cells) in the matrix.
+ * @param[in,out] values Pointer to an array of non-zero counts, ordered by row (if `row = true`) or by column (otherwise).
+ * On output, this contains the normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ * @param[in] indices Pointer to an array of column (if `row = true`) or row indices (otherwise) for each entry of `values`.
+ * @param[in] pointers Pointer to an array of length equal to `nrow + 1` (if `row = true`) or `ncol + 1` (otherwise).
+ * Entries of `values` and `indices` between `pointers[i]` and `pointers[i + 1]` correspond to row/column `i`.
+ * @param row Whether the matrix is in compressed sparse row format.
+ * If false, it is assumed to be in compressed sparse column format.
+ * @param size_factors Vector of length equal to `ncol`, containing the size factor for each cell.
+ * All values should be positive.
+ * @param options Further options.
+ */
+template<typename Value_, typename Index_, typename Pointer_, class SizeFactors_>
+void normalize_counts_sparse_inplace(
+    Index_ nrow,
+    Index_ ncol,
+    Value_* values,
+    const Index_* indices,
+    const Pointer_* pointers,
+    bool row,
+    SizeFactors_ size_factors,
+    const NormalizeCountsOptions& options)
+{
+    auto op = internal::create_inplace_operation<Value_>(ncol, std::move(size_factors), options);
+    if (!op.is_sparse()) {
+        throw std::runtime_error("normalization should preserve sparsity for in-place modification of a sparse matrix");
+    }
+
+    tatami::parallelize([&](int, Index_ start, Index_ length) -> void {
+        for (Index_ p = start, end = start + length; p < end; ++p) {
+            auto offset = pointers[p];
+            Index_ num = pointers[p + 1] - offset;
+            auto vptr = values + offset;
+            op.sparse(row, p, num, vptr, indices + offset, vptr);
+        }
+    }, (row ? nrow : ncol), options.num_threads);
+}
+
+/**
+ * Compute normalized expression values in place from a dense array of counts.
+ * This is equivalent to realizing the delayed matrix from `normalize_counts()`, but skips the `tatami::Matrix` interface and the allocation of extraction buffers.
+ * The normalized values are computed with the same calculations as `DelayedLogNormalize`, so the results are identical.
+ * Each row (or column) is processed in parallel according to `NormalizeCountsOptions::num_threads`.
+ *
+ * @tparam Value_ Floating-point type for the counts and normalized values.
+ * @tparam Index_ Integer type for the row/column indices.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods.
+ *
+ * @param nrow Number of rows (genes) in the matrix.
+ * @param ncol Number of columns (cells) in the matrix.
+ * @param[in,out] values Pointer to an array of length equal to `nrow * ncol`, containing the counts in row-major (if `row = true`) or column-major format (otherwise).
+ * On output, this contains the normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ * @param row Whether `values` is in row-major format.
+ * @param size_factors Vector of length equal to `ncol`, containing the size factor for each cell.
+ * All values should be positive.
+ * @param options Further options.
+ */
+template<typename Value_, typename Index_, class SizeFactors_>
+void normalize_counts_dense_inplace(
+    Index_ nrow,
+    Index_ ncol,
+    Value_* values,
+    bool row,
+    SizeFactors_ size_factors,
+    const NormalizeCountsOptions& options)
+{
+    auto op = internal::create_inplace_operation<Value_>(ncol, std::move(size_factors), options);
+    Index_ secondary = (row ? ncol : nrow);
+
+    tatami::parallelize([&](int, Index_ start, Index_ length) -> void {
+        for (Index_ p = start, end = start + length; p < end; ++p) {
+            auto vptr = values + static_cast<size_t>(p) * static_cast<size_t>(secondary);
+            op.dense(row, p, static_cast<Index_>(0), secondary, vptr, vptr);
+        }
+    }, (row ? nrow : ncol), options.num_threads);
+}
+
+}
+
+#endif
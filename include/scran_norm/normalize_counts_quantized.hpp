@@ -0,0 +1,433 @@
+#ifndef SCRAN_NORM_NORMALIZE_COUNTS_QUANTIZED_HPP
+#define SCRAN_NORM_NORMALIZE_COUNTS_QUANTIZED_HPP
+
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+
+#include "normalize_counts.hpp"
+#include "normalize_counts_realized.hpp"
+
+/**
+ * @file normalize_counts_quantized.hpp
+ * @brief Compute log-normalized values into a quantized compressed sparse matrix.
+ */
+
+namespace scran_norm {
+
+/**
+ * @brief Options for `normalize_counts_quantized()`.
+ */
+struct NormalizeCountsQuantizedOptions {
+    /**
+     * Whether to use a separate scale for each column (i.e., cell).
+     * This improves the precision for cells with a smaller range of normalized values, at the cost of storing one scale per cell.
+     * If false, a single scale is used for the entire matrix.
+     */
+    bool per_column_scale = false;
+};
+
+/**
+ * @brief Contents of a quantized compressed sparse matrix of normalized expression values.
+ *
+ * Each normalized value is approximated by its code multiplied by the relevant scale.
+ * Structural zeros in the normalized matrix are not stored.
+ *
+ * @tparam Code_ Unsigned integer type of the quantized codes.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Pointer_ Integer type of the pointers into `codes` and `indices`.
+ */
+template<typename Code_, typename Index_, typename Pointer_ = size_t>
+struct QuantizedNormalizedCounts {
+    /**
+     * Whether this is a compressed sparse row matrix.
+     * If false, this is a compressed sparse column matrix.
+     */
+    bool row = false;
+
+    /**
+     * Quantized codes for the non-zero normalized values, ordered by row (if `row = true`) or by column (otherwise).
+     */
+    std::vector<Code_> codes;
+
+    /**
+     * Column (if `row = true`) or row indices (otherwise) for each entry of `codes`, sorted in increasing order within each row/column.
+     */
+    std::vector<Index_> indices;
+
+    /**
+     * Vector of length equal to the number of rows (if `row = true`) or columns (otherwise) plus 1.
+     * Entries of `codes` and `indices` between `pointers[i]` and `pointers[i + 1]` correspond to row/column `i`.
+     */
+    std::vector<Pointer_> pointers;
+
+    /**
+     * Scale for the codes.
+     * This is of length equal to the number of columns if `NormalizeCountsQuantizedOptions::per_column_scale = true`, otherwise it is of length 1.
+     */
+    std::vector<double> scales;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+// Computing the largest count in each column, in parallel along the
+// requested dimension so that we use the same access pattern as the
+// subsequent realization.
+template<typename InputValue_, typename Index_>
+std::vector<InputValue_> find_column_maxima(const tatami::Matrix<InputValue_, Index_>& counts, bool row, int num_threads) {
+    Index_ NR = counts.nrow(), NC = counts.ncol();
+    Index_ primary = (row ? NR : NC);
+    Index_ secondary = (row ? NC : NR);
+    std::vector<InputValue_> output(NC);
+
+    size_t num_buffers = std::max(num_threads, 1);
+    std::vector<std::vector<InputValue_> > thread_maxima(row ? num_buffers : 0);
+
+    tatami::parallelize([&](int t, Index_ start, Index_ length) -> void {
+        tatami::Options opt;
+        opt.sparse_ordered_index = false;
+        auto ext = tatami::consecutive_extractor<true>(&counts, row, start, length, opt);
+        std::vector<InputValue_> vbuffer(secondary);
+        std::vector<Index_> ibuffer(secondary);
+
+        if (row) {
+            auto& curmax = thread_maxima[t];
+            curmax.resize(NC);
+            for (Index_ p = start, end = start + length; p < end; ++p) {
+                auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+                for (Index_ k = 0; k < range.number; ++k) {
+                    auto& current = curmax[range.index[k]];
+                    current = std::max(current, range.value[k]);
+                }
+            }
+        } else {
+            for (Index_ p = start, end = start + length; p < end; ++p) {
+                auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+                InputValue_ current = 0;
+                for (Index_ k = 0; k < range.number; ++k) {
+                    current = std::max(current, range.value[k]);
+                }
+                output[p] = current;
+            }
+        }
+    }, primary, num_threads);
+
+    for (const auto& curmax : thread_maxima) {
+        if (curmax.empty()) {
+            continue;
+        }
+        for (Index_ c = 0; c < NC; ++c) {
+            output[c] = std::max(output[c], curmax[c]);
+        }
+    }
+
+    return output;
+}
+
+template<typename Code_>
+double compute_quantization_scale(double largest) {
+    constexpr double code_max = std::numeric_limits<Code_>::max();
+    return (largest > 0 ? largest / code_max : 1);
+}
+
+template<typename Code_>
+Code_ quantize_value(double value, double inverse_scale) {
+    constexpr double code_max = std::numeric_limits<Code_>::max();
+    // Adding 0.5 for rounding to the nearest code, then clamping in case the
+    // floating-point error pushes us outside of the range of the code type.
+    double rounded = value * inverse_scale + 0.5;
+    return static_cast<Code_>(std::min(std::max(rounded, 0.0), code_max));
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute normalized expression values from a count matrix and store them as fixed-point codes in a compressed sparse matrix.
+ * Each normalized value is approximated by \f$qd\f$ for an integer code \f$q \in [0, Q]\f$ and a scale \f$d = m / Q\f$,
+ * where \f$Q\f$ is the largest value of `Code_` and \f$m\f$ is the largest normalized value in the matrix (or in each column, see `NormalizeCountsQuantizedOptions::per_column_scale`).
+ * The absolute error of each approximated value is then no greater than \f$d/2\f$.
+ * For typical log-normalized values with \f$m < 20\f$, 16-bit codes have an error below \f$10^{-3}\f$ and use a quarter of the memory of double-precision values.
+ *
+ * This function makes two passes over `counts`: one to determine the scale(s), and another to compute and quantize the normalized values.
+ * The normalized values are quantized immediately so the full-precision matrix is never held in memory.
+ * Each row (or column) is processed in parallel according to `NormalizeCountsOptions::num_threads`.
+ * The quantized matrix can be converted into a `tatami::Matrix` for downstream use with `dequantize_normalized_counts()`.
+ *
+ * As with `normalize_counts_realized()`, this function requires the transformation to preserve sparsity,
+ * i.e., either `NormalizeCountsOptions::log = false`, `NormalizeCountsOptions::pseudo_count = 1` or `NormalizeCountsOptions::preserve_sparsity = true`.
+ * An error is raised otherwise.
+ * All counts should also be non-negative, as negative normalized values are set to zero.
+ *
+ * @tparam Code_ Unsigned integer type for the quantized codes, typically `uint8_t` or `uint16_t`.
+ * @tparam Pointer_ Integer type for the pointers.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam Index_ Integer type for the input matrix.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()` and `operator[]` methods.
+ *
+ * @param counts A `tatami::Matrix` containing counts.
+ * Rows should correspond to genes while columns should correspond to cells.
+ * @param size_factors Vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * All values should be positive.
+ * @param row Whether to return a compressed sparse row matrix.
+ * If false, a compressed sparse column matrix is returned instead.
+ * @param options Further options for normalization.
+ * @param quantize_options Further options for quantization.
+ *
+ * @return Contents of the quantized compressed sparse matrix of normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ */
+template<typename Code_ = uint16_t, typename Pointer_ = size_t, typename InputValue_, typename Index_, class SizeFactors_>
+QuantizedNormalizedCounts<Code_, Index_, Pointer_> normalize_counts_quantized(
+    const tatami::Matrix<InputValue_, Index_>& counts,
+    SizeFactors_ size_factors,
+    bool row,
+    const NormalizeCountsOptions& options,
+    const NormalizeCountsQuantizedOptions& quantize_options)
+{
+    static_assert(std::is_integral<Code_>::value && std::is_unsigned<Code_>::value);
+    DelayedLogNormalize<double, InputValue_, SizeFactors_> op(std::move(size_factors), options);
+    if (!op.is_sparse()) {
+        throw std::runtime_error("normalization should preserve sparsity for a quantized sparse matrix");
+    }
+
+    // The normalized values are monotonic increasing with respect to the
+    // counts, so the largest normalized value of each column can be computed
+    // from its largest count.
+    Index_ NC = counts.ncol();
+    auto max_counts = internal::find_column_maxima(counts, row, options.num_threads);
+    std::vector<double> max_normalized(NC);
+    for (Index_ c = 0; c < NC; ++c) {
+        op.dense(false, c, static_cast<Index_>(0), static_cast<Index_>(1), max_counts.data() + c, max_normalized.data() + c);
+    }
+
+    QuantizedNormalizedCounts<Code_, Index_, Pointer_> output;
+    output.row = row;
+    if (quantize_options.per_column_scale) {
+        output.scales.reserve(NC);
+        for (auto m : max_normalized) {
+            output.scales.push_back(internal::compute_quantization_scale<Code_>(m));
+        }
+    } else {
+        double largest = 0;
+        for (auto m : max_normalized) {
+            largest = std::max(largest, m);
+        }
+        output.scales.push_back(internal::compute_quantization_scale<Code_>(largest));
+    }
+
+    std::vector<double> inverse_scales;
+    inverse_scales.reserve(output.scales.size());
+    for (auto s : output.scales) {
+        inverse_scales.push_back(1 / s);
+    }
+
+    size_t secondary = (row ? NC : counts.nrow());
+    std::vector<std::vector<double> > thread_buffers(std::max(options.num_threads, 1));
+
+    internal::realize_compressed_sparse(counts, row, options.num_threads, output.codes, output.indices, output.pointers, [&](int t, Index_ p, const auto& range, Code_* out) -> void {
+        auto& buffer = thread_buffers[t];
+        buffer.resize(secondary);
+        op.sparse(row, p, range.number, range.value, range.index, buffer.data());
+
+        if (!quantize_options.per_column_scale) {
+            double inv = inverse_scales.front();
+            for (Index_ k = 0; k < range.number; ++k) {
+                out[k] = internal::quantize_value<Code_>(buffer[k], inv);
+            }
+        } else if (row) {
+            for (Index_ k = 0; k < range.number; ++k) {
+                out[k] = internal::quantize_value<Code_>(buffer[k], inverse_scales[range.index[k]]);
+            }
+        } else {
+            double inv = inverse_scales[p];
+            for (Index_ k = 0; k < range.number; ++k) {
+                out[k] = internal::quantize_value<Code_>(buffer[k], inv);
+            }
+        }
+    });
+
+    return output;
+}
+
+/**
+ * Overload of `normalize_counts_quantized()` with default quantization options.
+ *
+ * @tparam Code_ Unsigned integer type for the quantized codes, typically `uint8_t` or `uint16_t`.
+ * @tparam Pointer_ Integer type for the pointers.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam Index_ Integer type for the input matrix.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ *
+ * @param counts A `tatami::Matrix` containing counts.
+ * @param size_factors Vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * @param row Whether to return a compressed sparse row matrix.
+ * @param options Further options for normalization.
+ *
+ * @return Contents of the quantized compressed sparse matrix of normalized expression values.
+ */
+template<typename Code_ = uint16_t, typename Pointer_ = size_t, typename InputValue_, typename Index_, class SizeFactors_>
+QuantizedNormalizedCounts<Code_, Index_, Pointer_> normalize_counts_quantized(
+    const tatami::Matrix<InputValue_, Index_>& counts,
+    SizeFactors_ size_factors,
+    bool row,
+    const NormalizeCountsOptions& options)
+{
+    return normalize_counts_quantized<Code_, Pointer_>(counts, std::move(size_factors), row, options, NormalizeCountsQuantizedOptions());
+}
+
+/**
+ * @brief Delayed decoding of quantized normalized values.
+ *
+ * This class implements the operation interface for `tatami::DelayedUnaryIsometricOperation`,
+ * multiplying each quantized code by its scale to approximate the original normalized value.
+ * This class is usually constructed by `dequantize_normalized_counts()`.
+ *
+ * @tparam OutputValue_ Floating-point type for the output values.
+ * @tparam InputValue_ Unsigned integer type for the quantized codes.
+ */
+template<typename OutputValue_, typename InputValue_>
+class DelayedDequantize {
+public:
+    /**
+     * @param scales Vector of scales, of length equal to 1 or the number of columns, see `QuantizedNormalizedCounts::scales`.
+     */
+    DelayedDequantize(const std::vector<double>& scales) : my_scales(scales.begin(), scales.end()) {
+        static_assert(std::is_floating_point<OutputValue_>::value);
+    }
+
+private:
+    std::vector<OutputValue_> my_scales;
+
+    bool per_column() const {
+        return my_scales.size() != 1;
+    }
+
+    template<typename Index_>
+    static void dequantize_constant(Index_ num, const InputValue_* input, OutputValue_ scale, OutputValue_* output) {
+        for (Index_ j = 0; j < num; ++j) {
+            output[j] = static_cast<OutputValue_>(input[j]) * scale;
+        }
+    }
+
+public:
+    /**
+     * @cond
+     */
+    static constexpr bool is_basic = false;
+
+    bool zero_depends_on_row() const {
+        return false;
+    }
+
+    bool zero_depends_on_column() const {
+        return false;
+    }
+
+    bool non_zero_depends_on_row() const {
+        return false;
+    }
+
+    bool non_zero_depends_on_column() const {
+        return per_column();
+    }
+
+    bool is_sparse() const {
+        return true;
+    }
+
+public:
+    template<typename Index_>
+    void dense(bool row, Index_ i, Index_ start, Index_ length, const InputValue_* input, OutputValue_* output) const {
+        if (!per_column()) {
+            dequantize_constant(length, input, my_scales.front(), output);
+        } else if (row) {
+            auto sptr = my_scales.data() + static_cast<size_t>(start);
+            for (Index_ j = 0; j < length; ++j) {
+                output[j] = static_cast<OutputValue_>(input[j]) * sptr[j];
+            }
+        } else {
+            dequantize_constant(length, input, my_scales[i], output);
+        }
+    }
+
+    template<typename Index_>
+    void dense(bool row, Index_ i, const std::vector<Index_>& indices, const InputValue_* input, OutputValue_* output) const {
+        sparse(row, i, static_cast<Index_>(indices.size()), input, indices.data(), output);
+    }
+
+    template<typename Index_>
+    void sparse(bool row, Index_ i, Index_ num, const InputValue_* input_value, const Index_* index, OutputValue_* output_value) const {
+        if (!per_column()) {
+            dequantize_constant(num, input_value, my_scales.front(), output_value);
+        } else if (row) {
+            for (Index_ j = 0; j < num; ++j) {
+                output_value[j] = static_cast<OutputValue_>(input_value[j]) * my_scales[index[j]];
+            }
+        } else {
+            dequantize_constant(num, input_value, my_scales[i], output_value);
+        }
+    }
+
+    template<typename FillValue_, typename Index_>
+    FillValue_ fill(bool, Index_) const {
+        return 0;
+    }
+    /**
+     * @endcond
+     */
+};
+
+/**
+ * Create a `tatami::Matrix` of normalized expression values from the quantized codes created by `normalize_counts_quantized()`.
+ * The codes are stored in a compressed sparse matrix and decoded to the approximate normalized values upon extraction.
+ *
+ * @tparam OutputValue_ Floating-point type for the decoded values.
+ * @tparam Code_ Unsigned integer type of the quantized codes.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Pointer_ Integer type of the pointers.
+ *
+ * @param nrow Number of rows (genes) in the matrix.
+ * @param ncol Number of columns (cells) in the matrix.
+ * @param quantized Quantized matrix from `normalize_counts_quantized()`.
+ * This is moved into the output matrix.
+ *
+ * @return Matrix of approximate normalized expression values.
+ */
+template<typename OutputValue_ = double, typename Code_, typename Index_, typename Pointer_>
+std::shared_ptr<tatami::Matrix<OutputValue_, Index_> > dequantize_normalized_counts(Index_ nrow, Index_ ncol, QuantizedNormalizedCounts<Code_, Index_, Pointer_> quantized) {
+    if (quantized.scales.size() != 1 && quantized.scales.size() != static_cast<size_t>(ncol)) {
+        throw std::runtime_error("length of 'scales' should be equal to 1 or the number of columns");
+    }
+
+    auto codes = std::make_shared<tatami::CompressedSparseMatrix<Code_, Index_, std::vector<Code_>, std::vector<Index_>, std::vector<Pointer_> > >(
+        nrow,
+        ncol,
+        std::move(quantized.codes),
+        std::move(quantized.indices),
+        std::move(quantized.pointers),
+        quantized.row
+    );
+
+    return tatami::make_DelayedUnaryIsometricOperation<OutputValue_>(
+        std::shared_ptr<const tatami::Matrix<Code_, Index_> >(std::move(codes)),
+        DelayedDequantize<OutputValue_, Code_>(quantized.scales)
+    );
+}
+
+}
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef SCRAN_NORM_NORMALIZE_COUNTS_REALIZED_HPP
+#define SCRAN_NORM_NORMALIZE_COUNTS_REALIZED_HPP
+
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <cstddef>
+
+#include "tatami/tatami.hpp"
+
+#include "normalize_counts.hpp"
+
+/**
+ * @file normalize_counts_realized.hpp
+ * @brief Compute log-normalized values into a compressed sparse matrix.
+ */
+
+namespace scran_norm {
+
+/**
+ * @brief Contents of a compressed sparse matrix of normalized expression values.
+ *
+ * @tparam Value_ Floating-point type of the normalized values.
+ * @tparam Index_ Integer type of the row/column indices.
+ * @tparam Pointer_ Integer type of the pointers into `values` and `indices`.
+ */
+template<typename Value_, typename Index_, typename Pointer_ = size_t>
+struct RealizedNormalizedCounts {
+    /**
+     * Whether this is a compressed sparse row matrix.
+     * If false, this is a compressed sparse column matrix.
+     */
+    bool row = false;
+
+    /**
+     * Non-zero normalized values, ordered by row (if `row = true`) or by column (otherwise).
+     */
+    std::vector<Value_> values;
+
+    /**
+     * Column (if `row = true`) or row indices (otherwise) for each entry of `values`, sorted in increasing order within each row/column.
+     */
+    std::vector<Index_> indices;
+
+    /**
+     * Vector of length equal to the number of rows (if `row = true`) or columns (otherwise) plus 1.
+     * Entries of `values` and `indices` between `pointers[i]` and `pointers[i + 1]` correspond to row/column `i`.
+     */
+    std::vector<Pointer_> pointers;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename Stored_, typename Index_, typename Pointer_>
+struct CompressedSparseBuffers {
+    std::vector<Stored_>* values;
+    std::vector<Index_>* indices;
+    std::vector<Pointer_>* pointers;
+};
+
+// Fills compressed sparse matrices from each matrix in 'counts'. All matrices
+// are processed in the same parallel section by splitting the concatenation
+// of their primary dimensions across threads. 'fun(m, t, p, range, output)'
+// should write the stored values for the non-zero elements in 'range' of
+// row/column 'p' of matrix 'm' into 'output', where 't' is the thread index
+// (e.g., for thread-specific workspaces). Explicit zeros from non-sparse
+// matrices are removed from 'range' before it is passed to 'fun'.
+//
+// With one thread, the output is filled in a single pass. With multiple
+// threads, a counting pass is first performed to compute the pointers, and
+// each thread then writes directly into its part of the output. This avoids
+// holding a per-thread copy of the output, at the cost of extracting each
+// matrix twice; for sparse matrices, the counting pass only extracts indices.
+template<typename Stored_, typename Index_, typename Pointer_, typename InputValue_, class Function_>
+void realize_compressed_sparse_multiple(
+    const std::vector<const tatami::Matrix<InputValue_, Index_>*>& counts,
+    bool row,
+    int num_threads,
+    const std::vector<CompressedSparseBuffers<Stored_, Index_, Pointer_> >& buffers,
+    Function_ fun)
+{
+    size_t nmats = counts.size();
+    std::vector<size_t> offsets(nmats + 1);
+    for (size_t m = 0; m < nmats; ++m) {
+        Index_ primary = (row ? counts[m]->nrow() : counts[m]->ncol());
+        buffers[m].values->clear();
+        buffers[m].indices->clear();
+        buffers[m].pointers->clear();
+        buffers[m].pointers->resize(static_cast<size_t>(primary) + 1);
+        offsets[m + 1] = offsets[m] + static_cast<size_t>(primary);
+    }
+
+    // Calls 'process(m, t, p, range)' for each row/column of each matrix.
+    auto iterate = [&](bool need_values, auto process) -> void {
+        tatami::parallelize([&](int t, size_t start, size_t length) -> void {
+            size_t end = start + length;
+            size_t m = std::upper_bound(offsets.begin(), offsets.end(), start) - offsets.begin() - 1;
+
+            for (; m < nmats && offsets[m] < end; ++m) {
+                Index_ first = std::max(start, offsets[m]) - offsets[m];
+                Index_ last = std::min(end, offsets[m + 1]) - offsets[m];
+                if (first >= last) {
+                    continue;
+                }
+
+                const auto& mat = *(counts[m]);
+                bool sparse = mat.is_sparse();
+                Index_ secondary = (row ? mat.ncol() : mat.nrow());
+                tatami::Options opt;
+                opt.sparse_extract_value = (need_values || !sparse);
+                auto ext = tatami::consecutive_extractor<true>(&mat, row, first, static_cast<Index_>(last - first), opt);
+                std::vector<InputValue_> vbuffer(secondary);
+                std::vector<Index_> ibuffer(secondary);
+
+                for (Index_ p = first; p < last; ++p) {
+                    auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+                    if (!sparse) {
+                        // Compaction is safe even if 'range' points to our buffers, as each entry is read before it is overwritten.
+                        Index_ nonzero = 0;
+                        for (Index_ k = 0; k < range.number; ++k) {
+                            auto val = range.value[k];
+                            if (val) {
+                                vbuffer[nonzero] = val;
+                                ibuffer[nonzero] = range.index[k];
+                                ++nonzero;
+                            }
+                        }
+                        range.value = vbuffer.data();
+                        range.index = ibuffer.data();
+                        range.number = nonzero;
+                    }
+                    process(m, t, p, range);
+                }
+            }
+        }, offsets.back(), num_threads);
+    };
+
+    auto fill_pointers = [&]() -> void {
+        for (size_t m = 0; m < nmats; ++m) {
+            auto& curpointers = *(buffers[m].pointers);
+            for (size_t p = 1, end = curpointers.size(); p < end; ++p) {
+                curpointers[p] += curpointers[p - 1];
+            }
+        }
+    };
+
+    if (num_threads <= 1) {
+        iterate(true, [&](size_t m, int t, Index_ p, const auto& range) -> void {
+            const auto& curbuffers = buffers[m];
+            size_t offset = curbuffers.values->size();
+            curbuffers.values->resize(offset + range.number);
+            fun(m, t, p, range, curbuffers.values->data() + offset);
+            curbuffers.indices->insert(curbuffers.indices->end(), range.index, range.index + range.number);
+            (*curbuffers.pointers)[static_cast<size_t>(p) + 1] = range.number;
+        });
+        fill_pointers();
+        return;
+    }
+
+    iterate(false, [&](size_t m, int, Index_ p, const auto& range) -> void {
+        (*buffers[m].pointers)[static_cast<size_t>(p) + 1] = range.number;
+    });
+    fill_pointers();
+
+    for (size_t m = 0; m < nmats; ++m) {
+        size_t total = buffers[m].pointers->back();
+        buffers[m].values->resize(total);
+        buffers[m].indices->resize(total);
+    }
+
+    iterate(true, [&](size_t m, int t, Index_ p, const auto& range) -> void {
+        const auto& curbuffers = buffers[m];
+        size_t offset = (*curbuffers.pointers)[p];
+        fun(m, t, p, range, curbuffers.values->data() + offset);
+        std::copy_n(range.index, range.number, curbuffers.indices->data() + offset);
+    });
+}
+
+// Single-matrix version, see realize_compressed_sparse_multiple() for details.
+template<typename Stored_, typename Index_, typename Pointer_, typename InputValue_, class Function_>
+void realize_compressed_sparse(
+    const tatami::Matrix<InputValue_, Index_>& counts,
+    bool row,
+    int num_threads,
+    std::vector<Stored_>& values,
+    std::vector<Index_>& indices,
+    std::vector<Pointer_>& pointers,
+    Function_ fun)
+{
+    std::vector<const tatami::Matrix<InputValue_, Index_>*> all_counts{ &counts };
+    std::vector<CompressedSparseBuffers<Stored_, Index_, Pointer_> > all_buffers{ { &values, &indices, &pointers } };
+    realize_compressed_sparse_multiple(all_counts, row, num_threads, all_buffers, [&](size_t, int t, Index_ p, const auto& range, Stored_* output) -> void {
+        fun(t, p, range, output);
+    });
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Compute normalized expression values from a count matrix and store them directly in a compressed sparse matrix.
+ * This is equivalent to, but more efficient than, realizing the delayed matrix from `normalize_counts()`,
+ * as it skips the construction of the delayed wrapper and only visits the non-zero elements of `counts`.
+ * Each row (or column) is extracted and normalized in parallel according to `NormalizeCountsOptions::num_threads`.
+ * With multiple threads, an additional pass over `counts` is performed to count the non-zero elements in each row (or column),
+ * so that each thread can write directly into the output; this only extracts the indices if `counts` is sparse.
+ * Explicit zeros in a non-sparse `counts` are not stored in the output.
+ *
+ * As the zero counts are never visited, this function requires the transformation to preserve sparsity,
+ * i.e., either `NormalizeCountsOptions::log = false`, `NormalizeCountsOptions::pseudo_count = 1` or `NormalizeCountsOptions::preserve_sparsity = true`.
+ * An error is raised otherwise.
+ * 
+ * @tparam OutputValue_ Floating-point type for the normalized values.
+ * @tparam Pointer_ Integer type for the pointers.
+ * @tparam InputValue_ Data type for the input matrix.
+ * @tparam Index_ Integer type for the input matrix.
+ * @tparam SizeFactors_ Container of floats for the size factors.
+ * This should have the `size()`, `begin()`, `end()` and `operator[]` methods.
+ *
+ * @param counts A `tatami::Matrix` containing counts.
+ * Rows should correspond to genes while columns should correspond to cells.
+ * @param size_factors Vector of length equal to the number of columns in `counts`, containing the size factor for each cell.
+ * All values should be positive. 
+ * @param row Whether to return a compressed sparse row matrix.
+ * If false, a compressed sparse column matrix is returned instead.
+ * @param options Further options.
+ *
+ * @return Contents of the compressed sparse matrix of normalized expression values.
+ * These are log-transformed if `NormalizeCountsOptions::log = true`.
+ */
+template<typename OutputValue_ = double, typename Pointer_ = size_t, typename InputValue_, typename Index_, class SizeFactors_>
+RealizedNormalizedCounts<OutputValue_, Index_, Pointer_> normalize_counts_realized(
+    const tatami::Matrix<InputValue_, Index_>& counts,
+    SizeFactors_ size_factors,
+    bool row,
+    const NormalizeCountsOptions& options)
+{
+    DelayedLogNormalize<OutputValue_, InputValue_, SizeFactors_> op(std::move(size_factors), options);
+    if (!op.is_sparse()) {
+        throw std::runtime_error("normalization should preserve sparsity for a realized sparse matrix");
+    }
+
+    RealizedNormalizedCounts<OutputValue_, Index_, Pointer_> output;
+    output.row = row;
+    internal::realize_compressed_sparse(counts, row, options.num_threads, output.values, output.indices, output.pointers, [&](int, Index_ p, const auto& range, OutputValue_* out) -> void {
+        op.sparse(row, p, range.number, range.value, range.index, out);
+    });
+
+    return output;
+}
+
+/**
+ * Compute normalized expression values from multiple count matrices and store them directly in compressed sparse matrices.
+ * This is typically used for multimodal datasets where each modality has its own count matrix and size factors for the same cells.
+ * The results are the same as calling `normalize_counts_realized()` on each matrix,
+ * but all matrices are processed in the same parallel section to avoid starting a new pool of threads for each matrix.
+ * This is most useful when some of the matrices are small, e.g., antibody-derived tags or hashtag oligos.
+ *
+ * @tparam OutputValue_ Floating-point type for the normalized values.
+ * @tparam Pointer_ Integer type for the pointers.
+ * @tparam InputValue_ Data type for the input matrices.
+ * @tparam Index_ Integer type for the input matrices.
+ * @tparam SizeFactors_ Container of floats for the size factors, see `normalize_counts_realized()`.
+ *
+ * @param counts Vector of pointers to `tatami::Matrix` objects containing counts.
+ * Rows should correspond to features while columns should correspond to cells.
+ * @param size_factors Vector of length equal to `counts.size()`, 
+ * where each entry contains the size factors for the cells of the corresponding matrix in `counts`.
+ * @param row Whether to return compressed sparse row matrices.
+ * If false, compressed sparse column matrices are returned instead.
+ * @param options Vector of length equal to `counts.size()`, containing the normalization options for each matrix in `counts`.
+ * The `NormalizeCountsOptions::num_threads` in each entry is ignored.
+ * @param num_threads Number of threads to use.
+ *
+ * @return Vector of length equal to `counts.size()`, containing the contents of the compressed sparse matrix of normalized expression values for each matrix in `counts`.
+ */
+template<typename OutputValue_ = double, typename Pointer_ = size_t, typename InputValue_, typename Index_, class SizeFactors_>
+std::vector<RealizedNormalizedCounts<OutputValue_, Index_, Pointer_> > normalize_counts_realized_multiple(
+    const std::vector<const tatami::Matrix<InputValue_, Index_>*>& counts,
+    std::vector<SizeFactors_> size_factors,
+    bool row,
+    const std::vector<NormalizeCountsOptions>& options,
+    int num_threads)
+{
+    size_t nmats = counts.size();
+    if (size_factors.size() != nmats) {
+        throw std::runtime_error("length of 'size_factors' should be equal to the number of matrices");
+    }
+    if (options.size() != nmats) {
+        throw std::runtime_error("length of 'options' should be equal to the number of matrices");
+    }
+
+    std::vector<DelayedLogNormalize<OutputValue_, InputValue_, SizeFactors_> > ops;
+    ops.reserve(nmats);
+    for (size_t m = 0; m < nmats; ++m) {
+        ops.emplace_back(std::move(size_factors[m]), options[m]);
+        if (!ops.back().is_sparse()) {
+            throw std::runtime_error("normalization should preserve sparsity for a realized sparse matrix");
+        }
+    }
+
+    std::vector<RealizedNormalizedCounts<OutputValue_, Index_, Pointer_> > output(nmats);
+    std::vector<internal::CompressedSparseBuffers<OutputValue_, Index_, Pointer_> > buffers;
+    buffers.reserve(nmats);
+    for (auto& current : output) {
+        current.row = row;
+        buffers.push_back({ &(current.values), &(current.indices), &(current.pointers) });
+    }
+
+    internal::realize_compressed_sparse_multiple(counts, row, num_threads, buffers, [&](size_t m, int, Index_ p, const auto& range, OutputValue_* out) -> void {
+        ops[m].sparse(row, p, range.number, range.value, range.index, out);
+    });
+
+    return output;
+}
+
+}
+
+#endif
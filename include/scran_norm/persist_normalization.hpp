@@ -0,0 +1,285 @@
+#ifndef SCRAN_NORM_PERSIST_NORMALIZATION_HPP
+#define SCRAN_NORM_PERSIST_NORMALIZATION_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+#include "sanitize_size_factors.hpp"
+#include "normalize_counts.hpp"
+#include "serialize.hpp"
+
+/**
+ * @file persist_normalization.hpp
+ * @brief Persist the normalization metadata for fast reloading.
+ */
+
+namespace scran_norm {
+
+/**
+ * Version of the persisted format created by `persist_normalization()`.
+ * This is incremented whenever the format changes, and `PersistedNormalization` will refuse to load buffers with a newer version.
+ */
+constexpr uint32_t persisted_normalization_version = 1;
+
+/**
+ * @cond
+ */
+namespace internal {
+
+// Arrays are aligned to cache lines relative to the start of the buffer, so
+// that they are suitably aligned when the buffer is memory-mapped.
+constexpr size_t persisted_alignment = 64;
+
+// Written as a native 32-bit integer to detect differences in byte order.
+constexpr uint32_t persisted_byte_order = 0x01020304;
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * @brief Size factors in a persisted buffer.
+ *
+ * This wraps a pointer into a buffer created by `persist_normalization()` so that it can be used as the `SizeFactors_` container in `DelayedLogNormalize`.
+ * The size factors are used directly from the buffer without copying, while the shared pointer keeps the buffer alive for the lifetime of each matrix.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+class PersistedSizeFactors {
+public:
+    /**
+     * @cond
+     */
+    PersistedSizeFactors(std::shared_ptr<const SizeFactor_> data, size_t size) : my_data(std::move(data)), my_size(size) {}
+    /**
+     * @endcond
+     */
+
+    /**
+     * @return Number of size factors.
+     */
+    size_t size() const {
+        return my_size;
+    }
+
+    /**
+     * @param i Index of the cell.
+     * @return Size factor for cell `i`.
+     */
+    const SizeFactor_& operator[](size_t i) const {
+        return my_data.get()[i];
+    }
+
+    /**
+     * @return Pointer to the start of the size factors.
+     */
+    const SizeFactor_* begin() const {
+        return my_data.get();
+    }
+
+    /**
+     * @return Pointer to the end of the size factors.
+     */
+    const SizeFactor_* end() const {
+        return my_data.get() + my_size;
+    }
+
+private:
+    std::shared_ptr<const SizeFactor_> my_data;
+    size_t my_size;
+};
+
+/**
+ * Persist the normalization metadata for a dataset, e.g., to be saved to file and memory-mapped when a service starts.
+ * This avoids recomputing the size factors, diagnostics, block means and pseudo-count from the counts.
+ *
+ * The buffer starts with a header containing a marker for the byte order, the type of `SizeFactor_` and the format version.
+ * This is followed by the diagnostics and options, and then the arrays of size factors and block means.
+ * Each array starts at a multiple of 64 bytes from the start of the buffer, so that it can be used directly from a memory-mapped file.
+ * All values use the native representation, so the buffer should only be loaded on the same architecture.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ *
+ * @param num_cells Number of cells.
+ * @param[in] size_factors Pointer to an array of length `num_cells`, containing the size factor for each cell.
+ * This is typically centered by `center_size_factors()` or `center_size_factors_blocked()`.
+ * @param diagnostics Diagnostics for invalid size factors, typically from `center_size_factors()` or `center_size_factors_blocked()`.
+ * @param num_blocks Number of blocks.
+ * This may be zero if no blocking was performed.
+ * @param[in] block_means Pointer to an array of length `num_blocks`, containing the mean size factor for each block from `center_size_factors_blocked()`.
+ * This may be NULL if `num_blocks = 0`.
+ * @param options Options for `normalize_counts()`.
+ * `NormalizeCountsOptions::pseudo_count` should be set to the chosen pseudo-count, e.g., from `choose_pseudo_count()`.
+ *
+ * @return Buffer containing the persisted metadata, to be loaded by `PersistedNormalization`.
+ */
+template<typename SizeFactor_>
+std::vector<unsigned char> persist_normalization(
+    size_t num_cells,
+    const SizeFactor_* size_factors,
+    const SizeFactorDiagnostics& diagnostics,
+    size_t num_blocks,
+    const SizeFactor_* block_means,
+    const NormalizeCountsOptions& options)
+{
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+    // Byte order comes first, so that it can be checked before interpreting anything else.
+    internal::StatisticsWriter writer;
+    writer.write(internal::persisted_byte_order);
+    writer.write(internal::statistics_tag<SizeFactor_>(3));
+    writer.write(persisted_normalization_version);
+    writer.write(static_cast<uint64_t>(num_cells));
+    writer.write(static_cast<uint64_t>(num_blocks));
+
+    writer.write(static_cast<unsigned char>(diagnostics.has_negative));
+    writer.write(static_cast<unsigned char>(diagnostics.has_zero));
+    writer.write(static_cast<unsigned char>(diagnostics.has_nan));
+    writer.write(static_cast<unsigned char>(diagnostics.has_infinite));
+
+    writer.write(options.pseudo_count);
+    writer.write(static_cast<unsigned char>(options.preserve_sparsity));
+    writer.write(static_cast<unsigned char>(options.log));
+    writer.write(options.log_base);
+    writer.write(options.size_factor_scale);
+    writer.write(static_cast<int32_t>(options.num_threads));
+    writer.write(static_cast<uint64_t>(options.lookup_table_size));
+    writer.write(static_cast<unsigned char>(options.precompute_reciprocals));
+    writer.write(static_cast<unsigned char>(options.approximate_log));
+
+    writer.pad(internal::persisted_alignment);
+    writer.write_array(size_factors, num_cells);
+    writer.pad(internal::persisted_alignment);
+    writer.write_array(block_means, num_blocks);
+    return writer.release();
+}
+
+/**
+ * @brief Normalization metadata loaded from a persisted buffer.
+ *
+ * This parses a buffer created by `persist_normalization()`, e.g., from a memory-mapped file.
+ * Only the header is read upon construction, so the cost is independent of the number of cells.
+ * The size factors are not copied and can be passed directly to `normalize_counts()`:
+ *
+ * ```cpp
+ * auto normalized = scran_norm::normalize_counts(counts, persisted.size_factors(), persisted.options());
+ * ```
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * This should be the same as that used in `persist_normalization()`.
+ */
+template<typename SizeFactor_>
+class PersistedNormalization {
+public:
+    /**
+     * @param data Pointer to the start of the persisted buffer.
+     * This should be aligned to at least `alignof(SizeFactor_)`, which is always true for memory-mapped files and for buffers from `new`.
+     * The pointer may use a custom deleter, e.g., to unmap the file once all normalized matrices are destroyed.
+     * The buffer should not be modified while this instance or any of its size factors are in use.
+     * @param size Size of the buffer, in bytes.
+     */
+    PersistedNormalization(std::shared_ptr<const unsigned char> data, size_t size) : my_data(std::move(data)) {
+        static_assert(std::is_floating_point<SizeFactor_>::value);
+        internal::StatisticsReader reader(my_data.get(), size);
+        if (reader.read<uint32_t>() != internal::persisted_byte_order) {
+            throw std::runtime_error("persisted normalization was created on an architecture with a different byte order");
+        }
+        reader.check_tag(internal::statistics_tag<SizeFactor_>(3));
+        auto version = reader.read<uint32_t>();
+        if (version == 0 || version > persisted_normalization_version) {
+            throw std::runtime_error("unsupported version of the persisted normalization format");
+        }
+        my_num_cells = reader.read<uint64_t>();
+        my_num_blocks = reader.read<uint64_t>();
+
+        my_diagnostics.has_negative = reader.read<unsigned char>();
+        my_diagnostics.has_zero = reader.read<unsigned char>();
+        my_diagnostics.has_nan = reader.read<unsigned char>();
+        my_diagnostics.has_infinite = reader.read<unsigned char>();
+
+        my_options.pseudo_count = reader.read<double>();
+        my_options.preserve_sparsity = reader.read<unsigned char>();
+        my_options.log = reader.read<unsigned char>();
+        my_options.log_base = reader.read<double>();
+        my_options.size_factor_scale = reader.read<double>();
+        my_options.num_threads = reader.read<int32_t>();
+        my_options.lookup_table_size = reader.read<uint64_t>();
+        my_options.precompute_reciprocals = reader.read<unsigned char>();
+        my_options.approximate_log = reader.read<unsigned char>();
+
+        reader.skip_padding(internal::persisted_alignment);
+        my_size_factors = reader.template view<SizeFactor_>(my_num_cells);
+        reader.skip_padding(internal::persisted_alignment);
+        my_block_means = reader.template view<SizeFactor_>(my_num_blocks);
+        reader.finish();
+    }
+
+    /**
+     * @param data Pointer to a vector containing the persisted buffer, e.g., after reading a file into memory.
+     * This should not be modified while this instance or any of its size factors are in use.
+     */
+    PersistedNormalization(std::shared_ptr<const std::vector<unsigned char> > data) :
+        PersistedNormalization(std::shared_ptr<const unsigned char>(data, data->data()), data->size()) {}
+
+private:
+    std::shared_ptr<const unsigned char> my_data;
+    size_t my_num_cells, my_num_blocks;
+    const SizeFactor_* my_size_factors;
+    const SizeFactor_* my_block_means;
+    SizeFactorDiagnostics my_diagnostics;
+    NormalizeCountsOptions my_options;
+
+public:
+    /**
+     * @return Number of cells.
+     */
+    size_t num_cells() const {
+        return my_num_cells;
+    }
+
+    /**
+     * @return Size factors for all cells, to be used in `normalize_counts()`.
+     * This refers to the persisted buffer without any copying, and keeps the buffer alive for as long as it is in use.
+     */
+    PersistedSizeFactors<SizeFactor_> size_factors() const {
+        return PersistedSizeFactors<SizeFactor_>(std::shared_ptr<const SizeFactor_>(my_data, my_size_factors), my_num_cells);
+    }
+
+    /**
+     * @return Number of blocks.
+     */
+    size_t num_blocks() const {
+        return my_num_blocks;
+    }
+
+    /**
+     * @return Pointer to an array of length `num_blocks()`, containing the mean size factor for each block.
+     * This refers to the persisted buffer and is only valid for the lifetime of this instance.
+     */
+    const SizeFactor_* block_means() const {
+        return my_block_means;
+    }
+
+    /**
+     * @return Diagnostics for invalid size factors.
+     */
+    const SizeFactorDiagnostics& diagnostics() const {
+        return my_diagnostics;
+    }
+
+    /**
+     * @return Options for `normalize_counts()`, including the chosen pseudo-count.
+     */
+    const NormalizeCountsOptions& options() const {
+        return my_options;
+    }
+};
+
+}
+
+#endif
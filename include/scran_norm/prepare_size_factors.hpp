@@ -0,0 +1,367 @@
+#ifndef SCRAN_NORM_PREPARE_SIZE_FACTORS_HPP
+#define SCRAN_NORM_PREPARE_SIZE_FACTORS_HPP
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include "center_size_factors.hpp"
+#include "sanitize_size_factors.hpp"
+
+/**
+ * @file prepare_size_factors.hpp
+ * @brief Center and sanitize size factors in a single call.
+ */
+
+namespace scran_norm {
+
+/**
+ * @brief Options for `prepare_size_factors()` and `prepare_size_factors_blocked()`.
+ */
+struct PrepareSizeFactorsOptions {
+    /**
+     * Whether to center the size factors.
+     * If false, the size factors are only sanitized.
+     */
+    bool center = true;
+
+    /**
+     * Options for centering, see `center_size_factors()` and `center_size_factors_blocked()`.
+     * Only used if `PrepareSizeFactorsOptions::center = true`.
+     */
+    CenterSizeFactorsOptions center_options;
+
+    /**
+     * Options for sanitization, see `sanitize_size_factors()`.
+     */
+    SanitizeSizeFactorsOptions sanitize_options;
+};
+
+/**
+ * @brief Results of `prepare_size_factors()`.
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+struct PrepareSizeFactorsResults {
+    /**
+     * Diagnostics for the invalid size factors in the input array.
+     */
+    SizeFactorDiagnostics diagnostics;
+
+    /**
+     * Mean size factor used for centering, see `center_size_factors()`.
+     * This is set to 1 if `PrepareSizeFactorsOptions::center = false`.
+     */
+    SizeFactor_ mean = 1;
+};
+
+/**
+ * @brief Results of `prepare_size_factors_blocked()`.
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ */
+template<typename SizeFactor_>
+struct PrepareSizeFactorsBlockedResults {
+    /**
+     * Diagnostics for the invalid size factors in the input array.
+     */
+    SizeFactorDiagnostics diagnostics;
+
+    /**
+     * Mean size factor for each block, see `center_size_factors_blocked()`.
+     * This is empty if `PrepareSizeFactorsOptions::center = false`.
+     */
+    std::vector<SizeFactor_> block_means;
+};
+
+/**
+ * @cond
+ */
+namespace internal {
+
+template<typename SizeFactor_>
+struct PrepareBlockStatistics {
+    SizeFactorSum<SizeFactor_> sum = 0;
+    size_t count = 0;
+    SizeFactor_ smallest = 0;
+    SizeFactor_ largest = 0;
+    bool found = false;
+};
+
+template<typename SizeFactor_>
+bool is_valid_scale(SizeFactor_ scale) {
+    // A scale of zero means that no division is performed, which is fine.
+    return scale == 0 || (std::isfinite(scale) && scale > 0);
+}
+
+template<typename SizeFactor_>
+SizeFactor_ apply_scale(SizeFactor_ val, SizeFactor_ scale) {
+    return (scale ? val / scale : val);
+}
+
+template<bool blocked_, typename SizeFactor_, typename Block_>
+bool prepare_size_factors(size_t num, SizeFactor_* size_factors, const Block_* block, const PrepareSizeFactorsOptions& options, SizeFactorDiagnostics& diagnostics, std::vector<SizeFactor_>& means) {
+    static_assert(std::is_floating_point<SizeFactor_>::value);
+
+    // First sweep collects diagnostics, sums and the smallest/largest valid values, all at once.
+    // Sums are accumulated in the same chunks as center_size_factors_mean() to get the same results.
+    std::vector<PrepareBlockStatistics<SizeFactor_> > stats(blocked_ ? 0 : 1);
+    std::vector<SizeFactorSum<SizeFactor_> > chunk_sums(stats.size());
+    bool ignore_invalid = options.center_options.ignore_invalid;
+
+    // Compensation is applied within and between chunks in the same manner as accumulate_size_factors_chunked().
+    bool compensated = options.center_options.compensated_sum;
+    std::vector<SizeFactorSum<SizeFactor_> > chunk_compensation(compensated ? stats.size() : 0), total_compensation(chunk_compensation.size());
+    auto add_to_chunk = [&](size_t b, SizeFactor_ val) -> void {
+        if (compensated) {
+            compensated_add<SizeFactorSum<SizeFactor_> >(chunk_sums[b], chunk_compensation[b], val);
+        } else {
+            chunk_sums[b] += val;
+        }
+    };
+    size_t chunk_size = centering_chunk_size(num);
+
+    for (size_t first = 0; first < num; first += chunk_size) {
+        std::fill(chunk_sums.begin(), chunk_sums.end(), 0);
+        std::fill(chunk_compensation.begin(), chunk_compensation.end(), 0);
+        size_t last = std::min(num, first + chunk_size);
+
+        for (size_t i = first; i < last; ++i) {
+            auto val = size_factors[i];
+
+            size_t b = 0;
+            if constexpr(blocked_) {
+                b = block[i];
+                if (b >= stats.size()) {
+                    stats.resize(b + 1);
+                    chunk_sums.resize(b + 1);
+                    if (compensated) {
+                        chunk_compensation.resize(b + 1);
+                        total_compensation.resize(b + 1);
+                    }
+                }
+            }
+            auto& current = stats[b];
+
+            if (!is_invalid(val, diagnostics)) {
+                add_to_chunk(b, val);
+                ++(current.count);
+                if (!current.found) {
+                    current.smallest = val;
+                    current.largest = val;
+                    current.found = true;
+                } else if (val < current.smallest) {
+                    current.smallest = val;
+                } else if (val > current.largest) {
+                    current.largest = val;
+                }
+            } else if (!ignore_invalid) {
+                add_to_chunk(b, val);
+                ++(current.count);
+            }
+        }
+
+        size_t ngroups = stats.size();
+        if (compensated) {
+            fold_compensation(ngroups, chunk_sums.data(), chunk_compensation.data());
+            for (size_t g = 0; g < ngroups; ++g) {
+                compensated_add(stats[g].sum, total_compensation[g], chunk_sums[g]);
+            }
+        } else {
+            for (size_t g = 0; g < ngroups; ++g) {
+                stats[g].sum += chunk_sums[g];
+            }
+        }
+    }
+
+    if (compensated) {
+        for (size_t g = 0, end = stats.size(); g < end; ++g) {
+            fold_compensation(1, &(stats[g].sum), total_compensation.data() + g);
+        }
+    }
+
+    size_t ngroups = stats.size();
+    std::vector<SizeFactor_> scale(ngroups);
+    if (options.center) {
+        means.resize(ngroups);
+        for (size_t g = 0; g < ngroups; ++g) {
+            if (stats[g].count) {
+                means[g] = stats[g].sum / stats[g].count;
+            }
+        }
+
+        if (!blocked_ || options.center_options.block_mode == CenterBlockMode::PER_BLOCK) {
+            scale = means;
+        } else if (options.center_options.block_mode == CenterBlockMode::LOWEST) {
+            auto min = find_lowest_mean(means);
+            if (min > 0) {
+                std::fill(scale.begin(), scale.end(), min);
+            }
+        }
+    }
+
+    // Replacement values are the smallest and largest valid size factors after centering.
+    // Division by a positive scale is monotonic, so we can just scale the per-block extremes.
+    SizeFactor_ smallest = 1, largest = 1;
+    bool found = false;
+    for (size_t g = 0; g < ngroups; ++g) {
+        const auto& curscale = scale[g];
+        if (!is_valid_scale(curscale)) {
+            // This can only happen if ignore_invalid = false, in which case
+            // centering may change the category of each invalid value.
+            return false;
+        }
+
+        const auto& current = stats[g];
+        if (!current.found) {
+            continue;
+        }
+        auto cursmall = apply_scale(current.smallest, curscale);
+        auto curlarge = apply_scale(current.largest, curscale);
+        if (cursmall == 0 || std::isinf(curlarge)) {
+            // Valid size factors became invalid after centering, so we give up.
+            return false;
+        }
+
+        if (!found) {
+            smallest = cursmall;
+            largest = curlarge;
+            found = true;
+        } else {
+            smallest = std::min(smallest, cursmall);
+            largest = std::max(largest, curlarge);
+        }
+    }
+
+    const auto& sopt = options.sanitize_options;
+    if (diagnostics.has_negative && sopt.handle_negative == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected negative size factor");
+    }
+    if (diagnostics.has_zero && sopt.handle_zero == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected size factor of zero");
+    }
+    if (diagnostics.has_nan && sopt.handle_nan == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected NaN size factor");
+    }
+    if (diagnostics.has_infinite && sopt.handle_infinite == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected infinite size factor");
+    }
+
+    // Mimicking sanitize_size_factors(), where the largest valid factor is
+    // computed after replacing the NaNs with 1.
+    if (found && diagnostics.has_nan && sopt.handle_nan == SanitizeAction::SANITIZE) {
+        largest = std::max(largest, static_cast<SizeFactor_>(1));
+    }
+
+    // Second sweep applies the centering and replacement together.
+    bool replace_negative = sopt.handle_negative == SanitizeAction::SANITIZE;
+    bool replace_zero = sopt.handle_zero == SanitizeAction::SANITIZE;
+    bool replace_nan = sopt.handle_nan == SanitizeAction::SANITIZE;
+    bool replace_infinite = sopt.handle_infinite == SanitizeAction::SANITIZE;
+
+    for (size_t i = 0; i < num; ++i) {
+        auto& val = size_factors[i];
+        SizeFactor_ curscale;
+        if constexpr(blocked_) {
+            curscale = scale[block[i]];
+        } else {
+            curscale = scale[0];
+        }
+
+        if (val < 0) {
+            val = (replace_negative ? smallest : apply_scale(val, curscale));
+        } else if (val == 0) {
+            val = (replace_zero ? smallest : val);
+        } else if (std::isnan(val)) {
+            val = (replace_nan ? static_cast<SizeFactor_>(1) : val);
+        } else if (std::isinf(val)) {
+            val = (replace_infinite ? largest : apply_scale(val, curscale));
+        } else {
+            val = apply_scale(val, curscale);
+        }
+    }
+
+    return true;
+}
+
+}
+/**
+ * @endcond
+ */
+
+/**
+ * Center and sanitize the size factors in a single call.
+ * This is equivalent to calling `center_size_factors()` followed by `sanitize_size_factors()`,
+ * but only requires two passes over `size_factors` instead of up to eight -
+ * the first to collect the diagnostics, mean and replacement values, and the second to apply the centering and replacements.
+ * This is most helpful for large arrays that do not fit into the cache.
+ *
+ * Unlike `sanitize_size_factors()`, any error is thrown before `size_factors` is modified.
+ * If sanitization is not required, users can set all actions in `SanitizeSizeFactorsOptions` to `SanitizeAction::IGNORE`.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ *
+ * @param num Number of cells.
+ * @param[in,out] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
+ * On output, this contains the centered and sanitized size factors.
+ * @param options Further options.
+ *
+ * @return Diagnostics for the input size factors and the mean used for centering.
+ */
+template<typename SizeFactor_>
+PrepareSizeFactorsResults<SizeFactor_> prepare_size_factors(size_t num, SizeFactor_* size_factors, const PrepareSizeFactorsOptions& options) {
+    PrepareSizeFactorsResults<SizeFactor_> output;
+    std::vector<SizeFactor_> means;
+    if (internal::prepare_size_factors<false>(num, size_factors, static_cast<const int*>(NULL), options, output.diagnostics, means)) {
+        if (!means.empty()) {
+            output.mean = means.front();
+        }
+        return output;
+    }
+
+    // Falling back to the separate functions if centering causes invalid values to appear, e.g., due to overflow.
+    // The diagnostics from the first sweep are retained as they describe the input size factors.
+    if (options.center) {
+        output.mean = center_size_factors(num, size_factors, NULL, options.center_options);
+    }
+    sanitize_size_factors(num, size_factors, options.sanitize_options);
+    return output;
+}
+
+/**
+ * Center size factors within each block and sanitize them in a single call.
+ * This is equivalent to calling `center_size_factors_blocked()` followed by `sanitize_size_factors()`,
+ * but only requires two passes over `size_factors` and `block`, see `prepare_size_factors()` for details.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ * @tparam Block_ Integer type for the block assignments.
+ *
+ * @param num Number of cells.
+ * @param[in,out] size_factors Pointer to an array of length `num`, containing the size factor for each cell.
+ * On output, this contains size factors that are centered according to `CenterSizeFactorsOptions::block_mode` and then sanitized.
+ * @param[in] block Pointer to an array of length `num`, containing the block assignment for each cell.
+ * Each assignment should be an integer in \f$[0, N)\f$ where \f$N\f$ is the total number of blocks.
+ * @param options Further options.
+ *
+ * @return Diagnostics for the input size factors and the mean size factor for each block.
+ */
+template<typename SizeFactor_, typename Block_>
+PrepareSizeFactorsBlockedResults<SizeFactor_> prepare_size_factors_blocked(size_t num, SizeFactor_* size_factors, const Block_* block, const PrepareSizeFactorsOptions& options) {
+    PrepareSizeFactorsBlockedResults<SizeFactor_> output;
+    if (internal::prepare_size_factors<true>(num, size_factors, block, options, output.diagnostics, output.block_means)) {
+        return output;
+    }
+
+    if (options.center) {
+        output.block_means = center_size_factors_blocked(num, size_factors, block, NULL, options.center_options);
+    } else {
+        output.block_means.clear();
+    }
+    sanitize_size_factors(num, size_factors, options.sanitize_options);
+    return output;
+}
+
+}
+
+#endif
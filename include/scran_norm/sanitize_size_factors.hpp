@@ -2,8 +2,15 @@
 #define SCRAN_SANITIZE_SIZE_FACTORS_HPP
 
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <limits>
 #include <stdexcept>
 
+#include "tatami/tatami.hpp"
+
+#include "instrumentation.hpp"
+
 /**
  * @file sanitize_size_factors.hpp
  * @brief Sanitize invalid size factors.
@@ -102,6 +109,74 @@ double find_largest_valid_factor(size_t num, const SizeFactor_* size_factors) {
     return largest;
 }
 
+template<typename SizeFactor_>
+struct SanitizeStatistics {
+    SizeFactorDiagnostics diagnostics;
+    SizeFactor_ smallest = 1;
+    SizeFactor_ largest = 1;
+    bool found = false;
+};
+
+template<bool diagnose_, typename SizeFactor_>
+void add_sanitize_statistics(size_t start, size_t length, const SizeFactor_* size_factors, SanitizeStatistics<SizeFactor_>& stats) {
+    for (size_t i = start, end = start + length; i < end; ++i) {
+        auto s = size_factors[i];
+        bool valid;
+        if constexpr(diagnose_) {
+            valid = !is_invalid(s, stats.diagnostics);
+        } else {
+            valid = std::isfinite(s) && s > 0;
+        }
+        if (valid) {
+            if (!stats.found) {
+                stats.smallest = s;
+                stats.largest = s;
+                stats.found = true;
+            } else {
+                stats.smallest = std::min(stats.smallest, s);
+                stats.largest = std::max(stats.largest, s);
+            }
+        }
+    }
+}
+
+template<bool diagnose_, typename SizeFactor_>
+SanitizeStatistics<SizeFactor_> compute_sanitize_statistics(size_t num, const SizeFactor_* size_factors, int num_threads) {
+    SanitizeStatistics<SizeFactor_> output;
+    if (num_threads <= 1) {
+        add_sanitize_statistics<diagnose_>(0, num, size_factors, output);
+        return output;
+    }
+
+    // Each thread reduces its own contiguous interval, and the per-thread results are then combined.
+    std::vector<SanitizeStatistics<SizeFactor_> > partials(num_threads);
+    tatami::parallelize([&](int t, size_t start, size_t length) -> void {
+        add_sanitize_statistics<diagnose_>(start, length, size_factors, partials[t]);
+    }, num, num_threads);
+
+    for (const auto& current : partials) {
+        if constexpr(diagnose_) {
+            output.diagnostics.has_negative |= current.diagnostics.has_negative;
+            output.diagnostics.has_zero |= current.diagnostics.has_zero;
+            output.diagnostics.has_nan |= current.diagnostics.has_nan;
+            output.diagnostics.has_infinite |= current.diagnostics.has_infinite;
+        }
+        if (!current.found) {
+            continue;
+        }
+        if (!output.found) {
+            output.smallest = current.smallest;
+            output.largest = current.largest;
+            output.found = true;
+        } else {
+            output.smallest = std::min(output.smallest, current.smallest);
+            output.largest = std::max(output.largest, current.largest);
+        }
+    }
+
+    return output;
+}
+
 }
 /**
  * @endcond
@@ -172,8 +247,72 @@ struct SanitizeSizeFactorsOptions {
      * This ensures that any normalized values will be, at least, finite; the choice of a relatively large replacement value reflects the extremity of the scaling.
      */
     SanitizeAction handle_infinite = SanitizeAction::ERROR;
+
+    /**
+     * Number of threads to use.
+     * The parallelization scheme is determined by `tatami::parallelize()`.
+     */
+    int num_threads = 1;
 };
 
+/**
+ * @cond
+ */
+namespace internal {
+
+inline void check_sanitize_errors(const SizeFactorDiagnostics& status, const SanitizeSizeFactorsOptions& options) {
+    if (status.has_negative && options.handle_negative == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected negative size factor");
+    }
+    if (status.has_zero && options.handle_zero == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected size factor of zero");
+    }
+    if (status.has_nan && options.handle_nan == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected NaN size factor");
+    }
+    if (status.has_infinite && options.handle_infinite == SanitizeAction::ERROR) {
+        throw std::runtime_error("detected infinite size factor");
+    }
+}
+
+template<typename SizeFactor_>
+void replace_invalid_size_factors(size_t num, SizeFactor_* size_factors, const SizeFactorDiagnostics& status, SizeFactor_ smallest, SizeFactor_ largest, const SanitizeSizeFactorsOptions& options) {
+    bool replace_negative = status.has_negative && options.handle_negative == SanitizeAction::SANITIZE;
+    bool replace_zero = status.has_zero && options.handle_zero == SanitizeAction::SANITIZE;
+    bool replace_nan = status.has_nan && options.handle_nan == SanitizeAction::SANITIZE;
+    bool replace_infinite = status.has_infinite && options.handle_infinite == SanitizeAction::SANITIZE;
+    if (!replace_negative && !replace_zero && !replace_nan && !replace_infinite) {
+        return;
+    }
+
+    // Each replacement is written as a select rather than an if/else chain, so that the compiler can vectorize the loop.
+    // The replacement values are all valid, so a replaced value will not be caught by any later select.
+    auto replace = [&](size_t start, size_t length) -> void {
+        constexpr SizeFactor_ inf = std::numeric_limits<SizeFactor_>::infinity();
+        for (size_t i = start, end = start + length; i < end; ++i) {
+            auto s = size_factors[i];
+            s = ((replace_negative & (s < 0)) ? smallest : s);
+            s = ((replace_zero & (s == 0)) ? smallest : s);
+            s = ((replace_nan & (s != s)) ? static_cast<SizeFactor_>(1) : s);
+            s = ((replace_infinite & (s == inf)) ? largest : s);
+            size_factors[i] = s;
+        }
+    };
+
+    if (options.num_threads <= 1) {
+        replace(0, num);
+    } else {
+        tatami::parallelize([&](int, size_t start, size_t length) -> void {
+            replace(start, length);
+        }, num, options.num_threads);
+    }
+}
+
+}
+/**
+ * @endcond
+ */
+
 /**
  * Replace zero, missing or infinite values in the size factor array so that it can be used to compute well-defined normalized values.
  * Such size factors can occasionally arise if, e.g., insufficient quality control was performed upstream.
@@ -184,6 +323,10 @@ struct SanitizeSizeFactorsOptions {
  * This ensures that the results of those functions are not affected by the placeholder values used to replace the invalid size factors.
  * As a rule of thumb, `sanitize_size_factors()` should be called just before passing those size factors to `normalize_counts()`.
  *
+ * Any error is thrown before `size_factors` is modified.
+ * Otherwise, the replacement values are computed in a single pass and all invalid size factors are replaced in a second pass,
+ * both of which are parallelized according to `SanitizeSizeFactorsOptions::num_threads`.
+ *
  * @tparam SizeFactor_ Floating-point type for the size factors.
  *
  * @param num Number of size factors.
@@ -195,64 +338,47 @@ struct SanitizeSizeFactorsOptions {
  */
 template<typename SizeFactor_>
 void sanitize_size_factors(size_t num, SizeFactor_* size_factors, const SizeFactorDiagnostics& status, const SanitizeSizeFactorsOptions& options) {
-    SizeFactor_ smallest = -1;
-
-    if (status.has_negative) {
-        if (options.handle_negative == SanitizeAction::ERROR) {
-            throw std::runtime_error("detected negative size factor");
-        } else if (options.handle_negative == SanitizeAction::SANITIZE) {
-            smallest = internal::find_smallest_valid_factor(num, size_factors);
-            for (size_t i = 0; i < num; ++i) {
-                auto& s = size_factors[i];
-                if (s < 0) {
-                    s = smallest;
-                }
-            }
-        }
+    internal::InstrumentationScope scope(InstrumentationEvent::SANITIZE_SIZE_FACTORS, num);
+    internal::check_sanitize_errors(status, options);
+
+    bool need_smallest = (status.has_negative && options.handle_negative == SanitizeAction::SANITIZE) || (status.has_zero && options.handle_zero == SanitizeAction::SANITIZE);
+    bool need_largest = status.has_infinite && options.handle_infinite == SanitizeAction::SANITIZE;
+    SizeFactor_ smallest = 1, largest = 1;
+    if (need_smallest || need_largest) {
+        auto stats = internal::compute_sanitize_statistics<false>(num, size_factors, options.num_threads);
+        smallest = stats.smallest;
+        largest = stats.largest;
     }
 
-    if (status.has_zero) {
-        if (options.handle_zero == SanitizeAction::ERROR) {
-            throw std::runtime_error("detected size factor of zero");
-        } else if (options.handle_zero == SanitizeAction::SANITIZE) {
-            if (smallest < 0) {
-                smallest = internal::find_smallest_valid_factor(num, size_factors);
-            }
-            for (size_t i = 0; i < num; ++i) {
-                auto& s = size_factors[i];
-                if (s == 0) {
-                    s = smallest;
-                }
-            }
-        }
+    // NaNs are replaced with 1 before the infinite values, so 1 is also considered when choosing the largest valid factor.
+    if (status.has_nan && options.handle_nan == SanitizeAction::SANITIZE) {
+        largest = std::max(largest, static_cast<SizeFactor_>(1));
     }
 
-    if (status.has_nan) {
-        if (options.handle_nan == SanitizeAction::ERROR) {
-            throw std::runtime_error("detected NaN size factor");
-        } else if (options.handle_nan == SanitizeAction::SANITIZE) {
-            for (size_t i = 0; i < num; ++i) {
-                auto& s = size_factors[i];
-                if (std::isnan(s)) {
-                    s = 1;
-                }
-            }
-        }
-    }
+    internal::replace_invalid_size_factors(num, size_factors, status, smallest, largest, options);
+}
 
-    if (status.has_infinite) {
-        if (options.handle_infinite == SanitizeAction::ERROR) {
-            throw std::runtime_error("detected infinite size factor");
-        } else if (options.handle_infinite == SanitizeAction::SANITIZE) {
-            auto largest = internal::find_largest_valid_factor(num, size_factors);
-            for (size_t i = 0; i < num; ++i) {
-                auto& s = size_factors[i];
-                if (std::isinf(s)) {
-                    s = largest;
-                }
-            }
-        }
-    }
+/**
+ * Overload of `sanitize_size_factors()` with pre-computed replacement values.
+ * This is intended for size factors that are processed in chunks, e.g., with `SizeFactorCenterer`,
+ * where the replacement values should be computed from all chunks rather than the current chunk.
+ * All replacements are performed in a single pass over `size_factors`.
+ *
+ * @tparam SizeFactor_ Floating-point type for the size factors.
+ *
+ * @param num Number of size factors.
+ * @param[in,out] size_factors Pointer to an array of positive size factors of length `n`.
+ * On output, invalid size factors are replaced.
+ * @param status A pre-computed object indicating whether invalid size factors are present across all chunks.
+ * @param smallest Smallest valid size factor across all chunks, used to replace zero and negative size factors.
+ * @param largest Largest valid size factor across all chunks, used to replace infinite size factors.
+ * @param options Further options.
+ */
+template<typename SizeFactor_>
+void sanitize_size_factors(size_t num, SizeFactor_* size_factors, const SizeFactorDiagnostics& status, SizeFactor_ smallest, SizeFactor_ largest, const SanitizeSizeFactorsOptions& options) {
+    internal::InstrumentationScope scope(InstrumentationEvent::SANITIZE_SIZE_FACTORS, num);
+    internal::check_sanitize_errors(status, options);
+    internal::replace_invalid_size_factors(num, size_factors, status, smallest, largest, options);
 }
 
 /**
@@ -269,8 +395,15 @@ void sanitize_size_factors(size_t num, SizeFactor_* size_factors, const SizeFact
  */
 template<typename SizeFactor_>
 SizeFactorDiagnostics sanitize_size_factors(size_t num, SizeFactor_* size_factors, const SanitizeSizeFactorsOptions& options) {
-    auto output = check_size_factor_sanity(num, size_factors);
-    sanitize_size_factors(num, size_factors, output, options);
+    internal::InstrumentationScope scope(InstrumentationEvent::SANITIZE_SIZE_FACTORS, num);
+    // Diagnostics and replacement values are collected in the same pass.
+    auto stats = internal::compute_sanitize_statistics<true>(num, size_factors, options.num_threads);
+    const auto& output = stats.diagnostics;
+    internal::check_sanitize_errors(output, options);
+    if (output.has_nan && options.handle_nan == SanitizeAction::SANITIZE) {
+        stats.largest = std::max(stats.largest, static_cast<SizeFactor_>(1));
+    }
+    internal::replace_invalid_size_factors(num, size_factors, output, stats.smallest, stats.largest, options);
     return output;
 }
 
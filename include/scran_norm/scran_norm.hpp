@@ -3,7 +3,16 @@
 
 #include "center_size_factors.hpp"
 #include "choose_pseudo_count.hpp"
+#include "compute_size_factors.hpp"
 #include "normalize_counts.hpp"
+#include "normalize_counts_realized.hpp"
+#include "normalize_counts_inplace.hpp"
+#include "normalize_counts_quantized.hpp"
+#include "cache_normalized_counts.hpp"
+#include "prepare_size_factors.hpp"
+#include "persist_normalization.hpp"
+#include "instrumentation.hpp"
+#include "serialize.hpp"
 
 /**
  * @file scran_norm.hpp
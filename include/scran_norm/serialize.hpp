@@ -0,0 +1,172 @@
+#ifndef SCRAN_NORM_SERIALIZE_HPP
+#define SCRAN_NORM_SERIALIZE_HPP
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * @file serialize.hpp
+ * @brief Serialization of partial statistics.
+ */
+
+namespace scran_norm {
+
+/**
+ * @cond
+ */
+namespace internal {
+
+/*
+ * Byte-level serialization of the partial statistics in the streaming
+ * accumulators, e.g., for sending them between nodes in a distributed
+ * analysis. Values are copied in the native representation, so the writer
+ * and reader are assumed to be using the same architecture.
+ */
+class StatisticsWriter {
+public:
+    StatisticsWriter() = default;
+
+    StatisticsWriter(uint32_t tag) {
+        write(tag);
+    }
+
+    template<typename Type_>
+    void write(Type_ x) {
+        static_assert(std::is_trivially_copyable<Type_>::value);
+        auto offset = my_buffer.size();
+        my_buffer.resize(offset + sizeof(Type_));
+        std::memcpy(my_buffer.data() + offset, &x, sizeof(Type_));
+    }
+
+    template<typename Type_>
+    void write(const std::vector<Type_>& x) {
+        write(static_cast<uint64_t>(x.size()));
+        for (const auto& y : x) {
+            write(y);
+        }
+    }
+
+    template<typename Type_>
+    void write_array(const Type_* x, size_t n) {
+        static_assert(std::is_trivially_copyable<Type_>::value);
+        auto offset = my_buffer.size();
+        my_buffer.resize(offset + n * sizeof(Type_));
+        if (n) {
+            std::memcpy(my_buffer.data() + offset, x, n * sizeof(Type_));
+        }
+    }
+
+    // Zero-padding so that the next value starts at a multiple of 'alignment' from the start of the buffer.
+    void pad(size_t alignment) {
+        auto remainder = my_buffer.size() % alignment;
+        if (remainder) {
+            my_buffer.resize(my_buffer.size() + alignment - remainder);
+        }
+    }
+
+    std::vector<unsigned char> release() {
+        return std::move(my_buffer);
+    }
+
+private:
+    std::vector<unsigned char> my_buffer;
+};
+
+class StatisticsReader {
+public:
+    StatisticsReader(const unsigned char* data, size_t size) : my_data(data), my_size(size) {}
+
+    StatisticsReader(const unsigned char* data, size_t size, uint32_t tag) : StatisticsReader(data, size) {
+        check_tag(tag);
+    }
+
+    void check_tag(uint32_t tag) {
+        if (read<uint32_t>() != tag) {
+            throw std::runtime_error("serialized statistics are not of the expected type");
+        }
+    }
+
+    template<typename Type_>
+    Type_ read() {
+        static_assert(std::is_trivially_copyable<Type_>::value);
+        if (my_size - my_position < sizeof(Type_)) {
+            throw std::runtime_error("serialized statistics are truncated");
+        }
+        Type_ output;
+        std::memcpy(&output, my_data + my_position, sizeof(Type_));
+        my_position += sizeof(Type_);
+        return output;
+    }
+
+    template<typename Type_>
+    std::vector<Type_> read_vector() {
+        auto len = read<uint64_t>();
+        if ((my_size - my_position) / sizeof(Type_) < len) {
+            throw std::runtime_error("serialized statistics are truncated");
+        }
+        std::vector<Type_> output;
+        output.reserve(len);
+        for (uint64_t i = 0; i < len; ++i) {
+            output.push_back(read<Type_>());
+        }
+        return output;
+    }
+
+    // Pointer to an array inside the buffer, without any copying. This
+    // requires the buffer itself to be suitably aligned, e.g., from mmap.
+    template<typename Type_>
+    const Type_* view(size_t len) {
+        static_assert(std::is_trivially_copyable<Type_>::value);
+        if ((my_size - my_position) / sizeof(Type_) < len) {
+            throw std::runtime_error("serialized statistics are truncated");
+        }
+        auto ptr = my_data + my_position;
+        if (reinterpret_cast<std::uintptr_t>(ptr) % alignof(Type_) != 0) {
+            throw std::runtime_error("serialized array is not suitably aligned");
+        }
+        my_position += len * sizeof(Type_);
+        return reinterpret_cast<const Type_*>(ptr);
+    }
+
+    void skip_padding(size_t alignment) {
+        auto remainder = my_position % alignment;
+        if (remainder) {
+            auto len = alignment - remainder;
+            if (my_size - my_position < len) {
+                throw std::runtime_error("serialized statistics are truncated");
+            }
+            my_position += len;
+        }
+    }
+
+    void finish() const {
+        if (my_position != my_size) {
+            throw std::runtime_error("unexpected trailing bytes in serialized statistics");
+        }
+    }
+
+private:
+    const unsigned char* my_data;
+    size_t my_size;
+    size_t my_position = 0;
+};
+
+// The tag contains the statistic type and the size of the floating-point
+// type, so that we don't accidentally read the wrong thing.
+template<typename Float_>
+constexpr uint32_t statistics_tag(uint32_t type) {
+    return (type << 8) | static_cast<uint32_t>(sizeof(Float_));
+}
+
+}
+/**
+ * @endcond
+ */
+
+}
+
+#endif
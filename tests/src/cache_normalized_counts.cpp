@@ -0,0 +1,161 @@
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <memory>
+#include <tuple>
+
+#include "scran_tests/scran_tests.hpp"
+
+#include "scran_norm/normalize_counts.hpp"
+#include "scran_norm/cache_normalized_counts.hpp"
+
+class CacheNormalizedCountsTest : public ::testing::TestWithParam<std::tuple<bool, bool, size_t> > {
+protected:
+    inline static std::shared_ptr<tatami::Matrix<double, int> > sparse_counts, dense_counts;
+    inline static std::vector<double> size_factors;
+
+    static void SetUpTestSuite() {
+        int nr = 57, nc = 83;
+        size_factors = scran_tests::simulate_vector(nc, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 2;
+            sparams.seed = 100;
+            return sparams;
+        }());
+
+        auto vec = scran_tests::simulate_vector(static_cast<size_t>(nr) * nc, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 200;
+            return sparams;
+        }());
+
+        dense_counts.reset(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+        sparse_counts = tatami::convert_to_compressed_sparse(dense_counts.get(), true);
+    }
+
+    static std::vector<double> dense_extract(tatami::MyopicDenseExtractor<double, int>* ext, int i, size_t n) {
+        std::vector<double> buffer(n);
+        auto ptr = ext->fetch(i, buffer.data());
+        tatami::copy_n(ptr, n, buffer.data());
+        return buffer;
+    }
+
+    static std::pair<std::vector<double>, std::vector<int> > sparse_extract(tatami::MyopicSparseExtractor<double, int>* ext, int i, size_t n) {
+        std::vector<double> vbuffer(n);
+        std::vector<int> ibuffer(n);
+        auto range = ext->fetch(i, vbuffer.data(), ibuffer.data());
+        return std::make_pair(std::vector<double>(range.value, range.value + range.number), std::vector<int>(range.index, range.index + range.number));
+    }
+
+    static void compare(const tatami::Matrix<double, int>* ref, const tatami::Matrix<double, int>* obs, bool row) {
+        int primary = (row ? ref->nrow() : ref->ncol());
+        int secondary = (row ? ref->ncol() : ref->nrow());
+        int block_start = secondary / 5, block_length = secondary / 2;
+        auto indices = std::make_shared<std::vector<int> >();
+        for (int j = 1; j < secondary; j += 3) {
+            indices->push_back(j);
+        }
+
+        tatami::Options opt;
+        auto rfull = ref->dense(row, opt), ofull = obs->dense(row, opt);
+        auto rblock = ref->dense(row, block_start, block_length, opt), oblock = obs->dense(row, block_start, block_length, opt);
+        auto rindex = ref->dense(row, indices, opt), oindex = obs->dense(row, indices, opt);
+        auto srfull = ref->sparse(row, opt), sofull = obs->sparse(row, opt);
+        auto srblock = ref->sparse(row, block_start, block_length, opt), soblock = obs->sparse(row, block_start, block_length, opt);
+        auto srindex = ref->sparse(row, indices, opt), soindex = obs->sparse(row, indices, opt);
+
+        // Jumping around to force re-use and eviction of chunks.
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int i = 0; i < primary; ++i) {
+                int p = (pass ? primary - i - 1 : (i * 7) % primary);
+                EXPECT_EQ(dense_extract(rfull.get(), p, secondary), dense_extract(ofull.get(), p, secondary));
+                EXPECT_EQ(dense_extract(rblock.get(), p, block_length), dense_extract(oblock.get(), p, block_length));
+                EXPECT_EQ(dense_extract(rindex.get(), p, indices->size()), dense_extract(oindex.get(), p, indices->size()));
+                EXPECT_EQ(sparse_extract(srfull.get(), p, secondary), sparse_extract(sofull.get(), p, secondary));
+                EXPECT_EQ(sparse_extract(srblock.get(), p, block_length), sparse_extract(soblock.get(), p, block_length));
+                EXPECT_EQ(sparse_extract(srindex.get(), p, indices->size()), sparse_extract(soindex.get(), p, indices->size()));
+            }
+        }
+    }
+};
+
+TEST_P(CacheNormalizedCountsTest, Extraction) {
+    auto param = GetParam();
+    bool sparse = std::get<0>(param);
+    scran_norm::CacheNormalizedCountsOptions copt;
+    copt.row = std::get<1>(param);
+    copt.cache_size = std::get<2>(param);
+    copt.chunk_size = 7;
+
+    scran_norm::NormalizeCountsOptions nopt;
+    auto normalized = scran_norm::normalize_counts(sparse ? sparse_counts : dense_counts, size_factors, nopt);
+    auto cached = scran_norm::cache_normalized_counts(normalized, copt);
+    EXPECT_EQ(cached->nrow(), normalized->nrow());
+    EXPECT_EQ(cached->ncol(), normalized->ncol());
+    EXPECT_EQ(cached->is_sparse(), normalized->is_sparse());
+    EXPECT_EQ(cached->prefer_rows(), copt.row);
+
+    compare(normalized.get(), cached.get(), copt.row);
+    compare(normalized.get(), cached.get(), !copt.row);
+
+    auto usage = static_cast<const scran_norm::CachedNormalizedMatrix<double, int>*>(cached.get())->cache_usage();
+    EXPECT_LE(usage, copt.cache_size);
+    if (copt.cache_size < 1000) {
+        EXPECT_EQ(usage, 0);
+    } else {
+        EXPECT_GT(usage, 0);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    CacheNormalizedCounts,
+    CacheNormalizedCountsTest,
+    ::testing::Combine(
+        ::testing::Values(false, true), // sparse or not.
+        ::testing::Values(false, true), // chunk by row or column.
+        ::testing::Values(0, 500, 5000, 100000000) // no cache, cache smaller than one chunk, small cache with evictions, everything cached.
+    )
+);
+
+TEST_F(CacheNormalizedCountsTest, Parallel) {
+    scran_norm::NormalizeCountsOptions nopt;
+    auto normalized = scran_norm::normalize_counts(sparse_counts, size_factors, nopt);
+    scran_norm::CacheNormalizedCountsOptions copt;
+    copt.chunk_size = 5;
+    copt.cache_size = 3000;
+    auto cached = scran_norm::cache_normalized_counts(normalized, copt);
+
+    int NR = normalized->nrow(), NC = normalized->ncol();
+    std::vector<double> expected, observed(static_cast<size_t>(NR) * NC);
+    {
+        auto ext = normalized->dense_row();
+        for (int r = 0; r < NR; ++r) {
+            auto row = dense_extract(ext.get(), r, NC);
+            expected.insert(expected.end(), row.begin(), row.end());
+        }
+    }
+
+    // Each thread iterates over all rows, starting at different positions, so that they compete for the same chunks.
+    int nthreads = 4;
+    std::vector<std::vector<double> > results(nthreads);
+    tatami::parallelize([&](int, int start, int length) -> void {
+        for (int t = start, end = start + length; t < end; ++t) {
+            auto ext = cached->dense_row();
+            auto& current = results[t];
+            current.resize(observed.size());
+            for (int i = 0; i < NR; ++i) {
+                int r = (i + t * 13) % NR;
+                auto row = dense_extract(ext.get(), r, NC);
+                std::copy(row.begin(), row.end(), current.begin() + static_cast<size_t>(r) * NC);
+            }
+        }
+    }, nthreads, nthreads);
+
+    for (const auto& res : results) {
+        EXPECT_EQ(res, expected);
+    }
+}
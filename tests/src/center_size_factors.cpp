@@ -3,6 +3,10 @@
 #include <limits>
 #include <cmath>
 #include <vector>
+#include <numeric>
+#include <algorithm>
+
+#include "scran_tests/scran_tests.hpp"
 
 #include "scran_norm/center_size_factors.hpp"
 
@@ -160,3 +164,559 @@ TEST(CenterSizeFactors, BlockIgnoreZeros) {
         EXPECT_EQ(empty, std::vector<double>(empty.size()));
     }
 }
+
+TEST(CenterSizeFactors, Parallel) {
+    size_t n = 300000; // enough for multiple chunks.
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 2468;
+        return sparams;
+    }());
+    for (size_t i = 0; i < n; i += 1001) {
+        sf[i] = 0;
+    }
+
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 13) % 7;
+    }
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    auto ref = sf;
+    scran_norm::SizeFactorDiagnostics refdiag;
+    auto refmean = scran_norm::center_size_factors(ref.size(), ref.data(), &refdiag, opt);
+    EXPECT_TRUE(refdiag.has_zero);
+    auto refblocked = sf;
+    auto refmeans = scran_norm::center_size_factors_blocked(refblocked.size(), refblocked.data(), block.data(), NULL, opt);
+
+    // Roughly the same as a naive calculation.
+    {
+        double expected = 0;
+        size_t denom = 0;
+        for (auto s : sf) {
+            if (s > 0) {
+                expected += s;
+                ++denom;
+            }
+        }
+        scran_tests::compare_almost_equal(refmean, expected / denom);
+    }
+
+    // Exactly the same for different numbers of threads.
+    for (int threads : { 2, 3, 7 }) {
+        opt.num_threads = threads;
+
+        auto copy = sf;
+        scran_norm::SizeFactorDiagnostics diag;
+        auto mean = scran_norm::center_size_factors(copy.size(), copy.data(), &diag, opt);
+        EXPECT_EQ(mean, refmean);
+        EXPECT_EQ(copy, ref);
+        EXPECT_TRUE(diag.has_zero);
+
+        for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+            opt.block_mode = mode;
+            auto bcopy = sf;
+            auto means = scran_norm::center_size_factors_blocked(bcopy.size(), bcopy.data(), block.data(), NULL, opt);
+            EXPECT_EQ(means, refmeans);
+            if (mode == scran_norm::CenterBlockMode::LOWEST) {
+                EXPECT_EQ(bcopy, refblocked);
+            }
+        }
+        opt.block_mode = scran_norm::CenterBlockMode::LOWEST;
+    }
+}
+
+TEST(CenterSizeFactors, Streaming) {
+    size_t n = 1000;
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 99;
+        return sparams;
+    }());
+    sf[10] = 0;
+    sf[20] = std::numeric_limits<double>::infinity();
+
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 7) % 4;
+    }
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+        opt.block_mode = mode;
+        auto ref = sf;
+        scran_norm::SizeFactorDiagnostics refdiag;
+        auto refmeans = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), &refdiag, opt);
+
+        scran_norm::SizeFactorCenterer<double> centerer(opt);
+        size_t chunk = 77;
+        for (size_t i = 0; i < n; i += chunk) {
+            centerer.add(std::min(chunk, n - i), sf.data() + i, block.data() + i);
+        }
+        auto means = centerer.finalize();
+        scran_tests::compare_almost_equal(means, refmeans);
+        EXPECT_TRUE(centerer.get_diagnostics().has_zero);
+        EXPECT_TRUE(centerer.get_diagnostics().has_infinite);
+        EXPECT_FALSE(centerer.get_diagnostics().has_nan);
+
+        auto copy = sf;
+        for (size_t i = 0; i < n; i += chunk) {
+            centerer.center(std::min(chunk, n - i), copy.data() + i, block.data() + i);
+        }
+        scran_tests::compare_almost_equal(copy, ref);
+
+        // Replacement values are consistent with the centered values.
+        scran_tests::compare_almost_equal(centerer.get_smallest_valid(), scran_norm::internal::find_smallest_valid_factor(n, ref.data()));
+        scran_tests::compare_almost_equal(centerer.get_largest_valid(), scran_norm::internal::find_largest_valid_factor(n, ref.data()));
+    }
+
+    // Unblocked version.
+    {
+        auto ref = sf;
+        auto refmean = scran_norm::center_size_factors(ref.size(), ref.data(), NULL, opt);
+
+        scran_norm::SizeFactorCenterer<double> centerer(opt);
+        centerer.add(300, sf.data());
+        centerer.add(n - 300, sf.data() + 300);
+        auto means = centerer.finalize();
+        ASSERT_EQ(means.size(), 1);
+        scran_tests::compare_almost_equal(means[0], refmean);
+
+        auto copy = sf;
+        centerer.center(300, copy.data());
+        centerer.center(n - 300, copy.data() + 300);
+        scran_tests::compare_almost_equal(copy, ref);
+    }
+}
+
+TEST(CenterSizeFactors, MixedPrecision) {
+    // Adding to a large float would lose the small values if the sum was accumulated in single precision.
+    size_t n = 1001;
+    std::vector<float> sf(n, 1);
+    sf[0] = 1e8;
+    double expected = (1e8 + 1000) / n;
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    auto mean = scran_norm::center_size_factors_mean(n, sf.data(), NULL, opt);
+    EXPECT_EQ(mean, static_cast<float>(expected));
+
+    std::vector<int> block(n);
+    auto bmeans = scran_norm::center_size_factors_blocked_mean(n, sf.data(), block.data(), NULL, opt);
+    ASSERT_EQ(bmeans.size(), 1);
+    EXPECT_EQ(bmeans[0], static_cast<float>(expected));
+
+    scran_norm::SizeFactorCenterer<float> centerer(opt);
+    centerer.add(n, sf.data());
+    auto smeans = centerer.finalize();
+    EXPECT_EQ(smeans[0], static_cast<float>(expected));
+}
+
+TEST(CenterSizeFactors, Appending) {
+    size_t n = 900;
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 420;
+        return sparams;
+    }());
+    sf[5] = 0;
+
+    // The last block only shows up in the later batches.
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i < 300 ? i % 2 : i % 3);
+    }
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+        opt.block_mode = mode;
+        scran_norm::BlockedCenteringState<double> state(opt);
+        std::vector<double> centered;
+        std::vector<int> seen_block;
+
+        for (size_t start : { 0, 300, 650 }) {
+            size_t end = (start == 650 ? n : (start == 0 ? 300 : 650));
+            std::vector<double> batch(sf.begin() + start, sf.begin() + end);
+            auto rescale = state.append(batch.size(), batch.data(), block.data() + start);
+
+            // Applying the rescaling to the existing cells.
+            size_t nold = centered.size();
+            for (size_t i = 0; i < nold; ++i) {
+                centered[i] *= rescale[seen_block[i]];
+            }
+            if (mode == scran_norm::CenterBlockMode::LOWEST) {
+                for (auto r : rescale) {
+                    EXPECT_EQ(r, rescale.front());
+                }
+            }
+            centered.insert(centered.end(), batch.begin(), batch.end());
+            seen_block.insert(seen_block.end(), block.begin() + start, block.begin() + end);
+
+            auto ref = std::vector<double>(sf.begin(), sf.begin() + end);
+            auto refmeans = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), NULL, opt);
+            scran_tests::compare_almost_equal(state.get_block_means(), refmeans);
+            scran_tests::compare_almost_equal(centered, ref);
+        }
+
+        EXPECT_EQ(state.get_scale().size(), 3);
+        EXPECT_TRUE(state.get_diagnostics().has_zero);
+    }
+}
+
+TEST(CenterSizeFactors, Merged) {
+    size_t n = 1000;
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 77;
+        return sparams;
+    }());
+    sf[10] = 0;
+    sf[600] = std::numeric_limits<double>::infinity();
+
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 3) % 5;
+    }
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+        opt.block_mode = mode;
+        auto ref = sf;
+        auto refmeans = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), NULL, opt);
+
+        // Each shard computes its partial statistics and serializes them.
+        std::vector<size_t> boundaries { 0, 200, 550, n };
+        std::vector<std::vector<unsigned char> > serialized;
+        for (size_t s = 0; s < 3; ++s) {
+            scran_norm::SizeFactorCenterer<double> shard(opt);
+            shard.add(boundaries[s + 1] - boundaries[s], sf.data() + boundaries[s], block.data() + boundaries[s]);
+            serialized.push_back(shard.serialize());
+        }
+
+        // Each shard then merges all partial statistics and centers its own size factors.
+        auto copy = sf;
+        for (size_t s = 0; s < 3; ++s) {
+            scran_norm::SizeFactorCenterer<double> global(opt);
+            for (const auto& ser : serialized) {
+                scran_norm::SizeFactorCenterer<double> partial(opt);
+                partial.deserialize(ser.data(), ser.size());
+                global.merge(partial);
+            }
+
+            auto means = global.finalize();
+            scran_tests::compare_almost_equal(means, refmeans);
+            EXPECT_TRUE(global.get_diagnostics().has_zero);
+            EXPECT_TRUE(global.get_diagnostics().has_infinite);
+            global.center(boundaries[s + 1] - boundaries[s], copy.data() + boundaries[s], block.data() + boundaries[s]);
+        }
+        scran_tests::compare_almost_equal(copy, ref);
+    }
+}
+
+TEST(CenterSizeFactors, MergedErrors) {
+    std::vector<double> sf { 0.5, 1.2, 0, 2.5, 0.8 };
+    std::vector<int> block { 0, 1, 0, 1, 2 };
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    scran_norm::SizeFactorCenterer<double> centerer(opt);
+    centerer.add(sf.size(), sf.data(), block.data());
+    auto serialized = centerer.serialize();
+
+    // Catches errors in the serialized data.
+    scran_norm::SizeFactorCenterer<double> target(opt);
+    target.add(2, sf.data(), block.data());
+    auto original = target.serialize();
+    scran_tests::expect_error([&]() {
+        target.deserialize(serialized.data(), serialized.size() - 1);
+    }, "truncated");
+    EXPECT_EQ(target.serialize(), original);
+
+    scran_norm::SizeFactorCenterer<float> fcenterer(opt);
+    scran_tests::expect_error([&]() {
+        fcenterer.deserialize(serialized.data(), serialized.size());
+    }, "expected type");
+
+    // Catches differences in the options.
+    for (int setting = 0; setting < 2; ++setting) {
+        auto other_opt = opt;
+        if (setting == 0) {
+            other_opt.block_mode = scran_norm::CenterBlockMode::PER_BLOCK;
+        } else {
+            other_opt.ignore_invalid = !opt.ignore_invalid;
+        }
+
+        scran_norm::SizeFactorCenterer<double> other(other_opt);
+        other.add(sf.size(), sf.data(), block.data());
+        scran_tests::expect_error([&]() {
+            centerer.merge(other);
+        }, "same options");
+
+        auto other_original = other.serialize();
+        scran_tests::expect_error([&]() {
+            other.deserialize(serialized.data(), serialized.size());
+        }, "different options");
+        EXPECT_EQ(other.serialize(), other_original);
+    }
+
+    // Options that don't affect the partial statistics are not checked.
+    auto other_opt = opt;
+    other_opt.num_threads = 3;
+    other_opt.compensated_sum = true;
+    scran_norm::SizeFactorCenterer<double> other(other_opt);
+    other.deserialize(serialized.data(), serialized.size());
+    centerer.merge(other);
+}
+
+TEST(CenterSizeFactors, Workspace) {
+    scran_norm::CenterSizeFactorsOptions opt;
+    scran_norm::CenterSizeFactorsWorkspace<double> work;
+
+    for (int it = 0; it < 5; ++it) {
+        size_t n = 50 + it * 20;
+        auto sf = scran_tests::simulate_vector(n, [&]{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 10;
+            sparams.seed = 100 + it;
+            return sparams;
+        }());
+        std::vector<int> block(n);
+        size_t nblocks = it + 1;
+        for (size_t i = 0; i < n; ++i) {
+            block[i] = i % nblocks;
+        }
+
+        for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+            opt.block_mode = mode;
+            auto ref = sf;
+            auto refmeans = scran_norm::center_size_factors_blocked(n, ref.data(), block.data(), NULL, opt);
+
+            auto copy = sf;
+            std::vector<double> means(nblocks);
+            scran_norm::center_size_factors_blocked(n, copy.data(), block.data(), nblocks, NULL, work, means.data(), opt);
+            EXPECT_EQ(means, refmeans);
+            EXPECT_EQ(copy, ref);
+
+            // Extra blocks are allowed and have means of zero.
+            std::vector<double> extra(nblocks + 2, -1);
+            scran_norm::center_size_factors_blocked_mean(n, sf.data(), block.data(), extra.size(), NULL, work, extra.data(), opt);
+            EXPECT_EQ(std::vector<double>(extra.begin(), extra.begin() + nblocks), refmeans);
+            EXPECT_EQ(extra[nblocks], 0);
+            EXPECT_EQ(extra[nblocks + 1], 0);
+        }
+    }
+}
+
+TEST(CenterSizeFactors, Multiple) {
+    size_t n = 200000; // enough for multiple chunks.
+    std::vector<std::vector<double> > all_sf;
+    for (int s = 0; s < 3; ++s) {
+        all_sf.push_back(scran_tests::simulate_vector(n, [&]{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 10;
+            sparams.seed = 1357 + s;
+            return sparams;
+        }()));
+    }
+    for (size_t i = 0; i < n; i += 999) {
+        all_sf[1][i] = 0;
+    }
+
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 7) % 5;
+    }
+
+    for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+        for (int threads : { 1, 3 }) {
+            scran_norm::CenterSizeFactorsOptions opt;
+            opt.block_mode = mode;
+            opt.num_threads = threads;
+
+            auto copies = all_sf;
+            std::vector<double*> ptrs;
+            for (auto& c : copies) {
+                ptrs.push_back(c.data());
+            }
+            std::vector<scran_norm::SizeFactorDiagnostics> diags;
+            auto means = scran_norm::center_size_factors_blocked_multiple(n, ptrs, block.data(), &diags, opt);
+            ASSERT_EQ(means.size(), all_sf.size());
+            ASSERT_EQ(diags.size(), all_sf.size());
+
+            // Same as separate calls.
+            for (size_t s = 0; s < all_sf.size(); ++s) {
+                auto ref = all_sf[s];
+                scran_norm::SizeFactorDiagnostics refdiag;
+                auto refmeans = scran_norm::center_size_factors_blocked(n, ref.data(), block.data(), &refdiag, opt);
+                EXPECT_EQ(means[s], refmeans);
+                EXPECT_EQ(copies[s], ref);
+                EXPECT_EQ(diags[s].has_zero, refdiag.has_zero);
+            }
+            EXPECT_FALSE(diags[0].has_zero);
+            EXPECT_TRUE(diags[1].has_zero);
+        }
+    }
+
+    // Works without any sets.
+    auto empty = scran_norm::center_size_factors_blocked_multiple(n, std::vector<double*>(), block.data(), NULL, scran_norm::CenterSizeFactorsOptions());
+    EXPECT_TRUE(empty.empty());
+}
+
+TEST(CenterSizeFactors, Sorted) {
+    // Creating block-contiguous cells with a mix of block sizes, including empty blocks.
+    size_t nblocks = 2000;
+    std::vector<size_t> offsets(nblocks + 1);
+    for (size_t b = 0; b < nblocks; ++b) {
+        size_t len = (b % 17 == 3 ? 0 : (b * 37) % 200);
+        offsets[b + 1] = offsets[b] + len;
+    }
+    size_t n = offsets.back(); // enough for multiple chunks.
+
+    std::vector<int> block(n);
+    for (size_t b = 0; b < nblocks; ++b) {
+        std::fill(block.begin() + offsets[b], block.begin() + offsets[b + 1], b);
+    }
+
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 9876;
+        return sparams;
+    }());
+    for (size_t i = 0; i < n; i += 777) {
+        sf[i] = 0;
+    }
+    // Filling an entire block with zeros.
+    std::fill(sf.begin() + offsets[10], sf.begin() + offsets[11], 0);
+
+    for (auto ignore : { true, false }) {
+        for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+            for (int threads : { 1, 3 }) {
+                scran_norm::CenterSizeFactorsOptions opt;
+                opt.block_mode = mode;
+                opt.num_threads = threads;
+                opt.ignore_invalid = ignore;
+
+                auto ref = sf;
+                scran_norm::SizeFactorDiagnostics refdiag;
+                auto refmeans = scran_norm::center_size_factors_blocked(n, ref.data(), block.data(), &refdiag, opt);
+
+                auto copy = sf;
+                scran_norm::SizeFactorDiagnostics diag;
+                auto means = scran_norm::center_size_factors_blocked_sorted(nblocks, offsets.data(), copy.data(), &diag, opt);
+                EXPECT_EQ(means, refmeans);
+                EXPECT_EQ(copy, ref);
+                EXPECT_EQ(diag.has_zero, refdiag.has_zero);
+                EXPECT_EQ(diag.has_zero, ignore);
+
+                auto means2 = scran_norm::center_size_factors_blocked_mean_sorted(nblocks, offsets.data(), sf.data(), NULL, opt);
+                EXPECT_EQ(means2, refmeans);
+            }
+        }
+    }
+
+    // Works with no cells.
+    std::vector<int> empty_offsets(5);
+    auto empty = scran_norm::center_size_factors_blocked_sorted(4, empty_offsets.data(), static_cast<double*>(NULL), NULL, scran_norm::CenterSizeFactorsOptions());
+    EXPECT_EQ(empty, std::vector<double>(4));
+
+    std::vector<int> bad_offsets { 1, 2, 3 };
+    scran_tests::expect_error([&]() { scran_norm::center_size_factors_blocked_mean_sorted(2, bad_offsets.data(), sf.data(), NULL, scran_norm::CenterSizeFactorsOptions()); }, "first entry");
+    bad_offsets = std::vector<int>{ 0, 2, 1 };
+    scran_tests::expect_error([&]() { scran_norm::center_size_factors_blocked_mean_sorted(2, bad_offsets.data(), sf.data(), NULL, scran_norm::CenterSizeFactorsOptions()); }, "non-decreasing");
+}
+
+TEST(CenterSizeFactors, Compensated) {
+    // Large first value followed by many small values that are not exactly representable.
+    size_t n = 300000; 
+    std::vector<double> sf(n, 0.1);
+    sf[0] = 1e8;
+    long double expected = 1e8L + static_cast<long double>(n - 1) * static_cast<long double>(0.1);
+    expected /= n;
+
+    scran_norm::CenterSizeFactorsOptions opt;
+    auto naive = scran_norm::center_size_factors_mean(n, sf.data(), NULL, opt);
+    opt.compensated_sum = true;
+    auto compensated = scran_norm::center_size_factors_mean(n, sf.data(), NULL, opt);
+    EXPECT_LT(std::abs(compensated - expected), std::abs(naive - expected));
+    EXPECT_LT(std::abs(compensated - expected), expected * 1e-15);
+
+    auto sim = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 10;
+        sparams.seed = 2468;
+        return sparams;
+    }());
+    for (size_t i = 0; i < n; i += 1111) {
+        sim[i] = 0;
+    }
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 11) % 6;
+    }
+
+    // Same results regardless of the number of threads.
+    for (auto mode : { scran_norm::CenterBlockMode::LOWEST, scran_norm::CenterBlockMode::PER_BLOCK }) {
+        opt.block_mode = mode;
+        opt.num_threads = 1;
+        auto ref = sim;
+        auto refmeans = scran_norm::center_size_factors_blocked(n, ref.data(), block.data(), NULL, opt);
+        auto refmean = scran_norm::center_size_factors_mean(n, sim.data(), NULL, opt);
+
+        for (int threads : { 2, 3, 7 }) {
+            opt.num_threads = threads;
+            auto copy = sim;
+            auto means = scran_norm::center_size_factors_blocked(n, copy.data(), block.data(), NULL, opt);
+            EXPECT_EQ(means, refmeans);
+            EXPECT_EQ(copy, ref);
+            EXPECT_EQ(scran_norm::center_size_factors_mean(n, sim.data(), NULL, opt), refmean);
+
+            auto copy2 = sim;
+            std::vector<double*> ptrs{ copy2.data() };
+            auto multi = scran_norm::center_size_factors_blocked_multiple(n, ptrs, block.data(), NULL, opt);
+            EXPECT_EQ(multi[0], refmeans);
+            EXPECT_EQ(copy2, ref);
+        }
+    }
+
+    // Same results for the sorted layout.
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t l, size_t r) -> bool { return block[l] < block[r]; });
+    std::vector<double> sorted_sf;
+    std::vector<int> sorted_block;
+    for (auto o : order) {
+        sorted_sf.push_back(sim[o]);
+        sorted_block.push_back(block[o]);
+    }
+    std::vector<size_t> offsets(7);
+    for (auto b : sorted_block) {
+        ++(offsets[b + 1]);
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    for (auto ignore : { true, false }) {
+        opt.ignore_invalid = ignore;
+        opt.num_threads = 3;
+        auto means = scran_norm::center_size_factors_blocked_mean_sorted(6, offsets.data(), sorted_sf.data(), NULL, opt);
+        EXPECT_EQ(means, scran_norm::center_size_factors_blocked_mean(n, sorted_sf.data(), sorted_block.data(), NULL, opt));
+    }
+
+    // Infinite values are not converted to NaNs by the compensation.
+    auto infcopy = sim;
+    infcopy[10] = std::numeric_limits<double>::infinity();
+    opt.ignore_invalid = false;
+    EXPECT_TRUE(std::isinf(scran_norm::center_size_factors_mean(n, infcopy.data(), NULL, opt)));
+    auto infmeans = scran_norm::center_size_factors_blocked_mean(n, infcopy.data(), block.data(), NULL, opt);
+    EXPECT_TRUE(std::isinf(infmeans[block[10]]));
+}
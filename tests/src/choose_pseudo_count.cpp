@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
 
 #include "scran_norm/choose_pseudo_count.hpp"
 
@@ -84,3 +85,259 @@ TEST(ChoosePseudoCount, EdgeCases) {
     auto out2 = scran_norm::choose_pseudo_count(2, contents.data() + 1, opt);
     EXPECT_EQ(out, out2);
 }
+
+TEST(ChoosePseudoCount, QuantilePair) {
+    auto contents = scran_tests::simulate_vector(1001, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 5;
+        sparams.seed = 777;
+        return sparams;
+    }());
+
+    for (double q : { 0.01, 0.05, 0.2, 0.5 }) {
+        auto copy1 = contents;
+        auto lower = scran_norm::internal::find_quantile(q, copy1.size(), copy1.data());
+        auto copy2 = contents;
+        auto upper = scran_norm::internal::find_quantile(1 - q, copy2.size(), copy2.data());
+
+        auto copy3 = contents;
+        auto pair = scran_norm::internal::find_quantile_pair(q, 1 - q, copy3.size(), copy3.data());
+        EXPECT_EQ(pair.first, lower);
+        EXPECT_EQ(pair.second, upper);
+
+        // Works in the other order.
+        auto copy4 = contents;
+        auto rpair = scran_norm::internal::find_quantile_pair(1 - q, q, copy4.size(), copy4.data());
+        EXPECT_EQ(rpair.first, upper);
+        EXPECT_EQ(rpair.second, lower);
+    }
+}
+
+TEST(ChoosePseudoCount, Approximate) {
+    size_t n = 10000;
+    auto contents = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.05;
+        sparams.upper = 5;
+        sparams.seed = 888;
+        return sparams;
+    }());
+    contents[0] = 0; // adding some invalid values.
+    contents[1] = -1;
+
+    scran_norm::internal::SizeFactorHistogram hist(0.01);
+    for (auto c : contents) {
+        if (c > 0) {
+            hist.add(c);
+        }
+    }
+    EXPECT_EQ(hist.size(), n - 2);
+
+    for (double q : { 0.01, 0.05, 0.5, 0.95 }) {
+        auto copy = contents;
+        auto exact = scran_norm::internal::find_quantile(q, n - 2, copy.data() + 2);
+        auto approx = hist.quantile(q);
+        EXPECT_LE(std::abs(approx - exact) / exact, 0.01);
+    }
+
+    scran_norm::ChoosePseudoCountOptions opt;
+    opt.min_value = 0;
+    auto exact = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+    opt.approximate = true;
+    auto approx = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+    EXPECT_NE(exact, approx);
+    EXPECT_LT(std::abs(approx - exact) / exact, 0.05);
+
+    // Raw version doesn't modify the input.
+    auto copy = contents;
+    EXPECT_EQ(scran_norm::choose_pseudo_count_raw(n, copy.data(), opt), approx);
+    EXPECT_EQ(copy, contents);
+
+    // Same results for the minimum and maximum.
+    opt.quantile = 0;
+    auto mm_approx = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+    opt.approximate = false;
+    auto mm_exact = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+    EXPECT_EQ(mm_approx, mm_exact);
+}
+
+TEST(ChoosePseudoCount, Float) {
+    std::vector<float> contents { 0.5, 1, 1.5, 2, 0 };
+    scran_norm::ChoosePseudoCountOptions opt;
+    opt.min_value = 0;
+    std::vector<double> dcontents(contents.begin(), contents.end());
+    scran_tests::compare_almost_equal(
+        static_cast<double>(scran_norm::choose_pseudo_count(contents.size(), contents.data(), opt)),
+        scran_norm::choose_pseudo_count(dcontents.size(), dcontents.data(), opt),
+        1e-6
+    );
+}
+
+TEST(ChoosePseudoCount, Streaming) {
+    size_t n = 5000;
+    auto contents = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.05;
+        sparams.upper = 5;
+        sparams.seed = 999;
+        return sparams;
+    }());
+    contents[5] = 0;
+
+    scran_norm::ChoosePseudoCountOptions opt;
+    opt.min_value = 0;
+    opt.approximate = true;
+    auto ref = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+
+    scran_norm::PseudoCountChooser<double> chooser(opt);
+    size_t chunk = 123;
+    for (size_t i = 0; i < n; i += chunk) {
+        chooser.add(std::min(chunk, n - i), contents.data() + i);
+    }
+    EXPECT_EQ(chooser.finalize(), ref);
+
+    // Exact for the minimum and maximum.
+    opt.quantile = 0;
+    opt.approximate = false;
+    auto mmref = scran_norm::choose_pseudo_count(n, contents.data(), opt);
+    scran_norm::PseudoCountChooser<double> mmchooser(opt);
+    mmchooser.add(1000, contents.data());
+    mmchooser.add(n - 1000, contents.data() + 1000);
+    EXPECT_EQ(mmchooser.finalize(), mmref);
+
+    // Falls back to the minimum for an empty chooser.
+    scran_norm::PseudoCountChooser<double> empty(opt);
+    EXPECT_EQ(empty.finalize(), 0);
+}
+
+TEST(ChoosePseudoCount, Blocked) {
+    size_t n = 1000;
+    auto contents = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 5;
+        sparams.seed = 1111;
+        return sparams;
+    }());
+    contents[3] = 0;
+
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 13) % 5;
+    }
+    block[n - 1] = 6; // block 5 is empty, block 6 has one cell.
+
+    scran_norm::ChoosePseudoCountOptions opt;
+    opt.min_value = 0.01;
+    for (bool approx : { false, true }) {
+        opt.approximate = approx;
+        auto output = scran_norm::choose_pseudo_count_blocked(n, contents.data(), block.data(), opt);
+        ASSERT_EQ(output.size(), 7);
+
+        for (int b = 0; b < 5; ++b) {
+            std::vector<double> subset;
+            for (size_t i = 0; i < n; ++i) {
+                if (block[i] == b) {
+                    subset.push_back(contents[i]);
+                }
+            }
+            EXPECT_EQ(output[b], scran_norm::choose_pseudo_count(subset.size(), subset.data(), opt));
+        }
+
+        EXPECT_EQ(output[5], opt.min_value);
+        EXPECT_EQ(output[6], opt.min_value);
+    }
+}
+
+TEST(ChoosePseudoCount, Merged) {
+    size_t n = 5000;
+    auto contents = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.05;
+        sparams.upper = 5;
+        sparams.seed = 888;
+        return sparams;
+    }());
+
+    for (double quantile : { 0.05, 0.0 }) {
+        scran_norm::ChoosePseudoCountOptions opt;
+        opt.min_value = 0;
+        opt.quantile = quantile;
+        scran_norm::PseudoCountChooser<double> ref(opt);
+        ref.add(n, contents.data());
+
+        // Each shard is serialized and merged in a different order.
+        std::vector<std::vector<unsigned char> > serialized;
+        for (size_t start : { 0, 1234, 3000 }) {
+            size_t end = (start == 3000 ? n : (start == 0 ? 1234 : 3000));
+            scran_norm::PseudoCountChooser<double> shard(opt);
+            shard.add(end - start, contents.data() + start);
+            serialized.push_back(shard.serialize());
+        }
+
+        scran_norm::PseudoCountChooser<double> merged(opt);
+        for (size_t s : { 2, 0, 1 }) {
+            scran_norm::PseudoCountChooser<double> shard(opt);
+            shard.deserialize(serialized[s].data(), serialized[s].size());
+            merged.merge(shard);
+        }
+        EXPECT_EQ(merged.finalize(), ref.finalize());
+        EXPECT_EQ(merged.serialize(), ref.serialize());
+    }
+
+    // Catches errors in the serialized data.
+    scran_norm::ChoosePseudoCountOptions opt;
+    scran_norm::PseudoCountChooser<double> chooser(opt);
+    chooser.add(n, contents.data());
+    auto serialized = chooser.serialize();
+    scran_tests::expect_error([&]() {
+        chooser.deserialize(serialized.data(), serialized.size() - 1);
+    }, "truncated");
+    scran_norm::PseudoCountChooser<float> fchooser(opt);
+    scran_tests::expect_error([&]() {
+        fchooser.deserialize(serialized.data(), serialized.size());
+    }, "expected type");
+
+    // Catches differences in the options.
+    for (int setting = 0; setting < 5; ++setting) {
+        auto other_opt = opt;
+        if (setting == 0) {
+            other_opt.quantile = 0.1;
+        } else if (setting == 1) {
+            other_opt.max_bias = 0.5;
+        } else if (setting == 2) {
+            other_opt.min_value = 2;
+        } else if (setting == 3) {
+            other_opt.approximate = !opt.approximate;
+        } else {
+            other_opt.approximate_error = 0.05;
+        }
+
+        scran_norm::PseudoCountChooser<double> other(other_opt);
+        other.add(n, contents.data());
+        scran_tests::expect_error([&]() {
+            chooser.merge(other);
+        }, "same options");
+        scran_tests::expect_error([&]() {
+            other.deserialize(serialized.data(), serialized.size());
+        }, "different options");
+    }
+}
+
+TEST(ChoosePseudoCount, Workspace) {
+    scran_norm::ChoosePseudoCountOptions opt;
+    scran_norm::ChoosePseudoCountWorkspace<double> work;
+    for (int it = 0; it < 5; ++it) {
+        auto contents = scran_tests::simulate_vector(100 - it * 10, [&]{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.05;
+            sparams.upper = 5;
+            sparams.seed = 200 + it;
+            return sparams;
+        }());
+        contents[0] = 0;
+        auto ref = scran_norm::choose_pseudo_count(contents.size(), contents.data(), opt);
+        EXPECT_EQ(scran_norm::choose_pseudo_count(contents.size(), contents.data(), work, opt), ref);
+    }
+}
@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+#include <memory>
+
+#include "scran_tests/scran_tests.hpp"
+
+#include "scran_norm/compute_size_factors.hpp"
+
+class ComputeSizeFactorsTest : public ::testing::Test {
+protected:
+    inline static std::vector<std::shared_ptr<tatami::Matrix<double, int> > > matrices;
+    inline static std::vector<double> simulated;
+    inline static int nr = 71, nc = 43;
+
+    static void SetUpTestSuite() {
+        simulated = scran_tests::simulate_vector(nr * nc, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 999;
+            return sparams;
+        }());
+
+        // Forcing an all-zero column.
+        for (int r = 0; r < nr; ++r) {
+            simulated[r * nc + 5] = 0;
+        }
+
+        auto dense_row = std::make_shared<tatami::DenseRowMatrix<double, int> >(nr, nc, simulated);
+        matrices.push_back(dense_row);
+        auto dense_column = tatami::convert_to_dense(dense_row.get(), false);
+        matrices.push_back(dense_column);
+        matrices.push_back(tatami::convert_to_compressed_sparse(dense_row.get(), true));
+        matrices.push_back(tatami::convert_to_compressed_sparse(dense_row.get(), false));
+    }
+
+    static std::vector<double> reference(const std::vector<char>& subset) {
+        std::vector<double> output(nc);
+        for (int r = 0; r < nr; ++r) {
+            if (!subset.empty() && !subset[r]) {
+                continue;
+            }
+            for (int c = 0; c < nc; ++c) {
+                output[c] += simulated[r * nc + c];
+            }
+        }
+        return output;
+    }
+};
+
+TEST_F(ComputeSizeFactorsTest, LibrarySizes) {
+    auto ref = reference({});
+    std::vector<char> subset(nr);
+    for (int r = 0; r < nr; r += 3) {
+        subset[r] = 1;
+    }
+    auto sub_ref = reference(subset);
+
+    for (const auto& mat : matrices) {
+        for (int threads : { 1, 3 }) {
+            std::vector<double> output(nc);
+            scran_norm::compute_library_sizes(*mat, output.data(), threads);
+            scran_tests::compare_almost_equal(ref, output);
+
+            scran_norm::compute_library_sizes(*mat, subset.data(), output.data(), threads);
+            scran_tests::compare_almost_equal(sub_ref, output);
+        }
+    }
+}
+
+TEST_F(ComputeSizeFactorsTest, Centered) {
+    auto ref = reference({});
+
+    for (const auto& mat : matrices) {
+        scran_norm::ComputeSizeFactorsOptions opt;
+        opt.num_threads = 2;
+        auto res = scran_norm::compute_size_factors(*mat, opt);
+
+        auto expected = ref;
+        scran_norm::SizeFactorDiagnostics diag;
+        auto mean = scran_norm::center_size_factors(expected.size(), expected.data(), &diag, opt.center_options);
+        scran_tests::compare_almost_equal(expected, res.size_factors);
+        scran_tests::compare_almost_equal(mean, res.mean);
+        EXPECT_TRUE(res.diagnostics.has_zero);
+        EXPECT_FALSE(res.diagnostics.has_negative);
+
+        // Diagnostics are still reported without centering.
+        opt.center = false;
+        auto raw = scran_norm::compute_size_factors(*mat, opt);
+        scran_tests::compare_almost_equal(ref, raw.size_factors);
+        EXPECT_EQ(raw.mean, 1);
+        EXPECT_TRUE(raw.diagnostics.has_zero);
+
+        // Same as an explicit NULL subset.
+        auto nullsub = scran_norm::compute_size_factors(*mat, static_cast<const char*>(NULL), opt);
+        EXPECT_EQ(nullsub.size_factors, raw.size_factors);
+    }
+}
+
+TEST_F(ComputeSizeFactorsTest, Blocked) {
+    auto ref = reference({});
+    std::vector<int> block(nc);
+    for (int c = 0; c < nc; ++c) {
+        block[c] = c % 3;
+    }
+
+    for (const auto& mat : matrices) {
+        scran_norm::ComputeSizeFactorsOptions opt;
+        opt.num_threads = 3;
+        opt.center_options.block_mode = scran_norm::CenterBlockMode::PER_BLOCK;
+        auto res = scran_norm::compute_size_factors_blocked(*mat, block.data(), opt);
+
+        auto expected = ref;
+        auto means = scran_norm::center_size_factors_blocked(expected.size(), expected.data(), block.data(), NULL, opt.center_options);
+        scran_tests::compare_almost_equal(expected, res.size_factors);
+        scran_tests::compare_almost_equal(means, res.block_means);
+        EXPECT_TRUE(res.diagnostics.has_zero);
+
+        auto nullsub = scran_norm::compute_size_factors_blocked(*mat, static_cast<const char*>(NULL), block.data(), opt);
+        EXPECT_EQ(nullsub.size_factors, res.size_factors);
+        EXPECT_EQ(nullsub.block_means, res.block_means);
+    }
+}
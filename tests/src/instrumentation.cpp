@@ -0,0 +1,108 @@
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <mutex>
+
+// Declaring the hook before including any scran_norm headers.
+namespace scran_norm {
+struct InstrumentationRecord;
+}
+void record_instrumentation(const scran_norm::InstrumentationRecord&);
+
+#define SCRAN_NORM_CUSTOM_INSTRUMENTATION record_instrumentation
+#include "scran_norm/scran_norm.hpp"
+
+namespace {
+
+std::mutex records_lock;
+std::vector<scran_norm::InstrumentationRecord> records;
+
+size_t total_count(scran_norm::InstrumentationEvent event) {
+    size_t total = 0;
+    for (const auto& rec : records) {
+        if (rec.event == event) {
+            total += rec.count;
+        }
+    }
+    return total;
+}
+
+}
+
+void record_instrumentation(const scran_norm::InstrumentationRecord& rec) {
+    std::lock_guard<std::mutex> lck(records_lock);
+    records.push_back(rec);
+}
+
+TEST(Instrumentation, SizeFactors) {
+    records.clear();
+    std::vector<double> sf { 0.5, 1, 0, 2, 3 };
+
+    scran_norm::CenterSizeFactorsOptions copt;
+    scran_norm::SizeFactorDiagnostics diag;
+    scran_norm::center_size_factors(sf.size(), sf.data(), &diag, copt);
+    EXPECT_EQ(total_count(scran_norm::InstrumentationEvent::CENTER_SIZE_FACTORS_MEAN), sf.size());
+    EXPECT_EQ(total_count(scran_norm::InstrumentationEvent::CENTER_SIZE_FACTORS), sf.size());
+
+    scran_norm::choose_pseudo_count(sf.size(), sf.data(), scran_norm::ChoosePseudoCountOptions());
+    EXPECT_EQ(total_count(scran_norm::InstrumentationEvent::CHOOSE_PSEUDO_COUNT), sf.size());
+
+    scran_norm::SanitizeSizeFactorsOptions sopt;
+    sopt.handle_zero = scran_norm::SanitizeAction::SANITIZE;
+    scran_norm::sanitize_size_factors(sf.size(), sf.data(), sopt);
+    EXPECT_EQ(total_count(scran_norm::InstrumentationEvent::SANITIZE_SIZE_FACTORS), sf.size());
+
+    for (const auto& rec : records) {
+        EXPECT_FALSE(rec.row);
+        EXPECT_GE(rec.elapsed, 0);
+    }
+}
+
+TEST(Instrumentation, Normalization) {
+    // Calling the operation directly, as the routing of extraction calls depends on tatami.
+    std::vector<double> sf { 1.5, 2, 0.5, 1, 3 };
+    scran_norm::NormalizeCountsOptions opt;
+    opt.lookup_table_size = 5;
+    scran_norm::DelayedLogNormalize<double, int, std::vector<double> > op(sf, opt);
+
+    records.clear();
+    std::vector<int> input { 0, 3, 7, 1, 10 };
+    std::vector<double> output(input.size());
+    op.dense(true, 0, 0, static_cast<int>(input.size()), input.data(), output.data());
+    op.dense(false, 2, std::vector<int>{ 1, 2, 3 }, input.data(), output.data());
+
+    ASSERT_EQ(records.size(), 4);
+    EXPECT_EQ(records[0].event, scran_norm::InstrumentationEvent::NORMALIZE_LOOKUP_MISS);
+    EXPECT_EQ(records[0].count, 2);
+    EXPECT_TRUE(records[0].row);
+    EXPECT_EQ(records[1].event, scran_norm::InstrumentationEvent::NORMALIZE_DENSE);
+    EXPECT_EQ(records[1].count, input.size());
+    EXPECT_TRUE(records[1].row);
+    EXPECT_EQ(records[2].count, 1); // only the first three inputs are used.
+    EXPECT_EQ(records[3].event, scran_norm::InstrumentationEvent::NORMALIZE_DENSE);
+    EXPECT_EQ(records[3].count, 3);
+    EXPECT_FALSE(records[3].row);
+
+    records.clear();
+    std::vector<int> index { 0, 1, 2, 3, 4 };
+    op.sparse(false, 1, 4, input.data() + 1, index.data(), output.data());
+    ASSERT_EQ(records.size(), 2);
+    EXPECT_EQ(records[0].count, 2);
+    EXPECT_EQ(records[1].event, scran_norm::InstrumentationEvent::NORMALIZE_SPARSE);
+    EXPECT_EQ(records[1].count, 4);
+    EXPECT_FALSE(records[1].row);
+
+    // Results are unaffected by the instrumentation.
+    auto ref = scran_norm::normalize_counts(
+        std::shared_ptr<const tatami::Matrix<int, int> >(new tatami::DenseRowMatrix<int, int>(1, 5, input)),
+        sf,
+        opt
+    );
+    auto ext = ref->dense_row();
+    std::vector<double> buffer(5);
+    auto ptr = ext->fetch(0, buffer.data());
+    op.dense(true, 0, 0, 5, input.data(), output.data());
+    for (int c = 0; c < 5; ++c) {
+        EXPECT_EQ(ptr[c], output[c]);
+    }
+}
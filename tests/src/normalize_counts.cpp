@@ -2,8 +2,10 @@
 
 #include <cmath>
 #include <vector>
+#include <limits>
 
 #include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
 
 #include "scran_norm/normalize_counts.hpp"
 
@@ -134,3 +136,556 @@ TEST_F(NormalizeCountsTest, NewType) {
 
     scran_tests::compare_almost_equal(expected, buffer);
 }
+
+TEST_F(NormalizeCountsTest, AccessPatterns) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = 3;
+    auto lmat = scran_norm::normalize_counts(mat, size_factors, opt);
+    opt.preserve_sparsity = true;
+    auto smat = scran_norm::normalize_counts(mat, size_factors, opt);
+
+    int NR = mat->nrow(), NC = mat->ncol();
+    std::vector<std::vector<double> > raw;
+    for (int r = 0; r < NR; ++r) {
+        raw.push_back(extract(mat.get(), r));
+    }
+
+    auto ref = [&](int r, int c, bool sparse) -> double {
+        double val = raw[r][c];
+        if (sparse) {
+            return std::log1p(val / (size_factors[c] * 3)) / std::log(2.0);
+        } else {
+            return std::log(val / size_factors[c] + 3) / std::log(2.0);
+        }
+    };
+
+    // Column access.
+    {
+        auto lext = lmat->dense_column();
+        auto sext = smat->dense_column();
+        std::vector<double> buffer(NR);
+        for (int c = 0; c < NC; ++c) {
+            auto lptr = lext->fetch(c, buffer.data());
+            for (int r = 0; r < NR; ++r) {
+                scran_tests::compare_almost_equal(lptr[r], ref(r, c, false));
+            }
+            auto sptr = sext->fetch(c, buffer.data());
+            for (int r = 0; r < NR; ++r) {
+                scran_tests::compare_almost_equal(sptr[r], ref(r, c, true));
+            }
+        }
+    }
+
+    // Block and indexed row access.
+    {
+        int start = 10, length = 50;
+        auto bext = lmat->dense_row(start, length);
+        std::vector<int> indices { 1, 5, 17, 33, 60, 100 };
+        auto iext = smat->dense_row(indices);
+        std::vector<double> buffer(NC);
+        for (int r = 0; r < NR; r += 7) {
+            auto bptr = bext->fetch(r, buffer.data());
+            for (int c = 0; c < length; ++c) {
+                scran_tests::compare_almost_equal(bptr[c], ref(r, c + start, false));
+            }
+            auto iptr = iext->fetch(r, buffer.data());
+            for (size_t i = 0; i < indices.size(); ++i) {
+                scran_tests::compare_almost_equal(iptr[i], ref(r, indices[i], true));
+            }
+        }
+    }
+
+    // Sparse access.
+    {
+        EXPECT_TRUE(smat->is_sparse());
+        auto ext = smat->sparse_row();
+        std::vector<double> vbuffer(NC);
+        std::vector<int> ibuffer(NC);
+        for (int r = 0; r < NR; ++r) {
+            auto range = ext->fetch(r, vbuffer.data(), ibuffer.data());
+            for (int i = 0; i < range.number; ++i) {
+                scran_tests::compare_almost_equal(range.value[i], ref(r, range.index[i], true));
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsTest, LookupTable) {
+    size_t nr = 20;
+    size_t nc = size_factors.size();
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = 1;
+        sparams.upper = 20;
+        sparams.seed = 1234;
+        return sparams;
+    }());
+
+    std::vector<int> ivec(vec.begin(), vec.end());
+    tatami::DenseRowMatrix<int, int> idense(nr, nc, std::move(ivec));
+    std::shared_ptr<tatami::Matrix<int, int> > imat = tatami::convert_to_compressed_sparse(&idense, false);
+
+    auto compare = [&](const tatami::Matrix<double, int>* ref, const tatami::Matrix<double, int>* obs) -> void {
+        EXPECT_EQ(ref->is_sparse(), obs->is_sparse());
+        for (size_t r = 0; r < nr; ++r) {
+            EXPECT_EQ(extract(ref, r), extract(obs, r));
+        }
+
+        auto rext = ref->dense_column();
+        auto oext = obs->dense_column();
+        std::vector<double> rbuffer(nr), obuffer(nr);
+        for (size_t c = 0; c < nc; ++c) {
+            auto rptr = rext->fetch(c, rbuffer.data());
+            auto optr = oext->fetch(c, obuffer.data());
+            EXPECT_EQ(std::vector<double>(rptr, rptr + nr), std::vector<double>(optr, optr + nr));
+        }
+
+        tatami::Options opt;
+        auto rsext = ref->sparse(true, opt);
+        auto osext = obs->sparse(true, opt);
+        std::vector<int> ribuffer(nc), oibuffer(nc);
+        rbuffer.resize(nc);
+        obuffer.resize(nc);
+        for (size_t r = 0; r < nr; ++r) {
+            auto rrange = rsext->fetch(r, rbuffer.data(), ribuffer.data());
+            auto orange = osext->fetch(r, obuffer.data(), oibuffer.data());
+            ASSERT_EQ(rrange.number, orange.number);
+            EXPECT_EQ(std::vector<double>(rrange.value, rrange.value + rrange.number), std::vector<double>(orange.value, orange.value + orange.number));
+        }
+    };
+
+    for (auto pseudo : { 1.0, 2.5 }) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.pseudo_count = pseudo;
+        auto ref = scran_norm::normalize_counts(imat, size_factors, opt);
+        opt.lookup_table_size = 8; // using a small table so that some counts are computed directly.
+        auto obs = scran_norm::normalize_counts(imat, size_factors, opt);
+        compare(ref.get(), obs.get());
+
+        opt.preserve_sparsity = true;
+        opt.lookup_table_size = 0;
+        ref = scran_norm::normalize_counts(imat, size_factors, opt);
+        opt.lookup_table_size = 8;
+        obs = scran_norm::normalize_counts(imat, size_factors, opt);
+        compare(ref.get(), obs.get());
+    }
+}
+
+TEST_F(NormalizeCountsTest, Float) {
+    scran_norm::NormalizeCountsOptions opt;
+    for (double pc : { 1.0, 2.5 }) {
+        opt.pseudo_count = pc;
+        auto dmat = scran_norm::normalize_counts(mat, size_factors, opt);
+        auto fmat = scran_norm::normalize_counts<float>(mat, size_factors, opt);
+        EXPECT_EQ(fmat->is_sparse(), dmat->is_sparse());
+
+        for (int r = 0; r < mat->nrow(); r += 7) {
+            auto dvals = extract(dmat.get(), r);
+            auto fvals = extract(fmat.get(), r);
+            for (int c = 0; c < mat->ncol(); ++c) {
+                EXPECT_NEAR(fvals[c], dvals[c], 1e-5 * std::max(1.0, std::abs(dvals[c])));
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsTest, PerCellPseudoCount) {
+    auto pseudo_counts = scran_tests::simulate_vector(size_factors.size(), []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.5;
+        sparams.upper = 5;
+        sparams.seed = 1000;
+        return sparams;
+    }());
+
+    scran_norm::NormalizeCountsOptions opt;
+    auto lmat = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+    EXPECT_FALSE(lmat->is_sparse());
+
+    for (int r = 0; r < mat->nrow(); r += 3) {
+        auto buffer = extract(lmat.get(), r);
+        auto expected = extract(mat.get(), r);
+        for (int c = 0; c < mat->ncol(); ++c) {
+            expected[c] = std::log(expected[c]/size_factors[c] + pseudo_counts[c]) / std::log(2.0);
+        }
+        scran_tests::compare_almost_equal(expected, buffer);
+    }
+
+    // Preserving sparsity.
+    opt.preserve_sparsity = true;
+    auto smat = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+    EXPECT_TRUE(smat->is_sparse());
+    for (int r = 0; r < mat->nrow(); r += 3) {
+        auto buffer = extract(smat.get(), r);
+        auto expected = extract(mat.get(), r);
+        for (int c = 0; c < mat->ncol(); ++c) {
+            expected[c] = std::log1p(expected[c]/(size_factors[c] * pseudo_counts[c])) / std::log(2.0);
+        }
+        scran_tests::compare_almost_equal(expected, buffer);
+    }
+
+    // Unity pseudo-counts are the same as the scalar version.
+    opt.preserve_sparsity = false;
+    std::vector<double> ones(size_factors.size(), 1);
+    auto umat = scran_norm::normalize_counts(mat, size_factors, ones, opt);
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    EXPECT_TRUE(umat->is_sparse());
+    EXPECT_EQ(extract(umat.get(), 5), extract(ref.get(), 5));
+
+    scran_tests::expect_error([&]() {
+        scran_norm::normalize_counts(mat, size_factors, std::vector<double>(1), opt);
+    }, "length");
+}
+
+TEST_F(NormalizeCountsTest, Blocked) {
+    std::vector<int> block(size_factors.size());
+    for (size_t c = 0; c < block.size(); ++c) {
+        block[c] = c % 3;
+    }
+    std::vector<double> block_pseudo { 1.5, 2, 3 };
+
+    scran_norm::NormalizeCountsOptions opt;
+    auto bmat = scran_norm::normalize_counts_blocked(mat, size_factors, block.data(), block_pseudo, opt);
+
+    std::vector<double> pseudo_counts;
+    for (auto b : block) {
+        pseudo_counts.push_back(block_pseudo[b]);
+    }
+    auto ref = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+    for (int r = 0; r < mat->nrow(); r += 7) {
+        EXPECT_EQ(extract(bmat.get(), r), extract(ref.get(), r));
+    }
+}
+
+TEST_F(NormalizeCountsTest, SizeFactorViews) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = 3;
+    opt.preserve_sparsity = true;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+
+    // Views are not modified when the pseudo-count is folded into the size factors.
+    auto copy = size_factors;
+    auto vmat = scran_norm::normalize_counts(mat, tatami::ArrayView<double>(copy.data(), copy.size()), opt);
+    EXPECT_TRUE(vmat->is_sparse());
+    EXPECT_EQ(copy, size_factors);
+
+    auto shared = std::make_shared<const std::vector<double> >(size_factors);
+    auto smat = scran_norm::normalize_counts(mat, shared, opt);
+    EXPECT_TRUE(smat->is_sparse());
+    EXPECT_EQ(*shared, size_factors);
+
+    for (int r = 0; r < mat->nrow(); r += 7) {
+        auto expected = extract(ref.get(), r);
+        EXPECT_EQ(expected, extract(vmat.get(), r));
+        EXPECT_EQ(expected, extract(smat.get(), r));
+    }
+
+    // Same for per-cell pseudo-counts.
+    std::vector<double> pseudo_counts(size_factors.size());
+    for (size_t c = 0; c < pseudo_counts.size(); ++c) {
+        pseudo_counts[c] = 1 + c % 4;
+    }
+    auto pref = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+    auto pmat = scran_norm::normalize_counts(mat, tatami::ArrayView<double>(copy.data(), copy.size()), pseudo_counts, opt);
+    EXPECT_EQ(copy, size_factors);
+    for (int r = 0; r < mat->nrow(); r += 7) {
+        EXPECT_EQ(extract(pref.get(), r), extract(pmat.get(), r));
+    }
+}
+
+TEST_F(NormalizeCountsTest, SizeFactorScale) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.size_factor_scale = 2;
+    auto smat = scran_norm::normalize_counts(mat, size_factors, opt);
+
+    auto scaled = size_factors;
+    for (auto& s : scaled) {
+        s *= 2;
+    }
+    opt.size_factor_scale = 1;
+    auto ref = scran_norm::normalize_counts(mat, scaled, opt);
+    for (int r = 0; r < mat->nrow(); r += 7) {
+        scran_tests::compare_almost_equal(extract(ref.get(), r), extract(smat.get(), r));
+    }
+
+    // Works with the pseudo-count folding.
+    opt.pseudo_count = 3;
+    opt.preserve_sparsity = true;
+    ref = scran_norm::normalize_counts(mat, scaled, opt);
+    opt.size_factor_scale = 2;
+    smat = scran_norm::normalize_counts(mat, size_factors, opt);
+    for (int r = 0; r < mat->nrow(); r += 7) {
+        scran_tests::compare_almost_equal(extract(ref.get(), r), extract(smat.get(), r));
+    }
+}
+
+TEST_F(NormalizeCountsTest, SpecializedBases) {
+    for (auto base : { 2.0, std::exp(1.0), 10.0 }) {
+        for (auto pseudo : { 1.0, 2.5 }) {
+            scran_norm::NormalizeCountsOptions opt;
+            opt.log_base = base;
+            opt.pseudo_count = pseudo;
+            auto lmat = scran_norm::normalize_counts(mat, size_factors, opt);
+
+            for (int r = 0; r < mat->nrow(); r += 11) {
+                auto buffer = extract(lmat.get(), r);
+                auto expected = extract(mat.get(), r);
+                for (int c = 0; c < mat->ncol(); ++c) {
+                    expected[c] = std::log(expected[c]/size_factors[c] + pseudo) / std::log(base);
+                }
+                scran_tests::compare_almost_equal(expected, buffer);
+            }
+
+            // Fill values are consistent with the explicit transformation of zeros.
+            auto ext = lmat->dense_column();
+            auto dext = mat->dense_column();
+            std::vector<double> buffer(mat->nrow()), dbuffer(mat->nrow());
+            auto ptr = ext->fetch(0, buffer.data());
+            auto dptr = dext->fetch(0, dbuffer.data());
+            for (int r = 0; r < mat->nrow(); ++r) {
+                if (dptr[r] == 0) {
+                    scran_tests::compare_almost_equal(ptr[r], std::log(pseudo) / std::log(base));
+                }
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsTest, ShiftedLogOffsets) {
+    // Using a dense matrix so that the zeros are also explicitly transformed.
+    auto dense = tatami::convert_to_dense(mat.get(), false);
+    int NR = mat->nrow(), NC = mat->ncol();
+
+    for (auto base : { 2.0, std::exp(1.0), 10.0 }) {
+        for (auto pseudo : { 0.5, 2.5 }) {
+            scran_norm::NormalizeCountsOptions opt;
+            opt.log_base = base;
+            opt.pseudo_count = pseudo;
+            opt.size_factor_scale = 1.5;
+            auto dmat = scran_norm::normalize_counts(dense, size_factors, opt);
+            auto smat = scran_norm::normalize_counts(mat, size_factors, opt);
+
+            // Comparing to the direct calculation with the division.
+            auto ext = dmat->dense_column();
+            auto rext = dense->dense_column();
+            std::vector<double> buffer(NR), rbuffer(NR);
+            for (int c = 0; c < NC; ++c) {
+                auto ptr = ext->fetch(c, buffer.data());
+                auto rptr = rext->fetch(c, rbuffer.data());
+                for (int r = 0; r < NR; ++r) {
+                    scran_tests::compare_almost_equal(ptr[r], std::log(rptr[r] / (size_factors[c] * 1.5) + pseudo) / std::log(base));
+                }
+            }
+
+            // Row and column access give the same results, and explicit zeros are equal to the fill value for sparse inputs.
+            auto dcol = dmat->dense_column();
+            auto scol = smat->dense_column();
+            std::vector<double> dbuffer(NR), sbuffer(NR);
+            std::vector<std::vector<double> > by_column;
+            for (int c = 0; c < NC; ++c) {
+                auto dptr = dcol->fetch(c, dbuffer.data());
+                auto sptr = scol->fetch(c, sbuffer.data());
+                by_column.emplace_back(dptr, dptr + NR);
+                EXPECT_EQ(by_column.back(), std::vector<double>(sptr, sptr + NR));
+            }
+
+            for (int r = 0; r < NR; ++r) {
+                auto drow = extract(dmat.get(), r);
+                EXPECT_EQ(drow, extract(smat.get(), r));
+                for (int c = 0; c < NC; ++c) {
+                    EXPECT_EQ(drow[c], by_column[c][r]);
+                }
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsTest, Reciprocals) {
+    int NR = mat->nrow(), NC = mat->ncol();
+    std::vector<double> pseudo_counts(size_factors.size());
+    for (size_t c = 0; c < pseudo_counts.size(); ++c) {
+        pseudo_counts[c] = 1 + c % 3;
+    }
+
+    auto compare = [&](const tatami::Matrix<double, int>* ref, const tatami::Matrix<double, int>* obs) -> void {
+        EXPECT_EQ(ref->is_sparse(), obs->is_sparse());
+
+        auto ext = obs->dense_column();
+        std::vector<double> buffer(NR);
+        std::vector<std::vector<double> > by_column;
+        for (int c = 0; c < NC; ++c) {
+            auto ptr = ext->fetch(c, buffer.data());
+            by_column.emplace_back(ptr, ptr + NR);
+        }
+
+        for (int r = 0; r < NR; ++r) {
+            auto obs_row = extract(obs, r);
+            scran_tests::compare_almost_equal(extract(ref, r), obs_row);
+            for (int c = 0; c < NC; ++c) {
+                EXPECT_EQ(obs_row[c], by_column[c][r]);
+            }
+        }
+    };
+
+    for (int setting = 0; setting < 4; ++setting) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.log = (setting != 0);
+        if (setting >= 2) {
+            opt.pseudo_count = 3;
+            opt.preserve_sparsity = true;
+        }
+        opt.size_factor_scale = 0.5;
+
+        std::shared_ptr<tatami::Matrix<double, int> > ref, obs;
+        if (setting == 3) {
+            ref = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+            opt.precompute_reciprocals = true;
+            obs = scran_norm::normalize_counts(mat, size_factors, pseudo_counts, opt);
+        } else {
+            ref = scran_norm::normalize_counts(mat, size_factors, opt);
+            opt.precompute_reciprocals = true;
+            obs = scran_norm::normalize_counts(mat, size_factors, opt);
+        }
+        compare(ref.get(), obs.get());
+    }
+
+    // Works with the lookup table.
+    std::vector<int> ivec(static_cast<size_t>(NR) * static_cast<size_t>(NC));
+    for (int r = 0; r < NR; ++r) {
+        auto row = extract(mat.get(), r);
+        std::copy(row.begin(), row.end(), ivec.begin() + static_cast<size_t>(r) * static_cast<size_t>(NC));
+    }
+    std::shared_ptr<tatami::Matrix<int, int> > imat(new tatami::DenseRowMatrix<int, int>(NR, NC, std::move(ivec)));
+
+    scran_norm::NormalizeCountsOptions opt;
+    opt.precompute_reciprocals = true;
+    auto ref = scran_norm::normalize_counts(imat, size_factors, opt);
+    opt.lookup_table_size = 4; // small table so that some counts are computed directly.
+    auto obs = scran_norm::normalize_counts(imat, size_factors, opt);
+    for (int r = 0; r < NR; ++r) {
+        EXPECT_EQ(extract(ref.get(), r), extract(obs.get(), r));
+    }
+}
+
+TEST_F(NormalizeCountsTest, ResolvedOptions) {
+    for (int setting = 0; setting < 4; ++setting) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.log = (setting != 0);
+        opt.size_factor_scale = 2;
+        opt.log_base = 10;
+        if (setting >= 2) {
+            opt.pseudo_count = 2.5;
+            opt.preserve_sparsity = (setting == 3);
+        }
+
+        auto resolved = scran_norm::resolve_normalize_counts_options(opt);
+        EXPECT_EQ(resolved.log, opt.log);
+        if (setting == 3) {
+            EXPECT_EQ(resolved.pseudo_count, 1);
+            EXPECT_EQ(resolved.size_factor_scale, 5);
+        }
+
+        // An independent implementation should give the same results.
+        auto lmat = scran_norm::normalize_counts(mat, size_factors, opt);
+        for (int r = 0; r < mat->nrow(); r += 13) {
+            auto expected = extract(mat.get(), r);
+            for (int c = 0; c < mat->ncol(); ++c) {
+                double y = expected[c] / (size_factors[c] * resolved.size_factor_scale);
+                if (resolved.log) {
+                    y = (resolved.pseudo_count == 1 ? std::log1p(y) : std::log(y + resolved.pseudo_count)) / resolved.log_of_base;
+                }
+                expected[c] = y;
+            }
+            scran_tests::compare_almost_equal(expected, extract(lmat.get(), r));
+        }
+    }
+}
+
+TEST_F(NormalizeCountsTest, ApproximateLog) {
+    // Checking the error bound of the approximation across a wide range of values.
+    for (double x = 1e-30; x < 1e30; x *= 1.0001) {
+        EXPECT_LT(std::abs(scran_norm::internal::approximate_log(x) - std::log(x)), 1e-5);
+        float fx = x;
+        EXPECT_LT(std::abs(scran_norm::internal::approximate_log(fx) - std::log(static_cast<double>(fx))), 1e-5);
+    }
+    EXPECT_EQ(scran_norm::internal::approximate_log(1.0), 0);
+    EXPECT_EQ(scran_norm::internal::approximate_log(1.0f), 0);
+
+    // Checking the relative error bound, particularly for values close to 1 and for small arguments to log1p.
+    for (double x = 0.5; x < 2; x += 1e-5) {
+        if (x != 1) {
+            EXPECT_LT(std::abs(scran_norm::internal::approximate_log(x) / std::log(x) - 1), 1e-5);
+        }
+    }
+    for (double x = 1e-30; x < 1e30; x *= 1.0001) {
+        EXPECT_LT(std::abs(scran_norm::internal::compute_log1p<true>(x) / std::log1p(x) - 1), 1e-5);
+        float fx = x;
+        EXPECT_LT(std::abs(scran_norm::internal::compute_log1p<true>(fx) / std::log1p(static_cast<double>(fx)) - 1), 1e-5);
+    }
+    EXPECT_EQ(scran_norm::internal::compute_log1p<true>(0.0), 0);
+    EXPECT_EQ(scran_norm::internal::compute_log1p<true>(1e-20), 1e-20);
+
+    // Special values are handled by the exact log.
+    for (double x : { 0.0, -1.0, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::denorm_min() }) {
+        auto expected = std::log(x);
+        auto observed = scran_norm::internal::approximate_log(x);
+        if (std::isnan(expected)) {
+            EXPECT_TRUE(std::isnan(observed));
+        } else {
+            EXPECT_EQ(observed, expected);
+        }
+
+        float fx = x;
+        auto fexpected = std::log(fx);
+        auto fobserved = scran_norm::internal::approximate_log(fx);
+        if (std::isnan(fexpected)) {
+            EXPECT_TRUE(std::isnan(fobserved));
+        } else {
+            EXPECT_EQ(fobserved, fexpected);
+        }
+    }
+    EXPECT_EQ(scran_norm::internal::compute_log1p<true>(std::numeric_limits<double>::infinity()), std::numeric_limits<double>::infinity());
+    EXPECT_EQ(scran_norm::internal::compute_log1p<true>(-1.0), -std::numeric_limits<double>::infinity());
+    EXPECT_TRUE(std::isnan(scran_norm::internal::compute_log1p<true>(std::numeric_limits<double>::quiet_NaN())));
+
+    for (auto base : { 2.0, 10.0 }) {
+        for (int setting = 0; setting < 3; ++setting) {
+            scran_norm::NormalizeCountsOptions opt;
+            opt.log_base = base;
+            if (setting > 0) {
+                opt.pseudo_count = 2.5;
+                opt.preserve_sparsity = (setting == 2);
+            }
+            auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+            opt.approximate_log = true;
+            auto obs = scran_norm::normalize_counts(mat, size_factors, opt);
+            EXPECT_EQ(ref->is_sparse(), obs->is_sparse());
+
+            double limit = 1e-5 / std::log(base);
+            for (int r = 0; r < mat->nrow(); ++r) {
+                auto rvals = extract(ref.get(), r);
+                auto ovals = extract(obs.get(), r);
+                for (int c = 0; c < mat->ncol(); ++c) {
+                    EXPECT_LT(std::abs(rvals[c] - ovals[c]), limit);
+                    if (setting != 1 && rvals[c] != 0) {
+                        // The output of log1p has a relative error bound.
+                        EXPECT_LT(std::abs(ovals[c] / rvals[c] - 1), 1e-5);
+                    }
+                    if (rvals[c] == 0) {
+                        EXPECT_EQ(ovals[c], 0);
+                    }
+                }
+            }
+
+            auto ext = obs->dense_column();
+            std::vector<double> buffer(mat->nrow());
+            for (int c = 0; c < mat->ncol(); c += 7) {
+                auto ptr = ext->fetch(c, buffer.data());
+                for (int r = 0; r < mat->nrow(); ++r) {
+                    EXPECT_EQ(ptr[r], obs->get(r, c));
+                }
+            }
+        }
+    }
+}
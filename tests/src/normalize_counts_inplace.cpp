@@ -0,0 +1,152 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <vector>
+
+#include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
+
+#include "scran_norm/normalize_counts_inplace.hpp"
+
+class NormalizeCountsInplaceTest : public ::testing::Test {
+protected:
+    inline static std::vector<double> size_factors;
+    inline static std::vector<double> dense_values;
+    inline static size_t nr = 41;
+
+    static void SetUpTestSuite() {
+        size_factors = scran_tests::simulate_vector(67, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 2;
+            sparams.seed = 1234;
+            return sparams;
+        }());
+
+        dense_values = scran_tests::simulate_vector(nr * size_factors.size(), []{
+            scran_tests::SimulationParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 5678;
+            return sparams;
+        }());
+    }
+
+    static std::vector<double> realize(const tatami::Matrix<double, int>* mat, bool row) {
+        int primary = (row ? mat->nrow() : mat->ncol());
+        int secondary = (row ? mat->ncol() : mat->nrow());
+        std::vector<double> output(static_cast<size_t>(primary) * static_cast<size_t>(secondary));
+        auto ext = mat->dense(row, tatami::Options());
+        for (int p = 0; p < primary; ++p) {
+            auto ptr = output.data() + static_cast<size_t>(p) * static_cast<size_t>(secondary);
+            auto out = ext->fetch(p, ptr);
+            tatami::copy_n(out, secondary, ptr);
+        }
+        return output;
+    }
+};
+
+TEST_F(NormalizeCountsInplaceTest, Dense) {
+    int nc = size_factors.size();
+    std::shared_ptr<tatami::Matrix<double, int> > mat(new tatami::DenseRowMatrix<double, int>(nr, nc, dense_values));
+
+    for (auto pseudo : { 1.0, 2.5 }) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.pseudo_count = pseudo;
+        auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+
+        for (auto row : { true, false }) {
+            auto expected = realize(ref.get(), row);
+            for (int threads : { 1, 3 }) {
+                opt.num_threads = threads;
+                auto values = realize(mat.get(), row);
+                scran_norm::normalize_counts_dense_inplace<double, int>(nr, nc, values.data(), row, size_factors, opt);
+                EXPECT_EQ(values, expected);
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsInplaceTest, Sparse) {
+    int nc = size_factors.size();
+    tatami::DenseRowMatrix<double, int> dmat(nr, nc, dense_values);
+
+    for (auto preserve : { false, true }) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.preserve_sparsity = preserve;
+        opt.pseudo_count = (preserve ? 3 : 1);
+
+        for (auto row : { true, false }) {
+            auto smat = tatami::convert_to_compressed_sparse(&dmat, row);
+            auto ref = scran_norm::normalize_counts(smat, size_factors, opt);
+
+            // Constructing the compressed sparse buffers from the sparse extractor.
+            int primary = (row ? nr : nc);
+            int secondary = (row ? nc : nr);
+            std::vector<double> values, expected_values;
+            std::vector<int> indices;
+            std::vector<size_t> pointers(1);
+            {
+                auto ext = smat->sparse(row, tatami::Options());
+                auto rext = ref->sparse(row, tatami::Options());
+                std::vector<double> vbuffer(secondary);
+                std::vector<int> ibuffer(secondary);
+                for (int p = 0; p < primary; ++p) {
+                    auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+                    values.insert(values.end(), range.value, range.value + range.number);
+                    indices.insert(indices.end(), range.index, range.index + range.number);
+                    pointers.push_back(values.size());
+                    auto rrange = rext->fetch(p, vbuffer.data(), ibuffer.data());
+                    expected_values.insert(expected_values.end(), rrange.value, rrange.value + rrange.number);
+                }
+            }
+
+            for (int threads : { 1, 3 }) {
+                opt.num_threads = threads;
+                auto copy = values;
+                scran_norm::normalize_counts_sparse_inplace<double, int>(nr, nc, copy.data(), indices.data(), pointers.data(), row, size_factors, opt);
+                EXPECT_EQ(copy, expected_values);
+            }
+        }
+    }
+}
+
+TEST_F(NormalizeCountsInplaceTest, Errors) {
+    int nc = size_factors.size();
+    std::vector<double> values(dense_values);
+    std::vector<int> indices(1);
+    std::vector<size_t> pointers(nr + 1);
+
+    scran_norm::NormalizeCountsOptions opt;
+    scran_tests::expect_error([&]() {
+        scran_norm::normalize_counts_dense_inplace<double, int>(nr, nc - 1, values.data(), true, size_factors, opt);
+    }, "length");
+
+    opt.pseudo_count = 2;
+    scran_tests::expect_error([&]() {
+        scran_norm::normalize_counts_sparse_inplace<double, int>(nr, nc, values.data(), indices.data(), pointers.data(), true, size_factors, opt);
+    }, "preserve sparsity");
+}
+
+TEST_F(NormalizeCountsInplaceTest, ApproximateLog) {
+    int nc = size_factors.size();
+    std::shared_ptr<tatami::Matrix<double, int> > mat(new tatami::DenseRowMatrix<double, int>(nr, nc, dense_values));
+
+    for (auto pseudo : { 1.0, 2.5 }) {
+        scran_norm::NormalizeCountsOptions opt;
+        opt.pseudo_count = pseudo;
+        opt.approximate_log = true;
+        auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+        auto expected = realize(ref.get(), false);
+        auto values = realize(mat.get(), false);
+        scran_norm::normalize_counts_dense_inplace<double, int>(nr, nc, values.data(), false, size_factors, opt);
+        EXPECT_EQ(values, expected);
+
+        opt.approximate_log = false;
+        auto exact = realize(scran_norm::normalize_counts(mat, size_factors, opt).get(), false);
+        for (size_t i = 0; i < values.size(); ++i) {
+            EXPECT_LT(std::abs(exact[i] - values[i]), 1e-5 / std::log(2.0));
+        }
+    }
+}
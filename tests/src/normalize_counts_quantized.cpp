@@ -0,0 +1,166 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+
+#include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
+
+#include "scran_norm/normalize_counts_quantized.hpp"
+
+class NormalizeCountsQuantizedTest : public ::testing::Test {
+protected:
+    inline static std::vector<double> size_factors;
+    inline static std::shared_ptr<tatami::Matrix<double, int> > mat;
+
+    static void SetUpTestSuite() {
+        size_factors = scran_tests::simulate_vector(77, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 2;
+            sparams.seed = 1111;
+            return sparams;
+        }());
+
+        size_t nr = 61;
+        auto vec = scran_tests::simulate_vector(nr * size_factors.size(), []{
+            scran_tests::SimulationParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 50;
+            sparams.seed = 2222;
+            return sparams;
+        }());
+
+        tatami::DenseRowMatrix<double, int> dmat(nr, size_factors.size(), std::move(vec));
+        mat = tatami::convert_to_compressed_sparse(&dmat, false);
+    }
+
+    template<typename Code_>
+    static void compare(const tatami::Matrix<double, int>* ref, const scran_norm::QuantizedNormalizedCounts<Code_, int>& quantized, bool row) {
+        EXPECT_EQ(quantized.row, row);
+        int NR = ref->nrow(), NC = ref->ncol();
+        ASSERT_EQ(quantized.pointers.size(), static_cast<size_t>(row ? NR : NC) + 1);
+        EXPECT_EQ(quantized.pointers.back(), quantized.codes.size());
+        EXPECT_EQ(quantized.pointers.back(), quantized.indices.size());
+
+        auto decoded = scran_norm::dequantize_normalized_counts(NR, NC, quantized);
+        EXPECT_TRUE(decoded->is_sparse());
+
+        bool per_column = quantized.scales.size() != 1;
+        for (int r = 0; r < NR; ++r) {
+            for (int c = 0; c < NC; ++c) {
+                double expected = ref->get(r, c);
+                double observed = decoded->get(r, c);
+                double scale = quantized.scales[per_column ? c : 0];
+                EXPECT_LE(std::abs(expected - observed), scale / 2 * (1 + 1e-8));
+                if (expected == 0) {
+                    EXPECT_EQ(observed, 0);
+                }
+            }
+        }
+    }
+};
+
+TEST_F(NormalizeCountsQuantizedTest, Basic) {
+    scran_norm::NormalizeCountsOptions opt;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    auto realized = scran_norm::normalize_counts_realized(*mat, size_factors, false, opt);
+
+    for (auto row : { true, false }) {
+        auto out = scran_norm::normalize_counts_quantized(*mat, size_factors, row, opt);
+        ASSERT_EQ(out.scales.size(), 1);
+        compare(ref.get(), out, row);
+
+        // Largest value is mapped to the largest code.
+        EXPECT_EQ(*std::max_element(out.codes.begin(), out.codes.end()), std::numeric_limits<uint16_t>::max());
+        scran_tests::compare_almost_equal(out.scales.front() * std::numeric_limits<uint16_t>::max(), *std::max_element(realized.values.begin(), realized.values.end()));
+
+        // Same structure as the unquantized matrix.
+        if (!row) {
+            EXPECT_EQ(out.indices, realized.indices);
+            EXPECT_EQ(out.pointers, realized.pointers);
+        }
+
+        opt.num_threads = 3;
+        auto pout = scran_norm::normalize_counts_quantized(*mat, size_factors, row, opt);
+        EXPECT_EQ(out.codes, pout.codes);
+        EXPECT_EQ(out.indices, pout.indices);
+        EXPECT_EQ(out.pointers, pout.pointers);
+        EXPECT_EQ(out.scales, pout.scales);
+        opt.num_threads = 1;
+    }
+}
+
+TEST_F(NormalizeCountsQuantizedTest, PerColumn) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = 2;
+    opt.preserve_sparsity = true;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+
+    scran_norm::NormalizeCountsQuantizedOptions qopt;
+    qopt.per_column_scale = true;
+    for (auto row : { true, false }) {
+        auto out = scran_norm::normalize_counts_quantized(*mat, size_factors, row, opt, qopt);
+        ASSERT_EQ(out.scales.size(), size_factors.size());
+        compare(ref.get(), out, row);
+
+        opt.num_threads = 2;
+        auto pout = scran_norm::normalize_counts_quantized(*mat, size_factors, row, opt, qopt);
+        EXPECT_EQ(out.codes, pout.codes);
+        EXPECT_EQ(out.scales, pout.scales);
+        opt.num_threads = 1;
+    }
+
+    // Each column's scale is at least as precise as the global scale.
+    auto global = scran_norm::normalize_counts_quantized(*mat, size_factors, false, opt);
+    auto percol = scran_norm::normalize_counts_quantized(*mat, size_factors, false, opt, qopt);
+    for (auto s : percol.scales) {
+        EXPECT_LE(s, global.scales.front() * (1 + 1e-8));
+    }
+}
+
+TEST_F(NormalizeCountsQuantizedTest, EightBit) {
+    scran_norm::NormalizeCountsOptions opt;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    for (auto row : { true, false }) {
+        auto out = scran_norm::normalize_counts_quantized<uint8_t>(*mat, size_factors, row, opt);
+        compare(ref.get(), out, row);
+    }
+
+    // Works without log-transformation.
+    opt.log = false;
+    ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    auto out = scran_norm::normalize_counts_quantized<uint8_t>(*mat, size_factors, true, opt);
+    compare(ref.get(), out, true);
+}
+
+TEST_F(NormalizeCountsQuantizedTest, Empty) {
+    // Columns with all-zero counts get a unit scale.
+    std::vector<double> zeros(10 * 5);
+    zeros[3] = 5;
+    std::shared_ptr<tatami::Matrix<double, int> > zmat(new tatami::DenseRowMatrix<double, int>(10, 5, std::move(zeros)));
+    std::vector<double> sf(5, 1);
+
+    scran_norm::NormalizeCountsQuantizedOptions qopt;
+    qopt.per_column_scale = true;
+    auto out = scran_norm::normalize_counts_quantized(*zmat, sf, false, scran_norm::NormalizeCountsOptions(), qopt);
+    EXPECT_EQ(out.scales[0], 1);
+    EXPECT_NE(out.scales[3], 1);
+    EXPECT_EQ(out.codes.size(), 1);
+}
+
+TEST_F(NormalizeCountsQuantizedTest, Errors) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = 3;
+    scran_tests::expect_error([&]() {
+        scran_norm::normalize_counts_quantized(*mat, size_factors, false, opt);
+    }, "preserve sparsity");
+
+    auto out = scran_norm::normalize_counts_quantized(*mat, size_factors, false, scran_norm::NormalizeCountsOptions());
+    out.scales.resize(2);
+    scran_tests::expect_error([&]() {
+        scran_norm::dequantize_normalized_counts(mat->nrow(), mat->ncol(), out);
+    }, "length of 'scales'");
+}
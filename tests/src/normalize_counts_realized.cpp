@@ -0,0 +1,179 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <vector>
+
+#include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
+
+#include "scran_norm/normalize_counts_realized.hpp"
+
+class NormalizeCountsRealizedTest : public ::testing::Test {
+protected:
+    inline static std::vector<double> size_factors;
+    inline static std::shared_ptr<tatami::Matrix<double, int> > mat;
+
+    static void SetUpTestSuite() {
+        size_factors = scran_tests::simulate_vector(87, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 2;
+            sparams.seed = 4242;
+            return sparams;
+        }());
+
+        size_t nr = 53;
+        auto vec = scran_tests::simulate_vector(nr * size_factors.size(), []{
+            scran_tests::SimulationParameters sparams;
+            sparams.density = 0.2;
+            sparams.lower = 1;
+            sparams.upper = 10;
+            sparams.seed = 6969;
+            return sparams;
+        }());
+
+        tatami::DenseRowMatrix<double, int> dmat(nr, size_factors.size(), std::move(vec));
+        mat = tatami::convert_to_compressed_sparse(&dmat, false);
+    }
+
+    template<typename Value_>
+    static void compare(const tatami::Matrix<Value_, int>* ref, bool row, const scran_norm::RealizedNormalizedCounts<Value_, int>& obs) {
+        EXPECT_EQ(obs.row, row);
+        int primary = (row ? ref->nrow() : ref->ncol());
+        int secondary = (row ? ref->ncol() : ref->nrow());
+        ASSERT_EQ(obs.pointers.size(), static_cast<size_t>(primary) + 1);
+        EXPECT_EQ(obs.pointers.back(), obs.values.size());
+        EXPECT_EQ(obs.pointers.back(), obs.indices.size());
+
+        tatami::Options opt;
+        auto ext = ref->sparse(row, opt);
+        std::vector<Value_> vbuffer(secondary);
+        std::vector<int> ibuffer(secondary);
+        for (int p = 0; p < primary; ++p) {
+            auto range = ext->fetch(p, vbuffer.data(), ibuffer.data());
+            std::vector<Value_> expected_values(range.value, range.value + range.number);
+            std::vector<int> expected_indices(range.index, range.index + range.number);
+            std::vector<Value_> observed_values(obs.values.begin() + obs.pointers[p], obs.values.begin() + obs.pointers[p + 1]);
+            std::vector<int> observed_indices(obs.indices.begin() + obs.pointers[p], obs.indices.begin() + obs.pointers[p + 1]);
+            EXPECT_EQ(expected_values, observed_values);
+            EXPECT_EQ(expected_indices, observed_indices);
+        }
+    }
+};
+
+TEST_F(NormalizeCountsRealizedTest, Basic) {
+    scran_norm::NormalizeCountsOptions opt;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+
+    for (auto row : { true, false }) {
+        auto out = scran_norm::normalize_counts_realized(*mat, size_factors, row, opt);
+        compare(ref.get(), row, out);
+
+        opt.num_threads = 3;
+        auto pout = scran_norm::normalize_counts_realized(*mat, size_factors, row, opt);
+        compare(ref.get(), row, pout);
+        opt.num_threads = 1;
+    }
+}
+
+TEST_F(NormalizeCountsRealizedTest, PseudoCount) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.pseudo_count = 2.5;
+    scran_tests::expect_error([&]() { scran_norm::normalize_counts_realized(*mat, size_factors, false, opt); }, "sparsity");
+
+    opt.preserve_sparsity = true;
+    opt.num_threads = 2;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    auto out = scran_norm::normalize_counts_realized(*mat, size_factors, true, opt);
+    compare(ref.get(), true, out);
+
+    // Pseudo-count is ignored without the log-transformation.
+    opt.log = false;
+    opt.preserve_sparsity = false;
+    ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    out = scran_norm::normalize_counts_realized(*mat, size_factors, false, opt);
+    compare(ref.get(), false, out);
+}
+
+TEST_F(NormalizeCountsRealizedTest, Float) {
+    scran_norm::NormalizeCountsOptions opt;
+    auto ref = scran_norm::normalize_counts<float>(mat, size_factors, opt);
+    opt.num_threads = 4;
+    auto out = scran_norm::normalize_counts_realized<float>(*mat, size_factors, true, opt);
+    compare(ref.get(), true, out);
+}
+
+TEST_F(NormalizeCountsRealizedTest, ApproximateLog) {
+    scran_norm::NormalizeCountsOptions opt;
+    opt.approximate_log = true;
+    opt.num_threads = 2;
+    auto ref = scran_norm::normalize_counts(mat, size_factors, opt);
+    auto out = scran_norm::normalize_counts_realized(*mat, size_factors, false, opt);
+    compare(ref.get(), false, out);
+
+    opt.approximate_log = false;
+    auto exact = scran_norm::normalize_counts_realized(*mat, size_factors, false, opt);
+    ASSERT_EQ(exact.values.size(), out.values.size());
+    for (size_t i = 0; i < out.values.size(); ++i) {
+        EXPECT_LT(std::abs(exact.values[i] - out.values[i]), 1e-5 / std::log(2.0));
+    }
+}
+
+TEST_F(NormalizeCountsRealizedTest, DenseInput) {
+    // Explicit zeros in a dense matrix should not be stored.
+    auto dense = tatami::convert_to_dense(mat.get(), true);
+    scran_norm::NormalizeCountsOptions opt;
+
+    for (auto row : { true, false }) {
+        for (int threads : { 1, 3 }) {
+            opt.num_threads = threads;
+            auto ref = scran_norm::normalize_counts_realized(*mat, size_factors, row, opt);
+            auto out = scran_norm::normalize_counts_realized(*dense, size_factors, row, opt);
+            EXPECT_EQ(out.values, ref.values);
+            EXPECT_EQ(out.indices, ref.indices);
+            EXPECT_EQ(out.pointers, ref.pointers);
+        }
+    }
+}
+
+TEST_F(NormalizeCountsRealizedTest, Multiple) {
+    // Creating a smaller second modality for the same cells.
+    size_t nc = size_factors.size();
+    auto vec = scran_tests::simulate_vector(5 * nc, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.density = 0.5;
+        sparams.lower = 1;
+        sparams.upper = 100;
+        sparams.seed = 123;
+        return sparams;
+    }());
+    tatami::DenseRowMatrix<double, int> dmat(5, nc, std::move(vec));
+    auto small = tatami::convert_to_compressed_sparse(&dmat, true);
+    auto small_sf = size_factors;
+    std::reverse(small_sf.begin(), small_sf.end());
+
+    std::vector<const tatami::Matrix<double, int>*> all_counts{ mat.get(), small.get() };
+    std::vector<std::vector<double> > all_sf{ size_factors, small_sf };
+    std::vector<scran_norm::NormalizeCountsOptions> all_opt(2);
+    all_opt[1].pseudo_count = 3;
+    all_opt[1].preserve_sparsity = true;
+
+    for (auto row : { true, false }) {
+        for (int threads : { 1, 2, 5 }) {
+            auto out = scran_norm::normalize_counts_realized_multiple(all_counts, all_sf, row, all_opt, threads);
+            ASSERT_EQ(out.size(), 2);
+            for (size_t m = 0; m < 2; ++m) {
+                auto ref = scran_norm::normalize_counts_realized(*(all_counts[m]), all_sf[m], row, all_opt[m]);
+                EXPECT_EQ(out[m].row, row);
+                EXPECT_EQ(out[m].values, ref.values);
+                EXPECT_EQ(out[m].indices, ref.indices);
+                EXPECT_EQ(out[m].pointers, ref.pointers);
+            }
+        }
+    }
+
+    all_opt[1].preserve_sparsity = false;
+    scran_tests::expect_error([&]() { scran_norm::normalize_counts_realized_multiple(all_counts, all_sf, false, all_opt, 1); }, "sparsity");
+    all_opt.pop_back();
+    scran_tests::expect_error([&]() { scran_norm::normalize_counts_realized_multiple(all_counts, all_sf, false, all_opt, 1); }, "length of 'options'");
+}
@@ -0,0 +1,184 @@
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
+
+#include "scran_norm/persist_normalization.hpp"
+
+class PersistNormalizationTest : public ::testing::Test {
+protected:
+    inline static std::vector<double> size_factors;
+    inline static std::vector<double> block_means;
+    inline static scran_norm::NormalizeCountsOptions options;
+    inline static scran_norm::SizeFactorDiagnostics diagnostics;
+
+    static void SetUpTestSuite() {
+        size_factors = scran_tests::simulate_vector(99, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 2;
+            sparams.seed = 4242;
+            return sparams;
+        }());
+        block_means = std::vector<double>{ 0.5, 1.2, 0.8 };
+
+        options.pseudo_count = 2.5;
+        options.preserve_sparsity = true;
+        options.log_base = 10;
+        options.lookup_table_size = 100;
+        options.num_threads = 3;
+        options.approximate_log = true;
+
+        diagnostics.has_zero = true;
+        diagnostics.has_nan = true;
+    }
+
+    static std::shared_ptr<const std::vector<unsigned char> > persist() {
+        return std::make_shared<std::vector<unsigned char> >(
+            scran_norm::persist_normalization(size_factors.size(), size_factors.data(), diagnostics, block_means.size(), block_means.data(), options)
+        );
+    }
+};
+
+TEST_F(PersistNormalizationTest, Basic) {
+    auto buffer = persist();
+    scran_norm::PersistedNormalization<double> loaded(buffer);
+
+    EXPECT_EQ(loaded.num_cells(), size_factors.size());
+    auto sf = loaded.size_factors();
+    ASSERT_EQ(sf.size(), size_factors.size());
+    EXPECT_EQ(std::vector<double>(sf.begin(), sf.end()), size_factors);
+    EXPECT_EQ(sf[10], size_factors[10]);
+
+    // No copy of the size factors.
+    auto start = reinterpret_cast<const unsigned char*>(sf.begin());
+    EXPECT_GE(start, buffer->data());
+    EXPECT_LT(start, buffer->data() + buffer->size());
+    EXPECT_EQ((start - buffer->data()) % 64, 0);
+
+    ASSERT_EQ(loaded.num_blocks(), block_means.size());
+    EXPECT_EQ(std::vector<double>(loaded.block_means(), loaded.block_means() + loaded.num_blocks()), block_means);
+
+    const auto& diag = loaded.diagnostics();
+    EXPECT_FALSE(diag.has_negative);
+    EXPECT_TRUE(diag.has_zero);
+    EXPECT_TRUE(diag.has_nan);
+    EXPECT_FALSE(diag.has_infinite);
+
+    const auto& opt = loaded.options();
+    EXPECT_EQ(opt.pseudo_count, options.pseudo_count);
+    EXPECT_EQ(opt.preserve_sparsity, options.preserve_sparsity);
+    EXPECT_EQ(opt.log, options.log);
+    EXPECT_EQ(opt.log_base, options.log_base);
+    EXPECT_EQ(opt.size_factor_scale, options.size_factor_scale);
+    EXPECT_EQ(opt.num_threads, options.num_threads);
+    EXPECT_EQ(opt.lookup_table_size, options.lookup_table_size);
+    EXPECT_EQ(opt.precompute_reciprocals, options.precompute_reciprocals);
+    EXPECT_EQ(opt.approximate_log, options.approximate_log);
+}
+
+TEST_F(PersistNormalizationTest, Empty) {
+    auto buffer = scran_norm::persist_normalization(0, static_cast<const float*>(NULL), scran_norm::SizeFactorDiagnostics(), 0, static_cast<const float*>(NULL), scran_norm::NormalizeCountsOptions());
+    scran_norm::PersistedNormalization<float> loaded(std::make_shared<std::vector<unsigned char> >(std::move(buffer)));
+    EXPECT_EQ(loaded.num_cells(), 0);
+    EXPECT_EQ(loaded.size_factors().size(), 0);
+    EXPECT_EQ(loaded.num_blocks(), 0);
+}
+
+TEST_F(PersistNormalizationTest, Normalize) {
+    size_t nr = 23, nc = size_factors.size();
+    auto vec = scran_tests::simulate_vector(nr * nc, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.density = 0.3;
+        sparams.lower = 1;
+        sparams.upper = 20;
+        sparams.seed = 6969;
+        return sparams;
+    }());
+    auto counts = std::shared_ptr<tatami::Matrix<double, int> >(new tatami::DenseRowMatrix<double, int>(nr, nc, std::move(vec)));
+
+    std::weak_ptr<const std::vector<unsigned char> > observer;
+    std::shared_ptr<tatami::Matrix<double, int> > normalized;
+    {
+        auto buffer = persist();
+        observer = buffer;
+        scran_norm::PersistedNormalization<double> loaded(buffer);
+        normalized = scran_norm::normalize_counts(counts, loaded.size_factors(), loaded.options());
+    }
+
+    // Normalized matrix keeps the buffer alive.
+    EXPECT_FALSE(observer.expired());
+
+    auto ref = scran_norm::normalize_counts(counts, size_factors, options);
+    auto rext = ref->dense_row();
+    auto pext = normalized->dense_row();
+    std::vector<double> rbuffer(nc), pbuffer(nc);
+    for (size_t r = 0; r < nr; ++r) {
+        auto rptr = rext->fetch(r, rbuffer.data());
+        auto pptr = pext->fetch(r, pbuffer.data());
+        EXPECT_EQ(std::vector<double>(rptr, rptr + nc), std::vector<double>(pptr, pptr + nc));
+    }
+
+    pext.reset();
+    normalized.reset();
+    EXPECT_TRUE(observer.expired());
+}
+
+TEST_F(PersistNormalizationTest, Errors) {
+    auto buffer = persist();
+
+    scran_tests::expect_error([&]() {
+        scran_norm::PersistedNormalization<float> loaded(buffer);
+    }, "not of the expected type");
+
+    {
+        auto copy = std::make_shared<std::vector<unsigned char> >(*buffer);
+        copy->pop_back();
+        scran_tests::expect_error([&]() {
+            scran_norm::PersistedNormalization<double> loaded(copy);
+        }, "truncated");
+    }
+
+    {
+        auto copy = std::make_shared<std::vector<unsigned char> >(*buffer);
+        copy->push_back(0);
+        scran_tests::expect_error([&]() {
+            scran_norm::PersistedNormalization<double> loaded(copy);
+        }, "trailing");
+    }
+
+    {
+        auto copy = std::make_shared<std::vector<unsigned char> >(*buffer);
+        uint32_t version = scran_norm::persisted_normalization_version + 1;
+        std::memcpy(copy->data() + 2 * sizeof(uint32_t), &version, sizeof(uint32_t));
+        scran_tests::expect_error([&]() {
+            scran_norm::PersistedNormalization<double> loaded(copy);
+        }, "unsupported version");
+    }
+
+    {
+        // Byte-swapping every 32-bit word of the header, as if it were created on an architecture with the other byte order.
+        auto copy = std::make_shared<std::vector<unsigned char> >(*buffer);
+        for (size_t i = 0; i < 3 * sizeof(uint32_t); i += sizeof(uint32_t)) {
+            std::reverse(copy->begin() + i, copy->begin() + i + sizeof(uint32_t));
+        }
+        scran_tests::expect_error([&]() {
+            scran_norm::PersistedNormalization<double> loaded(copy);
+        }, "byte order");
+    }
+
+    {
+        // Shifting the buffer so that the size factors are no longer aligned.
+        auto shifted = std::make_shared<std::vector<unsigned char> >(buffer->size() + 1);
+        std::copy(buffer->begin(), buffer->end(), shifted->begin() + 1);
+        scran_tests::expect_error([&]() {
+            scran_norm::PersistedNormalization<double> loaded(std::shared_ptr<const unsigned char>(shifted, shifted->data() + 1), buffer->size());
+        }, "aligned");
+    }
+}
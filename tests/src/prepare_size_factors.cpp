@@ -0,0 +1,255 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "scran_tests/scran_tests.hpp"
+#include "scran_tests/expect_error.hpp"
+
+#include "scran_norm/prepare_size_factors.hpp"
+
+class PrepareSizeFactorsTest : public ::testing::TestWithParam<std::tuple<bool, int> > {
+protected:
+    static std::vector<double> simulate(size_t n, bool invalid) {
+        auto output = scran_tests::simulate_vector(n, []{
+            scran_tests::SimulationParameters sparams;
+            sparams.lower = 0.1;
+            sparams.upper = 5;
+            sparams.seed = 1357;
+            return sparams;
+        }());
+
+        if (invalid) {
+            for (size_t i = 0; i < n; i += 11) {
+                output[i] = 0;
+            }
+            for (size_t i = 3; i < n; i += 13) {
+                output[i] = -1;
+            }
+            for (size_t i = 5; i < n; i += 17) {
+                output[i] = std::numeric_limits<double>::quiet_NaN();
+            }
+            for (size_t i = 7; i < n; i += 19) {
+                output[i] = std::numeric_limits<double>::infinity();
+            }
+        }
+
+        return output;
+    }
+
+    static scran_norm::PrepareSizeFactorsOptions create_options(int action) {
+        scran_norm::PrepareSizeFactorsOptions opt;
+        auto choice = (action == 0 ? scran_norm::SanitizeAction::IGNORE : scran_norm::SanitizeAction::SANITIZE);
+        opt.sanitize_options.handle_zero = choice;
+        opt.sanitize_options.handle_negative = choice;
+        opt.sanitize_options.handle_nan = choice;
+        opt.sanitize_options.handle_infinite = choice;
+        return opt;
+    }
+
+    static void compare(const std::vector<double>& expected, const std::vector<double>& observed) {
+        ASSERT_EQ(expected.size(), observed.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            if (std::isnan(expected[i])) {
+                EXPECT_TRUE(std::isnan(observed[i]));
+            } else {
+                EXPECT_EQ(expected[i], observed[i]);
+            }
+        }
+    }
+
+    static void compare(const scran_norm::SizeFactorDiagnostics& expected, const scran_norm::SizeFactorDiagnostics& observed) {
+        EXPECT_EQ(expected.has_zero, observed.has_zero);
+        EXPECT_EQ(expected.has_negative, observed.has_negative);
+        EXPECT_EQ(expected.has_nan, observed.has_nan);
+        EXPECT_EQ(expected.has_infinite, observed.has_infinite);
+    }
+};
+
+TEST_P(PrepareSizeFactorsTest, Unblocked) {
+    auto param = GetParam();
+    auto sf = simulate(1000, std::get<0>(param));
+    auto opt = create_options(std::get<1>(param));
+
+    auto ref = sf;
+    auto mean = scran_norm::center_size_factors(ref.size(), ref.data(), NULL, opt.center_options);
+    auto diag = scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+
+    auto obs = sf;
+    auto res = scran_norm::prepare_size_factors(obs.size(), obs.data(), opt);
+    EXPECT_EQ(mean, res.mean);
+    compare(diag, res.diagnostics);
+    compare(ref, obs);
+
+    // Same results without centering.
+    opt.center = false;
+    ref = sf;
+    scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+    obs = sf;
+    res = scran_norm::prepare_size_factors(obs.size(), obs.data(), opt);
+    EXPECT_EQ(res.mean, 1);
+    compare(ref, obs);
+}
+
+TEST_P(PrepareSizeFactorsTest, Blocked) {
+    auto param = GetParam();
+    size_t n = 1000;
+    auto sf = simulate(n, std::get<0>(param));
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 7) % 4;
+    }
+
+    auto opt = create_options(std::get<1>(param));
+    for (auto mode : { scran_norm::CenterBlockMode::PER_BLOCK, scran_norm::CenterBlockMode::LOWEST }) {
+        opt.center_options.block_mode = mode;
+
+        auto ref = sf;
+        auto means = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), NULL, opt.center_options);
+        auto diag = scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+
+        auto obs = sf;
+        auto res = scran_norm::prepare_size_factors_blocked(obs.size(), obs.data(), block.data(), opt);
+        EXPECT_EQ(means, res.block_means);
+        compare(diag, res.diagnostics);
+        compare(ref, obs);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    PrepareSizeFactors,
+    PrepareSizeFactorsTest,
+    ::testing::Combine(
+        ::testing::Values(false, true), // whether to add invalid values.
+        ::testing::Values(0, 1) // whether to ignore or sanitize.
+    )
+);
+
+TEST(PrepareSizeFactors, Errors) {
+    std::vector<double> sf { 1, 2, 0, 3, -1 };
+    scran_norm::PrepareSizeFactorsOptions opt;
+    auto copy = sf;
+    scran_tests::expect_error([&]() { scran_norm::prepare_size_factors(copy.size(), copy.data(), opt); }, "negative");
+    EXPECT_EQ(copy, sf); // no modification on error.
+
+    opt.sanitize_options.handle_negative = scran_norm::SanitizeAction::SANITIZE;
+    scran_tests::expect_error([&]() { scran_norm::prepare_size_factors(copy.size(), copy.data(), opt); }, "zero");
+    EXPECT_EQ(copy, sf);
+}
+
+TEST(PrepareSizeFactors, Fallback) {
+    // Not ignoring invalid values causes the mean to be NaN.
+    std::vector<double> sf { 1, std::numeric_limits<double>::quiet_NaN(), 3, -1 };
+    scran_norm::PrepareSizeFactorsOptions opt;
+    opt.center_options.ignore_invalid = false;
+    opt.sanitize_options.handle_negative = scran_norm::SanitizeAction::SANITIZE;
+    opt.sanitize_options.handle_nan = scran_norm::SanitizeAction::SANITIZE;
+
+    auto ref = sf;
+    scran_norm::center_size_factors(ref.size(), ref.data(), NULL, opt.center_options);
+    scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+
+    auto obs = sf;
+    auto res = scran_norm::prepare_size_factors(obs.size(), obs.data(), opt);
+    EXPECT_TRUE(std::isnan(res.mean));
+    EXPECT_EQ(ref, obs);
+
+    // Diagnostics describe the input size factors, not the centered values (which are all NaN).
+    auto input_diag = scran_norm::check_size_factor_sanity(sf.size(), sf.data());
+    auto compare = [](const scran_norm::SizeFactorDiagnostics& expected, const scran_norm::SizeFactorDiagnostics& observed) -> void {
+        EXPECT_EQ(expected.has_zero, observed.has_zero);
+        EXPECT_EQ(expected.has_negative, observed.has_negative);
+        EXPECT_EQ(expected.has_nan, observed.has_nan);
+        EXPECT_EQ(expected.has_infinite, observed.has_infinite);
+    };
+    compare(input_diag, res.diagnostics);
+    EXPECT_TRUE(res.diagnostics.has_negative);
+    EXPECT_TRUE(res.diagnostics.has_nan);
+
+    std::vector<int> block{ 0, 1, 0, 1 };
+    obs = sf;
+    auto bres = scran_norm::prepare_size_factors_blocked(obs.size(), obs.data(), block.data(), opt);
+    compare(input_diag, bres.diagnostics);
+}
+
+TEST(PrepareSizeFactors, Large) {
+    // Checking that we get the same results when the centering uses multiple chunks.
+    size_t n = 200000;
+    auto sf = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 5;
+        sparams.seed = 2222;
+        return sparams;
+    }());
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = i % 3;
+    }
+
+    scran_norm::PrepareSizeFactorsOptions opt;
+    auto ref = sf;
+    auto mean = scran_norm::center_size_factors(ref.size(), ref.data(), NULL, opt.center_options);
+    auto obs = sf;
+    auto res = scran_norm::prepare_size_factors(obs.size(), obs.data(), opt);
+    EXPECT_EQ(mean, res.mean);
+    EXPECT_EQ(ref, obs);
+
+    ref = sf;
+    auto means = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), NULL, opt.center_options);
+    obs = sf;
+    auto bres = scran_norm::prepare_size_factors_blocked(obs.size(), obs.data(), block.data(), opt);
+    EXPECT_EQ(means, bres.block_means);
+    EXPECT_EQ(ref, obs);
+}
+
+template<typename SizeFactor_>
+void test_prepare_compensated(SizeFactor_ large) {
+    // Using multiple chunks and invalid values to check that compensation is applied consistently.
+    size_t n = 200000;
+    auto simulated = scran_tests::simulate_vector(n, []{
+        scran_tests::SimulationParameters sparams;
+        sparams.lower = 0.1;
+        sparams.upper = 5;
+        sparams.seed = 3333;
+        return sparams;
+    }());
+    std::vector<SizeFactor_> sf(simulated.begin(), simulated.end());
+    sf[1] = large; // large dynamic range for the compensation to matter.
+    for (size_t i = 0; i < n; i += 101) {
+        sf[i] = 0;
+    }
+    std::vector<int> block(n);
+    for (size_t i = 0; i < n; ++i) {
+        block[i] = (i * 5) % 3;
+    }
+
+    scran_norm::PrepareSizeFactorsOptions opt;
+    opt.center_options.compensated_sum = true;
+    opt.sanitize_options.handle_zero = scran_norm::SanitizeAction::SANITIZE;
+
+    auto ref = sf;
+    auto mean = scran_norm::center_size_factors(ref.size(), ref.data(), NULL, opt.center_options);
+    scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+    auto obs = sf;
+    auto res = scran_norm::prepare_size_factors(obs.size(), obs.data(), opt);
+    EXPECT_EQ(mean, res.mean);
+    EXPECT_EQ(ref, obs);
+
+    for (auto mode : { scran_norm::CenterBlockMode::PER_BLOCK, scran_norm::CenterBlockMode::LOWEST }) {
+        opt.center_options.block_mode = mode;
+        ref = sf;
+        auto means = scran_norm::center_size_factors_blocked(ref.size(), ref.data(), block.data(), NULL, opt.center_options);
+        scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt.sanitize_options);
+        obs = sf;
+        auto bres = scran_norm::prepare_size_factors_blocked(obs.size(), obs.data(), block.data(), opt);
+        EXPECT_EQ(means, bres.block_means);
+        EXPECT_EQ(ref, obs);
+    }
+}
+
+TEST(PrepareSizeFactors, Compensated) {
+    test_prepare_compensated<float>(1e7);
+    test_prepare_compensated<double>(1e12);
+}
@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <vector>
 
 #include "scran_tests/expect_error.hpp"
@@ -174,3 +176,82 @@ TEST(SanitizeSizeFactors, Missings) {
     ref.back() = 1;
     EXPECT_EQ(copy, ref);
 }
+
+TEST(SanitizeSizeFactors, Precomputed) {
+    std::vector<double> sf { 0.5, 0, 0.3, -1, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN(), 2 };
+    auto status = scran_norm::check_size_factor_sanity(sf.size(), sf.data());
+
+    scran_norm::SanitizeSizeFactorsOptions opt;
+    opt.handle_zero = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_negative = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_infinite = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_nan = scran_norm::SanitizeAction::SANITIZE;
+
+    auto copy = sf;
+    scran_norm::sanitize_size_factors(copy.size(), copy.data(), status, 0.1, 5.0, opt);
+    std::vector<double> expected { 0.5, 0.1, 0.3, 0.1, 5, 1, 2 };
+    EXPECT_EQ(copy, expected);
+
+    // Only the requested replacements are performed.
+    opt.handle_infinite = scran_norm::SanitizeAction::IGNORE;
+    copy = sf;
+    scran_norm::sanitize_size_factors(copy.size(), copy.data(), status, 0.1, 5.0, opt);
+    EXPECT_TRUE(std::isinf(copy[4]));
+
+    // Errors are thrown even if the chunk doesn't contain the invalid value.
+    opt.handle_zero = scran_norm::SanitizeAction::ERROR;
+    scran_tests::expect_error([&]() {
+        scran_norm::sanitize_size_factors(1, copy.data(), status, 0.1, 5.0, opt);
+    }, "zero");
+}
+
+TEST(SanitizeSizeFactors, Parallel) {
+    std::vector<double> sf(1001);
+    for (size_t i = 0; i < sf.size(); ++i) {
+        switch (i % 7) {
+            case 0: sf[i] = 0; break;
+            case 1: sf[i] = -1; break;
+            case 2: sf[i] = std::numeric_limits<double>::infinity(); break;
+            case 3: sf[i] = std::numeric_limits<double>::quiet_NaN(); break;
+            default: sf[i] = 0.5 + static_cast<double>(i) / sf.size();
+        }
+    }
+
+    scran_norm::SanitizeSizeFactorsOptions opt;
+    opt.handle_zero = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_negative = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_infinite = scran_norm::SanitizeAction::SANITIZE;
+    opt.handle_nan = scran_norm::SanitizeAction::SANITIZE;
+
+    auto ref = sf;
+    auto ref_status = scran_norm::sanitize_size_factors(ref.size(), ref.data(), opt);
+    EXPECT_TRUE(ref_status.has_zero);
+    EXPECT_TRUE(ref_status.has_negative);
+    EXPECT_TRUE(ref_status.has_infinite);
+    EXPECT_TRUE(ref_status.has_nan);
+    EXPECT_EQ(ref[0], ref[4]); // smallest valid value.
+    EXPECT_EQ(ref[1], ref[4]);
+    EXPECT_EQ(ref[2], *std::max_element(ref.begin(), ref.end()));
+    EXPECT_EQ(ref[3], 1);
+
+    opt.num_threads = 3;
+    auto par = sf;
+    auto par_status = scran_norm::sanitize_size_factors(par.size(), par.data(), opt);
+    EXPECT_EQ(ref, par);
+    EXPECT_TRUE(par_status.has_zero);
+    EXPECT_TRUE(par_status.has_negative);
+    EXPECT_TRUE(par_status.has_infinite);
+    EXPECT_TRUE(par_status.has_nan);
+
+    par = sf;
+    scran_norm::sanitize_size_factors(par.size(), par.data(), ref_status, opt);
+    EXPECT_EQ(ref, par);
+
+    // Errors are thrown before any modification.
+    opt.handle_nan = scran_norm::SanitizeAction::ERROR;
+    par = sf;
+    scran_tests::expect_error([&]() {
+        scran_norm::sanitize_size_factors(par.size(), par.data(), opt);
+    }, "NaN");
+    EXPECT_EQ(par[0], 0);
+}